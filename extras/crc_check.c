@@ -0,0 +1,126 @@
+/* Host check and benchmark of the sdEmmc_crc kernels.
+ *
+ * Checks the values given in sdEmmc_crc.h for each kernel, checks that the
+ * kernels agree on random data split at random points, then times them:
+ *
+ *     cc -O2 -I. extras/crc_check.c sdEmmc_crc.c -o crc_check && ./crc_check
+ *
+ * Add -DSDEMMC_CONFIG_LOW_MEMORY=1 to check the nibble CRC-32C kernel.
+ * Exits with 1 if a check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sdEmmc_crc.h"
+
+typedef uint16_t (*crc16_fn_t)(uint16_t crc, const void* data, size_t len);
+
+static const struct {
+    const char* name;
+    crc16_fn_t fn;
+} s_crc16_kernels[] = {
+#if SDEMMC_CRC_TABLES
+    { "crc16_slice8", sdEmmc_crc16_slice8 },
+    { "crc16_slice4", sdEmmc_crc16_slice4 },
+#endif
+    { "crc16_nibble", sdEmmc_crc16_nibble },
+    { "crc16", sdEmmc_crc16 },
+};
+
+#define KERNEL_COUNT    (sizeof(s_crc16_kernels) / sizeof(s_crc16_kernels[0]))
+
+static int s_failures;
+
+static void check(const char* what, uint32_t got, uint32_t expected)
+{
+    if (got != expected) {
+        printf("FAIL %s: 0x%x, expected 0x%x\n", what, got, expected);
+        s_failures++;
+    }
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* name, size_t bytes, double seconds)
+{
+    printf("%-14s %8.1f MB/s\n", name, bytes / seconds / 1e6);
+}
+
+int main(void)
+{
+    static const uint8_t cmd0[5] = { 0x40, 0x00, 0x00, 0x00, 0x00 };
+    static uint8_t block[512];
+    static uint8_t data[64 * 1024];
+    char what[64];
+
+    /* values from sdEmmc_crc.h */
+    memset(block, 0xff, sizeof(block));
+    check("crc32c(\"123456789\")", sdEmmc_crc32c(0, "123456789", 9), 0xe3069283);
+    check("crc7(\"123456789\")", sdEmmc_crc7("123456789", 9), 0x75);
+    check("crc7(CMD0)", sdEmmc_crc7(cmd0, sizeof(cmd0)), 0x4a);
+    for (size_t k = 0; k < KERNEL_COUNT; ++k) {
+        snprintf(what, sizeof(what), "%s(\"123456789\")", s_crc16_kernels[k].name);
+        check(what, s_crc16_kernels[k].fn(0, "123456789", 9), 0x31c3);
+        snprintf(what, sizeof(what), "%s(512 x 0xff)", s_crc16_kernels[k].name);
+        check(what, s_crc16_kernels[k].fn(0, block, sizeof(block)), 0x7fa1);
+    }
+
+    /* chained calls over random data, split anywhere, give the one-shot result */
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = rand();
+    }
+    uint32_t crc32c = sdEmmc_crc32c(0, data, sizeof(data));
+    uint16_t crc16 = s_crc16_kernels[KERNEL_COUNT - 1].fn(0, data, sizeof(data));
+    for (int i = 0; i < 100; ++i) {
+        size_t split = rand() % sizeof(data);
+        check("crc32c chained", sdEmmc_crc32c(sdEmmc_crc32c(0, data, split),
+                data + split, sizeof(data) - split), crc32c);
+        for (size_t k = 0; k < KERNEL_COUNT; ++k) {
+            snprintf(what, sizeof(what), "%s chained", s_crc16_kernels[k].name);
+            crc16_fn_t fn = s_crc16_kernels[k].fn;
+            check(what, fn(fn(0, data, split), data + split, sizeof(data) - split), crc16);
+        }
+    }
+    if (s_failures != 0) {
+        printf("%d checks failed\n", s_failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+
+    /* throughput over 512 byte blocks, as the driver uses them */
+    const int rounds = 256;
+    const size_t bytes = (size_t) rounds * sizeof(data);
+    volatile uint32_t sink = 0;
+    double t0 = now_s();
+    for (int r = 0; r < rounds; ++r) {
+        for (size_t off = 0; off < sizeof(data); off += 512) {
+            sink += sdEmmc_crc32c(0, data + off, 512);
+        }
+    }
+    report("crc32c", bytes, now_s() - t0);
+    t0 = now_s();
+    for (int r = 0; r < rounds; ++r) {
+        for (size_t off = 0; off < sizeof(data); off += 512) {
+            sink += sdEmmc_crc7(data + off, 512);
+        }
+    }
+    report("crc7", bytes, now_s() - t0);
+    for (size_t k = 0; k < KERNEL_COUNT; ++k) {
+        t0 = now_s();
+        for (int r = 0; r < rounds; ++r) {
+            for (size_t off = 0; off < sizeof(data); off += 512) {
+                sink += s_crc16_kernels[k].fn(0, data + off, 512);
+            }
+        }
+        report(s_crc16_kernels[k].name, bytes, now_s() - t0);
+    }
+    (void) sink;
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Worst case stack of the driver's public functions.
+
+Reads the .ci files GCC writes with -fcallgraph-info=su and sums frame sizes
+along the deepest call chain below each public (sdEmmc_*) function. Calls
+through function pointers (the host's do_transaction, completion callbacks)
+and functions outside the driver (logging, libc, ESP-IDF) count as 0 bytes.
+A function may appear twice on a chain: the metadata writes of sdEmmc_sparse,
+sdEmmc_integrity and sdEmmc_journal re-enter the write path once.
+
+    for f in *.c; do $CC $CFLAGS -Os -fcallgraph-info=su -c $f; done
+    python3 extras/stack_usage.py *.ci
+
+$CFLAGS holds the include paths of the Arduino-ESP32 core; the .o and .ci
+files land in the current directory.
+"""
+import re
+import sys
+
+NODE = re.compile(r'node: \{ title: "([^"]+)" label: "[^"\\]*\\n[^"\\]*(?:\\n(\d+) bytes)?')
+EDGE = re.compile(r'edge: \{ sourcename: "([^"]+)" targetname: "([^"]+)"')
+MAX_VISITS = 2
+
+
+def load(paths):
+    frame, calls = {}, {}
+    for path in paths:
+        with open(path) as f:
+            text = f.read()
+        for name, size in NODE.findall(text):
+            if size:
+                frame[name] = int(size)
+        for src, dst in EDGE.findall(text):
+            calls.setdefault(src, set()).add(dst)
+    return frame, calls
+
+
+def depth(fn, frame, calls, path):
+    if path.count(fn) >= MAX_VISITS:
+        return 0
+    path.append(fn)
+    below = max((depth(c, frame, calls, path) for c in calls.get(fn, ())), default=0)
+    path.pop()
+    return frame.get(fn, 0) + below
+
+
+def main():
+    frame, calls = load(sys.argv[1:])
+    public = sorted(n for n in frame if n.startswith("sdEmmc_") and ":" not in n)
+    for fn in public:
+        print("%-40s %5d" % (fn, depth(fn, frame, calls, [])))
+
+
+if __name__ == "__main__":
+    main()
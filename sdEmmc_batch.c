@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "esp32-hal-log.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_batch.h"
+
+static int batch_compare(const void* a, const void* b)
+{
+    const sdEmmc_req_t* x = (const sdEmmc_req_t*) a;
+    const sdEmmc_req_t* y = (const sdEmmc_req_t*) b;
+    if (x->sector != y->sector) {
+        return (x->sector < y->sector) ? -1 : 1;
+    }
+    return (int) x->is_write - (int) y->is_write;
+}
+
+static esp_err_t batch_transfer(sdmmc_card_t* card, const sdEmmc_req_t* req)
+{
+    return req->is_write ? sdEmmc_write_sectors(card, req->buf, req->sector, req->count) :
+            sdEmmc_read_sectors(card, req->buf, req->sector, req->count);
+}
+
+static void batch_complete(sdEmmc_req_t* req, esp_err_t err)
+{
+    req->err = err;
+    if (req->done) {
+        req->done(req->ctx, err);
+    }
+}
+
+esp_err_t sdEmmc_submit_batch(sdmmc_card_t* card, sdEmmc_req_t* reqs, size_t n)
+{
+    qsort(reqs, n, sizeof(*reqs), &batch_compare);
+
+    esp_err_t first_err = ESP_OK;
+    size_t transfers = 0;
+    size_t i = 0;
+    while (i < n) {
+        /* zero length requests complete at once */
+        if (reqs[i].count == 0) {
+            batch_complete(&reqs[i++], ESP_OK);
+            continue;
+        }
+        sdmmc_segment_t segs[SDEMMC_BATCH_MAX_MERGE];
+        sdEmmc_merge_t merge;
+        sdEmmc_merge_init(&merge, card, segs, SDEMMC_BATCH_MAX_MERGE, SIZE_MAX);
+        size_t j = i;
+        while (j < n && reqs[j].count != 0 &&
+               sdEmmc_merge_add(&merge, reqs[j].is_write, reqs[j].sector, reqs[j].count, reqs[j].buf)) {
+            ++j;
+        }
+        esp_err_t err = sdEmmc_merge_transfer(card, &merge);
+        ++transfers;
+        if (err == ESP_OK) {
+            for (size_t k = i; k < j; ++k) {
+                batch_complete(&reqs[k], ESP_OK);
+            }
+        } else if (j - i == 1) {
+            batch_complete(&reqs[i], err);
+        } else {
+            log_w( "%s: merged transfer %d+%d failed (0x%x), retrying %d requests",
+                    __func__, merge.start_sector, merge.sector_count, err, j - i);
+            sdEmmc_recover(card);
+            for (size_t k = i; k < j; ++k) {
+                esp_err_t req_err = batch_transfer(card, &reqs[k]);
+                ++transfers;
+                if (req_err != ESP_OK) {
+                    sdEmmc_recover(card);
+                }
+                batch_complete(&reqs[k], req_err);
+            }
+        }
+        for (size_t k = i; k < j; ++k) {
+            if (first_err == ESP_OK && reqs[k].err != ESP_OK) {
+                first_err = reqs[k].err;
+            }
+        }
+        i = j;
+    }
+    log_v( "%s: %d requests in %d transfers", __func__, n, transfers);
+    return first_err;
+}
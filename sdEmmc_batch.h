@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Batched sector I/O
+ *
+ * A batch is an array of independent read and write requests. The requests
+ * are sorted by sector, and runs of requests in the same direction which
+ * continue each other are merged into one multi-block transfer through
+ * sdEmmc_write_sectorsv / sdEmmc_read_sectorsv, so the card is busy-waited
+ * once per run rather than once per request. If a merged run fails, its
+ * requests are recovered and retried one by one, so that one bad request
+ * doesn't fail its neighbours.
+ */
+
+#define SDEMMC_BATCH_MAX_MERGE  16      // Max buffer segments of one merged transfer; requests contiguous in memory share one
+
+/**
+ * One request of a batch
+ */
+typedef struct {
+    bool is_write;              /*!< true to write buf to the card, false to read into it */
+    size_t sector;              /*!< first sector */
+    size_t count;               /*!< number of sectors */
+    void* buf;                  /*!< count sectors of data; DMA capable, word aligned buffers avoid a copy */
+    void (*done)(void* ctx, esp_err_t err); /*!< called when the request completes; may be NULL */
+    void* ctx;                  /*!< argument of done */
+    esp_err_t err;              /*!< result, set before done is called */
+} sdEmmc_req_t;
+
+/**
+ * Execute a batch of requests
+ *
+ * Requests complete in sector order; done is called for each as soon as its
+ * transfer has finished, written data being programmed. Overlapping requests
+ * are executed in unspecified order.
+ *
+ * @param card  card initialized using sdEmmc_card_init
+ * @param reqs  requests; the array is sorted in place
+ * @param n  number of requests
+ * @return
+ *      - ESP_OK if all requests succeeded
+ *      - Error of the first request which failed, in sector order
+ */
+esp_err_t sdEmmc_submit_batch(sdmmc_card_t* card, sdEmmc_req_t* reqs, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,129 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_clock.h"
+#include "sys/param.h"
+
+#define CLOCK_DEFAULT_WINDOW        256
+#define CLOCK_DEFAULT_MAX_ERRORS    2
+#define CLOCK_DEFAULT_CLEAN_WINDOWS 16
+#define CLOCK_MAX_BACKOFF           64
+
+static const uint32_t s_default_steps_khz[] = { 40000, 26000, 20000, 10000 };
+
+esp_err_t sdEmmc_clock_attach(sdmmc_card_t* card, sdEmmc_clock_t* clk,
+        const sdEmmc_clock_config_t* config)
+{
+    memset(clk, 0, sizeof(*clk));
+    if (config) {
+        clk->config = *config;
+    }
+    sdEmmc_clock_config_t* c = &clk->config;
+    if (c->steps_khz == NULL) {
+        c->steps_khz = s_default_steps_khz;
+        c->step_count = sizeof(s_default_steps_khz) / sizeof(s_default_steps_khz[0]);
+    }
+    if (c->window == 0) {
+        c->window = CLOCK_DEFAULT_WINDOW;
+    }
+    if (c->max_errors == 0) {
+        c->max_errors = CLOCK_DEFAULT_MAX_ERRORS;
+    }
+    if (c->clean_windows == 0) {
+        c->clean_windows = CLOCK_DEFAULT_CLEAN_WINDOWS;
+    }
+
+    /* the clock selected at init is the fastest step; slower table entries follow */
+    clk->steps_khz[0] = card->freq_khz;
+    clk->step_count = 1;
+    for (size_t i = 0; i < c->step_count; ++i) {
+        if (c->steps_khz[i] >= clk->steps_khz[clk->step_count - 1]) {
+            continue;
+        }
+        if (clk->step_count == SDEMMC_CLOCK_MAX_STEPS) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        clk->steps_khz[clk->step_count++] = c->steps_khz[i];
+    }
+    if (clk->step_count == 1) {
+        /* e.g. a card left at 400kHz */
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    clk->backoff = 1;
+    card->clock = clk;
+    log_d( "%s: %d steps from %ukHz to %ukHz", __func__, clk->step_count,
+            clk->steps_khz[0], clk->steps_khz[clk->step_count - 1]);
+    return ESP_OK;
+}
+
+void sdEmmc_clock_detach(sdmmc_card_t* card)
+{
+    card->clock = NULL;
+}
+
+static void clock_set_step(sdmmc_card_t* card, size_t step)
+{
+    sdEmmc_clock_t* clk = card->clock;
+    uint32_t freq_khz = clk->steps_khz[step];
+    esp_err_t err = (*card->host.set_card_clk)(card->host.slot, freq_khz);
+    if (err != ESP_OK) {
+        log_e( "%s: set_card_clk(%u) returned 0x%x", __func__, freq_khz, err);
+        return;
+    }
+    log_w( "%s: card clock %ukHz -> %ukHz", __func__, card->freq_khz, freq_khz);
+    if (step > clk->step) {
+        clk->downshifts++;
+    } else {
+        clk->upshifts++;
+    }
+    clk->step = step;
+    card->freq_khz = freq_khz;
+    sdEmmc_update_timeouts(card);
+}
+
+void sdEmmc_clock_on_cmd(sdmmc_card_t* card, esp_err_t err)
+{
+    sdEmmc_clock_t* clk = card->clock;
+    const sdEmmc_clock_config_t* c = &clk->config;
+    if (err == ESP_ERR_INVALID_CRC || err == ESP_ERR_TIMEOUT) {
+        clk->errors++;
+        clk->total_errors++;
+    }
+    clk->cmds++;
+
+    if (clk->errors >= c->max_errors) {
+        /* an up-shift which fails in its first window makes the next one wait longer */
+        if (clk->probing) {
+            clk->backoff = MIN(clk->backoff * 2, CLOCK_MAX_BACKOFF);
+        }
+        if (clk->step + 1 < clk->step_count) {
+            clock_set_step(card, clk->step + 1);
+        }
+        clk->probing = false;
+        clk->clean = 0;
+        clk->cmds = 0;
+        clk->errors = 0;
+        return;
+    }
+    if (clk->cmds < c->window) {
+        return;
+    }
+
+    /* end of window */
+    if (clk->errors == 0) {
+        clk->clean++;
+        if (clk->probing) {
+            clk->backoff = MAX(clk->backoff / 2, 1);
+        }
+    } else {
+        clk->clean = 0;
+    }
+    clk->probing = false;
+    clk->cmds = 0;
+    clk->errors = 0;
+    if (clk->step > 0 && clk->clean >= c->clean_windows * clk->backoff) {
+        clock_set_step(card, clk->step - 1);
+        clk->probing = true;
+        clk->clean = 0;
+    }
+}
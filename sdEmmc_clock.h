@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Adaptive bus clock
+ *
+ * While attached to a card, the result of every command is counted in
+ * windows of a fixed number of commands. When CRC errors and timeouts within
+ * a window reach a threshold, the card clock is lowered one step. After a
+ * number of error-free windows, the next faster step is tried again. If that
+ * step fails again within its first window, the number of clean windows
+ * required before the next attempt doubles, so a marginal clock isn't
+ * retried over and over.
+ *
+ * Only the host clock changes: the card stays in the timing mode selected
+ * at init, which is valid at any lower clock.
+ */
+
+#define SDEMMC_CLOCK_MAX_STEPS  8
+
+/**
+ * Adaptive clock configuration; zero fields take the defaults
+ */
+typedef struct {
+    const uint32_t* steps_khz;  /*!< clocks to step down through, fastest first; NULL for 40, 26, 20 and 10 MHz */
+    size_t step_count;          /*!< number of entries in steps_khz */
+    uint32_t window;            /*!< commands per window (default 256) */
+    uint32_t max_errors;        /*!< errors within a window which lower the clock (default 2) */
+    uint32_t clean_windows;     /*!< error-free windows before trying a faster clock (default 16) */
+} sdEmmc_clock_config_t;
+
+/**
+ * Adaptive clock state, attached to a card
+ */
+typedef struct sdEmmc_clock_s {
+    sdEmmc_clock_config_t config;
+    uint32_t steps_khz[SDEMMC_CLOCK_MAX_STEPS]; /*!< clock of each step; step 0 is the clock at attach */
+    size_t step_count;          /*!< number of steps */
+    size_t step;                /*!< current step */
+    uint32_t cmds;              /*!< commands in the current window */
+    uint32_t errors;            /*!< errors in the current window */
+    uint32_t clean;             /*!< consecutive error-free windows */
+    uint32_t backoff;           /*!< clean_windows multiplier after failed up-shifts */
+    bool probing;               /*!< in the first window after an up-shift */
+    uint32_t downshifts;        /*!< number of times the clock was lowered */
+    uint32_t upshifts;          /*!< number of times the clock was raised */
+    uint32_t total_errors;      /*!< CRC errors and timeouts since attach */
+} sdEmmc_clock_t;
+
+/**
+ * Start adapting the card clock to the error rate
+ *
+ * @param card  card initialized using sdEmmc_card_init; its current clock is the fastest step
+ * @param clk  state; must stay valid until sdEmmc_clock_detach
+ * @param config  configuration, or NULL for the defaults
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the step table is too long
+ *      - ESP_ERR_NOT_SUPPORTED if no step is slower than the current clock,
+ *        e.g. for cards which stayed at the 400kHz probing clock
+ */
+esp_err_t sdEmmc_clock_attach(sdmmc_card_t* card, sdEmmc_clock_t* clk,
+        const sdEmmc_clock_config_t* config);
+
+/**
+ * Stop adapting the card clock; the current clock is kept
+ */
+void sdEmmc_clock_detach(sdmmc_card_t* card);
+
+/**
+ * Called by the command layer with the result of each command
+ */
+void sdEmmc_clock_on_cmd(sdmmc_card_t* card, esp_err_t err);
+
+#ifdef __cplusplus
+}
+#endif
@@ -20,9 +20,15 @@
 #include "esp_heap_caps.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "sdEmmc_defs.h"
 #include "sdEmmc_types.h"
 #include "sdEmmc_cmd.h"
+#include "sdEmmc_integrity.h"
+#include "sdEmmc_clock.h"
+#include "sdEmmc_sparse.h"
+#include "sdEmmc_quirks.h"
+#include "sdEmmc_journal.h"
 #include "sys/param.h"
 #include "soc/soc_memory_layout.h"
 
@@ -36,9 +42,10 @@ static esp_err_t sdmmc_send_cmd_go_idle_state(sdmmc_card_t* card);
 static esp_err_t sdmmc_send_cmd_send_if_cond(sdmmc_card_t* card, uint32_t ocr);
 static esp_err_t sdmmc_send_cmd_send_op_cond(sdmmc_card_t* card, uint32_t ocr, uint32_t *ocrp);
 static esp_err_t sdmmc_send_cmd_read_ocr(sdmmc_card_t *card, uint32_t *ocrp);
-static esp_err_t sdmmc_send_cmd_send_cid(sdmmc_card_t *card, sdmmc_cid_t *out_cid);
+static esp_err_t sdmmc_send_cmd_send_cid(sdmmc_card_t *card, sdmmc_response_t *out_raw_cid);
 static esp_err_t sdmmc_decode_cid(sdmmc_response_t resp, sdmmc_cid_t* out_cid);
-static esp_err_t sdmmc_send_cmd_all_send_cid(sdmmc_card_t* card, sdmmc_cid_t* out_cid);
+static esp_err_t mmc_decode_cid(int mmc_ver, sdmmc_response_t resp, sdmmc_cid_t* out_cid);
+static esp_err_t sdmmc_send_cmd_all_send_cid(sdmmc_card_t* card, sdmmc_response_t* out_raw_cid);
 static esp_err_t sdmmc_send_cmd_set_relative_addr(sdmmc_card_t* card, uint16_t* out_rca);
 static esp_err_t sdmmc_send_cmd_set_blocklen(sdmmc_card_t* card, sdmmc_csd_t* csd);
 //static esp_err_t sdmmc_send_cmd_switch_func(sdmmc_card_t* card,        uint32_t mode, uint32_t group, uint32_t function,        sdmmc_switch_func_rsp_t* resp);
@@ -48,12 +55,29 @@ static esp_err_t sd_decode_csd(sdmmc_response_t response, sdmmc_csd_t* out_csd);
 static esp_err_t sdmmc_send_cmd_send_csd(sdmmc_card_t* card, sdmmc_csd_t* out_csd);
 static esp_err_t sdmmc_mem_send_cxd_data(sdmmc_card_t* card , int opcode, void *data, size_t datalen);
 static esp_err_t sdmmc_send_cmd_select_card(sdmmc_card_t* card, uint32_t rca);
-//static esp_err_t sdmmc_decode_scr(uint32_t *raw_scr, sdmmc_scr_t* out_scr);
-//static esp_err_t sdmmc_send_cmd_send_scr(sdmmc_card_t* card, sdmmc_scr_t *out_scr);
+static esp_err_t sdmmc_decode_ssr(uint32_t *raw_ssr, sdmmc_ssr_t* out_ssr);
+static esp_err_t sdmmc_send_cmd_sd_status(sdmmc_card_t* card, sdmmc_ssr_t* out_ssr);
+static esp_err_t sdmmc_write_sectors_copy(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count);
+static bool sdmmc_sector_is_zero(const void* sector, size_t size);
+static esp_err_t sdmmc_write_sectors_elide(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count);
+static esp_err_t sdmmc_read_sectors_dma_bus(sdmmc_card_t* card, void* dst,
+        size_t start_block, size_t block_count);
+static esp_err_t sdmmc_decode_scr(uint32_t *raw_scr, sdmmc_scr_t* out_scr);
+static esp_err_t sdmmc_send_cmd_send_scr(sdmmc_card_t* card, sdmmc_scr_t *out_scr);
 //static esp_err_t sdmmc_send_cmd_set_bus_width(sdmmc_card_t* card, int width);
 //static esp_err_t sdmmc_mmc_command_set(sdmmc_card_t* card, uint8_t set);
 static esp_err_t sdmmc_mmc_switch(sdmmc_card_t* card, uint8_t set, uint8_t index, uint8_t value);
-//static esp_err_t sdmmc_send_cmd_stop_transmission(sdmmc_card_t* card, uint32_t* status);
+static esp_err_t sdmmc_mmc_switch_timeout(sdmmc_card_t* card, uint8_t set, uint8_t index, uint8_t value,
+        uint32_t timeout_ms);
+static esp_err_t sdmmc_mmc_init(sdmmc_card_t* card, uint8_t* ext_csd);
+static void sdmmc_init_timeouts(sdmmc_card_t* card);
+static uint32_t sdmmc_taac_to_ns(int taac);
+static esp_err_t sdmmc_send_cmd_stop_transmission(sdmmc_card_t* card, uint32_t* status);
+static esp_err_t sdmmc_send_cmd_set_block_count(sdmmc_card_t* card, size_t block_count, bool reliable);
+static esp_err_t sdmmc_write_sectors_dma_cmd(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count, bool reliable);
 static esp_err_t sdmmc_send_cmd_send_status(sdmmc_card_t* card, uint32_t* out_status);
 static esp_err_t sdmmc_send_cmd_crc_on_off(sdmmc_card_t* card, bool crc_enable);
 static uint32_t  get_host_ocr(float voltage);
@@ -62,16 +86,250 @@ static void flip_byte_order(uint32_t* response, size_t size);
 
 
 #include "soc/sdmmc_struct.h"
-static bool host_is_spi(const sdmmc_card_t* card)
+/* With a single bus configured, this folds to a constant and the branches of
+ * the other bus are compiled out; sdEmmc_card_is_mmc does the same for the card type.
+ */
+static inline bool host_is_spi(const sdmmc_card_t* card)
 {
+#if !SDEMMC_CONFIG_SDMMC_BUS
+    return true;
+#elif !SDEMMC_CONFIG_SPI_BUS
+    return false;
+#else
     return (card->host.flags & SDMMC_HOST_FLAG_SPI) != 0;
+#endif
+}
+
+/* Integrity tags cover user area sectors; other partitions aren't tracked */
+static inline bool integrity_active(const sdmmc_card_t* card)
+{
+    return card->integrity != NULL && card->part == SDEMMC_PART_USER;
+}
+
+/* Likewise the written-sector map */
+static inline bool sparse_active(const sdmmc_card_t* card)
+{
+    return card->sparse != NULL && card->part == SDEMMC_PART_USER;
+}
+
+/* WR_REL_SET makes every write to the selected partition a reliable one */
+static inline bool rel_set_active(const sdmmc_card_t* card)
+{
+    int bit = (card->part == SDEMMC_PART_USER) ? 0 :
+              (card->part >= SDEMMC_PART_GP1) ? card->part - SDEMMC_PART_GP1 + 1 : -1;
+    return bit >= 0 && (card->ext_csd.rel_set & BIT(bit));
+}
+
+static portMUX_TYPE s_dma_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Pools allocated by sdEmmc_card_init and not released yet, with the card
+ * structure holding each. A card structure may be uninitialized when passed
+ * to sdEmmc_card_init, so its pool is only trusted if it is listed here.
+ */
+static struct {
+    const sdmmc_card_t* card;
+    uint8_t* base;
+} s_live_pools[SDMMC_MAX_LIVE_POOLS];
+
+static bool sdmmc_dma_pool_is_live(const sdmmc_card_t* card)
+{
+    bool live = false;
+    portENTER_CRITICAL(&s_dma_pool_lock);
+    for (int i = 0; i < SDMMC_MAX_LIVE_POOLS; ++i) {
+        if (s_live_pools[i].card == card && s_live_pools[i].base == card->pool.base) {
+            live = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_dma_pool_lock);
+    return live;
+}
+
+/* Add the pool to the list, or remove it if base is NULL */
+static void sdmmc_dma_pool_track(const sdmmc_card_t* card, uint8_t* base)
+{
+    const sdmmc_card_t* find_card = (base != NULL) ? NULL : card;
+    uint8_t* find_base = (base != NULL) ? NULL : card->pool.base;
+    portENTER_CRITICAL(&s_dma_pool_lock);
+    for (int i = 0; i < SDMMC_MAX_LIVE_POOLS; ++i) {
+        if (s_live_pools[i].card == find_card && s_live_pools[i].base == find_base) {
+            s_live_pools[i].card = (base != NULL) ? card : NULL;
+            s_live_pools[i].base = base;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_dma_pool_lock);
+}
+
+static esp_err_t sdmmc_dma_pool_init(sdmmc_card_t* card)
+{
+    sdmmc_dma_pool_t* pool = &card->pool;
+    int count = card->host.dma_pool_buffers;
+    if (count == 0) {
+        count = SDMMC_DEFAULT_DMA_POOL_BUFFERS;
+    }
+    if (count < 1 || count > 32) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pool->base = (uint8_t*) heap_caps_malloc(count * SDMMC_DMA_POOL_BUF_SIZE, MALLOC_CAP_DMA);
+    if (pool->base == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    pool->buf_size = SDMMC_DMA_POOL_BUF_SIZE;
+    pool->count = count;
+    pool->free_mask = (count == 32) ? UINT32_MAX : ((1u << count) - 1);
+    sdmmc_dma_pool_track(card, pool->base);
+    return ESP_OK;
 }
 
+void* sdEmmc_dma_buf_get(sdmmc_card_t* card)
+{
+    sdmmc_dma_pool_t* pool = &card->pool;
+    void* buf = NULL;
+    portENTER_CRITICAL(&s_dma_pool_lock);
+    if (pool->free_mask != 0) {
+        int i = __builtin_ctz(pool->free_mask);
+        pool->free_mask &= ~(1u << i);
+        buf = pool->base + i * pool->buf_size;
+    }
+    portEXIT_CRITICAL(&s_dma_pool_lock);
+    if (buf == NULL) {
+        log_w( "%s: DMA buffer pool exhausted", __func__);
+    }
+    return buf;
+}
+
+void sdEmmc_dma_buf_put(sdmmc_card_t* card, void* buf)
+{
+    sdmmc_dma_pool_t* pool = &card->pool;
+    if (buf == NULL) {
+        return;
+    }
+    size_t i = ((uint8_t*) buf - pool->base) / pool->buf_size;
+    assert(i < pool->count && "buffer does not belong to the card's DMA pool");
+    portENTER_CRITICAL(&s_dma_pool_lock);
+    pool->free_mask |= (1u << i);
+    portEXIT_CRITICAL(&s_dma_pool_lock);
+}
+
+void sdEmmc_card_deinit(sdmmc_card_t* card)
+{
+    sdmmc_dma_pool_track(card, NULL);
+    free(card->pool.base);
+    memset(&card->pool, 0, sizeof(card->pool));
+}
+
+static esp_err_t sdmmc_card_init_protocol(const sdmmc_host_t* config, sdmmc_card_t* card);
+
 esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
 {
     log_d( "%s", __func__);
+    if (sdmmc_dma_pool_is_live(card)) {
+        log_d( "%s: releasing the pool of the previous init", __func__);
+        sdEmmc_card_deinit(card);
+    }
     memset(card, 0, sizeof(*card));
     memcpy(&card->host, config, sizeof(*config));
+    if (((config->flags & SDMMC_HOST_FLAG_SPI) && !SDEMMC_CONFIG_SPI_BUS) ||
+        (!(config->flags & SDMMC_HOST_FLAG_SPI) && !SDEMMC_CONFIG_SDMMC_BUS)) {
+        log_e( "%s: host bus type is disabled in this build", __func__);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#if !SDEMMC_CONFIG_SD
+    card->host.flags |= SDMMC_HOST_MMC_CARD;
+#elif !SDEMMC_CONFIG_MMC
+    card->host.flags &= ~SDMMC_HOST_MMC_CARD;
+#endif
+    /* identification runs at the probing clock on one data line; MMC init
+     * updates these when it switches speed and width */
+    card->freq_khz = MMC_FREQ_PROBING_400K;
+    card->bus_width = 1;
+
+    /* All buffers the driver needs internally are taken from this pool;
+     * no heap allocations are made after init.
+     */
+    esp_err_t err = sdmmc_dma_pool_init(card);
+    if (err != ESP_OK) {
+        log_e( "%s: can't allocate DMA buffer pool (0x%x)", __func__, err);
+        return err;
+    }
+    err = sdmmc_card_init_protocol(config, card);
+    if (err != ESP_OK) {
+        sdEmmc_card_deinit(card);
+    }
+    return err;
+}
+
+typedef struct {
+    const sdmmc_host_t* host;
+    sdmmc_card_t* card;
+    esp_err_t err;
+    SemaphoreHandle_t done;
+} sdmmc_init_job_t;
+
+static void sdmmc_card_init_task(void* arg)
+{
+    sdmmc_init_job_t* job = (sdmmc_init_job_t*) arg;
+    job->err = sdEmmc_card_init(job->host, job->card);
+    xSemaphoreGive(job->done);
+    vTaskDelete(NULL);
+}
+
+esp_err_t sdEmmc_card_init_multi(const sdmmc_host_t* hosts, sdmmc_card_t* cards, size_t n,
+        esp_err_t* out_errs)
+{
+    if (n == 0) {
+        return ESP_OK;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (hosts[i].slot == hosts[j].slot &&
+                (hosts[i].flags & SDMMC_HOST_FLAG_SPI) == (hosts[j].flags & SDMMC_HOST_FLAG_SPI)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+    }
+    sdmmc_init_job_t* jobs = (sdmmc_init_job_t*) calloc(n, sizeof(*jobs));
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(n, 0);
+    if (jobs == NULL || done == NULL) {
+        free(jobs);
+        if (done) {
+            vSemaphoreDelete(done);
+        }
+        return ESP_ERR_NO_MEM;
+    }
+    /* cards 1..n-1 get a task each; the calling task brings up card 0 meanwhile */
+    size_t started = 0;
+    for (size_t i = 1; i < n; ++i) {
+        jobs[i] = (sdmmc_init_job_t) { .host = &hosts[i], .card = &cards[i], .done = done };
+        if (xTaskCreatePinnedToCore(&sdmmc_card_init_task, "sdEmmc_init", SDMMC_INIT_TASK_STACK_SIZE,
+                &jobs[i], uxTaskPriorityGet(NULL), NULL, tskNO_AFFINITY) == pdPASS) {
+            started++;
+        } else {
+            log_w( "%s: no task for slot %d, initializing it in sequence", __func__, hosts[i].slot);
+            jobs[i].err = sdEmmc_card_init(&hosts[i], &cards[i]);
+        }
+    }
+    jobs[0].err = sdEmmc_card_init(&hosts[0], &cards[0]);
+    while (started-- > 0) {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < n; ++i) {
+        if (out_errs) {
+            out_errs[i] = jobs[i].err;
+        }
+        if (err == ESP_OK) {
+            err = jobs[i].err;
+        }
+    }
+    vSemaphoreDelete(done);
+    free(jobs);
+    return err;
+}
+
+static esp_err_t sdmmc_card_init_protocol(const sdmmc_host_t* config, sdmmc_card_t* card)
+{
     const bool is_spi = host_is_spi(card);
 
     /* GO_IDLE_STATE (CMD0) command resets the card */
@@ -94,6 +352,9 @@ esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
         host_ocr |= SD_OCR_SDHC_CAP;
     } else if (err == ESP_ERR_TIMEOUT) {
         log_d( "CMD8 timeout; not an SDHC/SDXC card");
+    } else if (is_spi && err == ESP_ERR_NOT_SUPPORTED) {
+        /* in SPI mode, cards answer with ILLEGAL_COMMAND instead of staying silent */
+        log_d( "CMD8 rejected; not an SDHC/SDXC card");
     } else {
         log_e( "%s: send_if_cond (1) returned 0x%x", __func__, err);
         return err;
@@ -119,6 +380,7 @@ esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
     /* Send SEND_OP_COND (ACMD41) command to the card until it becomes ready. */
     err = sdmmc_send_cmd_send_op_cond(card, host_ocr, &card->ocr);
 
+#if SDEMMC_CONFIG_SD && SDEMMC_CONFIG_MMC
     //if time-out try switching from SD to MMC and vice-versa
     if (err == ESP_ERR_TIMEOUT){
         if (card->host.flags & SDMMC_HOST_MMC_CARD) {   
@@ -131,6 +393,7 @@ esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
         //retry SEND_OP_COND operation
         err = sdmmc_send_cmd_send_op_cond(card, host_ocr, &card->ocr);
     }
+#endif
     if (err != ESP_OK) {
         log_e( "%s: send_op_cond (1) returned 0x%x", __func__, err);
         return err;
@@ -153,9 +416,12 @@ esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
     host_ocr &= (card->ocr | (~SD_OCR_VOL_MASK));
     log_d( "sdEmmc_card_init: host_ocr=%08x, card_ocr=%08x", host_ocr, card->ocr);
 
-    /* Read and decode the contents of CID register */
+    /* Read the contents of CID register; MMC CID layout depends on the CSD
+     * version, so it is decoded once CSD is known.
+     */
+    sdmmc_response_t raw_cid;
     if (!is_spi) {
-        err = sdmmc_send_cmd_all_send_cid(card, &card->cid);
+        err = sdmmc_send_cmd_all_send_cid(card, &raw_cid);
         if (err != ESP_OK) {
             log_e( "%s: all_send_cid returned 0x%x", __func__, err);
             return err;
@@ -166,7 +432,7 @@ esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
             return err;
         }
     } else {
-        err = sdmmc_send_cmd_send_cid(card, &card->cid);
+        err = sdmmc_send_cmd_send_cid(card, &raw_cid);
         if (err != ESP_OK) {
             log_e( "%s: send_cid returned 0x%x", __func__, err);
             return err;
@@ -186,6 +452,20 @@ esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
                 __func__, card->csd.capacity, max_sdsc_capacity);
         card->csd.capacity = max_sdsc_capacity;
     }
+    if (sdEmmc_card_is_mmc(card)) {
+        mmc_decode_cid(card->csd.mmc_ver, raw_cid, &card->cid);
+    } else {
+        sdmmc_decode_cid(raw_cid, &card->cid);
+    }
+
+    /* Known misbehaving parts get their workarounds before anything relies on them */
+    const sdEmmc_quirk_t* quirk = sdEmmc_quirks_lookup(card);
+    if (quirk != NULL) {
+        log_d( "%s: applying quirks for %s rev %02x (flags 0x%x)", __func__,
+                card->cid.name, card->cid.revision, quirk->quirks.flags);
+        card->quirks = quirk->quirks;
+    }
+    card->tuning.write_min_sectors = card->quirks.write_chunk_sectors;
 
     /* Switch the card from stand-by mode to data transfer mode (not needed if
      * SPI interface is used). This is needed to issue SET_BLOCKLEN and
@@ -211,148 +491,333 @@ esp_err_t sdEmmc_card_init(const sdmmc_host_t* config, sdmmc_card_t* card)
         }
     }
 
-    if (card->host.flags & SDMMC_HOST_MMC_CARD) {
+    if (sdEmmc_card_is_mmc(card)) {
         log_d( "Using MMC protocol");
-        /* sdmmc_mem_mmc_init */
-        int width, width_value;
-        int card_type;
-        uint8_t ext_csd[512];
-        uint8_t powerclass = 0;
-		int speed_supported = MMC_FREQ_PROBING_400K;
-		                
-        uint32_t sectors = 0;
-
-        if (card->csd.mmc_ver < MMC_CSD_MMCVER_4_0){
-          log_d( "card->csd.mmc_ver < MMC_CSD_MMCVER_4_0"); 
-          return ESP_FAIL;
-        } 
+        uint8_t* ext_csd = (uint8_t*) sdEmmc_dma_buf_get(card);
+        if (ext_csd == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        err = sdmmc_mmc_init(card, ext_csd);
+        sdEmmc_dma_buf_put(card, ext_csd);
+        if (err != ESP_OK) {
+            return err;
+        }
+    } else {
+        log_d( "Using SD protocol");
+        /* SD Status is informational (AU size, speed class); cards which
+         * fail to return it are still usable.
+         */
+        err = sdmmc_send_cmd_sd_status(card, &card->ssr);
+        if (err != ESP_OK) {
+            log_w( "%s: sd_status returned 0x%x", __func__, err);
+        }
+        /* likewise SCR, which tells what erased sectors read back as */
+        card->scr.data_stat_after_erase = 1;
+        err = sdmmc_send_cmd_send_scr(card, &card->scr);
+        if (err != ESP_OK) {
+            log_w( "%s: send_scr returned 0x%x", __func__, err);
+        }
+        /* default speed needs no function switch; hosts keep the probing
+         * clock unless their max_freq_khz allows more */
+        uint32_t speed = MIN(card->csd.tr_speed / 1000, (uint32_t) card->host.max_freq_khz);
+        if (card->quirks.max_freq_khz != 0) {
+            speed = MIN(speed, card->quirks.max_freq_khz);
+        }
+        if (speed > card->freq_khz) {
+            err = (*card->host.set_card_clk)(card->host.slot, speed);
+            if (err != ESP_OK) {
+                log_e( "%s: set_card_clk(%u) returned 0x%x", __func__, speed, err);
+                return err;
+            }
+            card->freq_khz = speed;
+        }
+    }
+    sdmmc_init_timeouts(card);
+    return ESP_OK;
+}
 
-        
-		/* read EXT_CSD */
+/* ext_csd: DMA capable buffer of EXT_CSD_MMC_SIZE bytes */
+static esp_err_t sdmmc_mmc_init(sdmmc_card_t* card, uint8_t* ext_csd)
+{
+    esp_err_t err;
+    int width, width_value;
+    int card_type;
+    uint8_t powerclass = 0;
+	int speed_supported = MMC_FREQ_PROBING_400K;
+	                
+    uint32_t sectors = 0;
+
+    if (card->csd.mmc_ver < MMC_CSD_MMCVER_4_0){
+      log_d( "card->csd.mmc_ver < MMC_CSD_MMCVER_4_0"); 
+      return ESP_FAIL;
+    } 
+
+    
+	/* read EXT_CSD */
+	err = sdmmc_mem_send_cxd_data(card,
+			MMC_SEND_EXT_CSD, ext_csd, EXT_CSD_MMC_SIZE);
+	if (err != ESP_OK) {
+		//SET(card->flags, SFF_ERROR);
+		log_e( "%s: can't read EXT_CSD\n", __func__);
+		return err;
+	}
+
+	card_type = ext_csd[EXT_CSD_CARD_TYPE];
+
+	//NOTE: ESP32 doesn't support DDR
+	if (card_type & EXT_CSD_CARD_TYPE_F_52M_1_8V) {
+		log_d( "EXT_CSD_CARD_TYPE_F_52M_1_8V");
+		speed_supported = MMC_FREQ_HIGHSPEED_SDR_52M;
+	} else if (card_type & EXT_CSD_CARD_TYPE_F_52M) {
+		log_d( "EXT_CSD_CARD_TYPE_F_52M");
+		speed_supported = MMC_FREQ_HIGHSPEED_SDR_52M;
+	} else if (card_type & EXT_CSD_CARD_TYPE_F_26M) {
+		log_d( "EXT_CSD_CARD_TYPE_F_26M");
+		speed_supported = MMC_FREQ_DEFAULT_26M;
+	} else {
+		log_e( "%s: unknown CARD_TYPE 0x%x\n", __func__,
+				ext_csd[EXT_CSD_CARD_TYPE]);
+	}
+	
+	int speed = speed_supported;
+	if(card->host.max_freq_khz < speed ) speed = card->host.max_freq_khz;
+	if(card->quirks.max_freq_khz != 0 && card->quirks.max_freq_khz < speed) speed = card->quirks.max_freq_khz;
+
+	if (speed > MMC_FREQ_DEFAULT_26M) {
+		/* switch to high speed timing */
+		log_d( "switch to high speed timing ");
+		err = sdmmc_mmc_switch(card, EXT_CSD_CMD_SET_NORMAL,
+				EXT_CSD_HS_TIMING, EXT_CSD_HS_TIMING_HS);
+		if (err != ESP_OK) {
+			log_e( "%s: can't change high speed",
+					__func__);
+			return err;
+		}
+		ets_delay_us(10000);
+		
+		/* read EXT_CSD again */
 		err = sdmmc_mem_send_cxd_data(card,
-				MMC_SEND_EXT_CSD, ext_csd, sizeof(ext_csd));
+				MMC_SEND_EXT_CSD, ext_csd, EXT_CSD_MMC_SIZE);
 		if (err != ESP_OK) {
-			//SET(card->flags, SFF_ERROR);
-			log_e( "%s: can't read EXT_CSD\n", __func__);
+			log_e( "%s: can't re-read EXT_CSD\n", __func__);
 			return err;
 		}
+		if (ext_csd[EXT_CSD_HS_TIMING] != EXT_CSD_HS_TIMING_HS) {
+			log_e( "%s, HS_TIMING set failed\n", __func__);
+			return ESP_ERR_INVALID_RESPONSE;
+		}			
+	}
+
+	log_d( "switching speed to:%u",speed);
+	err = (*card->host.set_card_clk)(card->host.slot, speed);
+	if (err != ESP_OK) {
+		log_e( "failed to switch speed");
+		return err;
+	}
+	card->freq_khz = speed;
+    
 
-		card_type = ext_csd[EXT_CSD_CARD_TYPE];
-
-		//NOTE: ESP32 doesn't support DDR
-		if (card_type & EXT_CSD_CARD_TYPE_F_52M_1_8V) {
-			log_d( "EXT_CSD_CARD_TYPE_F_52M_1_8V");
-			speed_supported = MMC_FREQ_HIGHSPEED_SDR_52M;
-		} else if (card_type & EXT_CSD_CARD_TYPE_F_52M) {
-			log_d( "EXT_CSD_CARD_TYPE_F_52M");
-			speed_supported = MMC_FREQ_HIGHSPEED_SDR_52M;
-		} else if (card_type & EXT_CSD_CARD_TYPE_F_26M) {
-			log_d( "EXT_CSD_CARD_TYPE_F_26M");
-			speed_supported = MMC_FREQ_DEFAULT_26M;
-		} else {
-			log_e( "%s: unknown CARD_TYPE 0x%x\n", __func__,
-					ext_csd[EXT_CSD_CARD_TYPE]);
+	if (card->host.flags & SDMMC_HOST_FLAG_8BIT) {
+		width = 8;
+		width_value = EXT_CSD_BUS_WIDTH_8;
+		powerclass = ext_csd[(speed > MMC_FREQ_DEFAULT_26M) ? EXT_CSD_PWR_CL_52_360 : EXT_CSD_PWR_CL_26_360] >> 4;
+	} else if (card->host.flags & SDMMC_HOST_FLAG_4BIT) {
+		width = 4;
+		width_value = EXT_CSD_BUS_WIDTH_4;
+		powerclass = ext_csd[(speed > MMC_FREQ_DEFAULT_26M) ? EXT_CSD_PWR_CL_52_360 : EXT_CSD_PWR_CL_26_360] & 0x0f;
+	} else {
+		width = 1;
+		width_value = EXT_CSD_BUS_WIDTH_1;
+		powerclass = 0; //card must be able to do full rate at powerclass 0 in 1-bit mode
+	}
+	
+	if (powerclass != 0) {
+		log_d("setting powerclass:%X",powerclass);
+		err = sdmmc_mmc_switch(card, EXT_CSD_CMD_SET_NORMAL,
+				EXT_CSD_POWER_CLASS, powerclass);
+		if (err != ESP_OK) {
+			log_e( "%s: can't change power class"
+						" (%d bit)\n", __func__, powerclass);
+			return err;
 		}
-		
-		int speed = speed_supported;
-		if(config->max_freq_khz < speed ) speed = config->max_freq_khz;
-
-		if (speed > MMC_FREQ_DEFAULT_26M) {
-			/* switch to high speed timing */
-			log_d( "switch to high speed timing ");
-			err = sdmmc_mmc_switch(card, EXT_CSD_CMD_SET_NORMAL,
-					EXT_CSD_HS_TIMING, EXT_CSD_HS_TIMING_HS);
-			if (err != ESP_OK) {
-				log_e( "%s: can't change high speed",
-						__func__);
-				return err;
-			}
-			ets_delay_us(10000);
-			
-			/* read EXT_CSD again */
-			err = sdmmc_mem_send_cxd_data(card,
-					MMC_SEND_EXT_CSD, ext_csd, sizeof(ext_csd));
+        ets_delay_us(10000);
+	}
+	if (width != 1) {
+		log_d("setting bus width:%u width_value:%X",width,width_value);
+		err = sdmmc_mmc_switch(card, EXT_CSD_CMD_SET_NORMAL,
+				EXT_CSD_BUS_WIDTH, width_value);
+		if (err == ESP_OK) {
+			err = (*card->host.set_bus_width)(card->host.slot, width);
 			if (err != ESP_OK) {
-				log_e( "%s: can't re-read EXT_CSD\n", __func__);
+				log_e( "slot->set_bus_width failed");
 				return err;
 			}
-			if (ext_csd[EXT_CSD_HS_TIMING] != EXT_CSD_HS_TIMING_HS) {
-				log_e( "%s, HS_TIMING set failed\n", __func__);
-				return ESP_ERR_INVALID_RESPONSE;
-			}			
+			card->bus_width = width;
+		} else {
+			log_e( "%s: can't change bus width"
+						" (%d bit)\n", __func__, width);
+			return err;
 		}
 
-		log_d( "switching speed to:%u",speed);
-		err = (*config->set_card_clk)(config->slot, speed);
+		/* XXXX: need bus test? (using by CMD14 & CMD19) */
+		ets_delay_us(10000);
+	}
+
+	sectors = ext_csd[EXT_CSD_SEC_COUNT + 0] << 0 |
+		ext_csd[EXT_CSD_SEC_COUNT + 1] << 8  |
+		ext_csd[EXT_CSD_SEC_COUNT + 2] << 16 |
+		ext_csd[EXT_CSD_SEC_COUNT + 3] << 24;
+
+	if (sectors > (2u * 1024 * 1024 * 1024) / 512) {
+		//card->flags |= SFF_SDHC;
+		card->csd.capacity = sectors;
+	}
+
+	card->ext_csd.rev = ext_csd[EXT_CSD_REV];
+	card->ext_csd.sec_feature = ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT];
+	if (card->quirks.flags & SDEMMC_QUIRK_NO_TRIM) {
+		card->ext_csd.sec_feature &= ~EXT_CSD_SEC_GB_CL_EN;
+	}
+	card->ext_csd.erase_group_def = ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 1;
+	card->ext_csd.erased_mem_cont = ext_csd[EXT_CSD_ERASED_MEM_CONT] & 1;
+
+	/* high capacity erase groups: plain erases must cover whole groups, whether
+	 * or not the card also gives their erase timeout (0 leaves it to sdmmc_init_timeouts) */
+	if (card->ext_csd.erase_group_def) {
+		if (ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] != 0) {
+			card->timeouts.erase_unit_sectors = ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] * (512 * 1024 / 512);
+			card->timeouts.erase_ms = ext_csd[EXT_CSD_ERASE_TIMEOUT_MULT] * SDMMC_MMC_ERASE_TIMEOUT_MS;
+		} else {
+			/* group size unknown, so no range can be aligned to it */
+			card->ext_csd.erase_group_def = 0;
+		}
+	}
+
+	/* S_A_TIMEOUT: 100ns * 2^x, SLEEP_NOTIFICATION_TIME: 10us * 2^x, GENERIC_CMD6_TIME: 10ms units */
+	uint8_t s_a = MIN(ext_csd[EXT_CSD_S_A_TIMEOUT], 0x17);
+	card->ext_csd.sleep_awake_ms = s_a ? (uint32_t) (((100ull << s_a) + 999999) / 1000000) :
+			SDMMC_DEFAULT_CMD_TIMEOUT_MS;
+	card->ext_csd.cmd6_ms = ext_csd[EXT_CSD_GENERIC_CMD6_TIME] ?
+			ext_csd[EXT_CSD_GENERIC_CMD6_TIME] * 10 : SDMMC_DEFAULT_CMD_TIMEOUT_MS;
+	if (card->ext_csd.rev >= EXT_CSD_REV_5_0 && ext_csd[EXT_CSD_SLEEP_NOTIFICATION_TIME] != 0) {
+		uint8_t sn = MIN(ext_csd[EXT_CSD_SLEEP_NOTIFICATION_TIME], 0x17);
+		card->ext_csd.sleep_notify_ms = (uint32_t) (((10ull << sn) + 999) / 1000);
+	}
+
+	/* hardware partitions; GP sizes only take effect once partitioning is completed */
+	card->ext_csd.part_config = ext_csd[EXT_CSD_PART_CONFIG];
+	card->ext_csd.part_switch_ms = ext_csd[EXT_CSD_PART_SWITCH_TIME] ?
+			ext_csd[EXT_CSD_PART_SWITCH_TIME] * 10 : card->ext_csd.cmd6_ms;
+	card->ext_csd.part_sectors[SDEMMC_PART_USER] = card->csd.capacity;
+	card->ext_csd.part_sectors[SDEMMC_PART_BOOT1] = ext_csd[EXT_CSD_BOOT_SIZE_MULT] * (128 * 1024 / 512);
+	card->ext_csd.part_sectors[SDEMMC_PART_BOOT2] = card->ext_csd.part_sectors[SDEMMC_PART_BOOT1];
+	if (ext_csd[EXT_CSD_PARTITION_SETTING] & EXT_CSD_PARTITION_SETTING_COMPLETED) {
+		const uint32_t gp_unit = ext_csd[EXT_CSD_HC_WP_GRP_SIZE] * ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] *
+				(512 * 1024 / 512);
+		for (int i = 0; i < 4; ++i) {
+			const uint8_t* mult = &ext_csd[EXT_CSD_GP_SIZE_MULT + 3 * i];
+			card->ext_csd.part_sectors[SDEMMC_PART_GP1 + i] =
+					(mult[2] << 16 | mult[1] << 8 | mult[0]) * gp_unit;
+		}
+	}
+	/* reliable write; a writable WR_REL_SET only takes effect once partitioning is completed */
+	card->ext_csd.rel_param = ext_csd[EXT_CSD_WR_REL_PARAM];
+	card->ext_csd.rel_wr_sectors = ext_csd[EXT_CSD_REL_WR_SEC_C];
+	if (!(card->ext_csd.rel_param & EXT_CSD_WR_REL_PARAM_HS_CTRL_REL) ||
+		(ext_csd[EXT_CSD_PARTITION_SETTING] & EXT_CSD_PARTITION_SETTING_COMPLETED)) {
+		card->ext_csd.rel_set = ext_csd[EXT_CSD_WR_REL_SET];
+	}
+	card->part = card->ext_csd.part_config & EXT_CSD_PART_CONFIG_ACC_MASK;
+	if (card->part != SDEMMC_PART_USER) {
+		err = sdEmmc_part_select(card, SDEMMC_PART_USER);
 		if (err != ESP_OK) {
-			log_e( "failed to switch speed");
+			log_e( "%s: can't select the user area (0x%x)", __func__, err);
 			return err;
 		}
-        
-
-		if (card->host.flags & SDMMC_HOST_FLAG_8BIT) {
-			width = 8;
-			width_value = EXT_CSD_BUS_WIDTH_8;
-			powerclass = ext_csd[(speed > MMC_FREQ_DEFAULT_26M) ? EXT_CSD_PWR_CL_52_360 : EXT_CSD_PWR_CL_26_360] >> 4;
-		} else if (card->host.flags & SDMMC_HOST_FLAG_4BIT) {
-			width = 4;
-			width_value = EXT_CSD_BUS_WIDTH_4;
-			powerclass = ext_csd[(speed > MMC_FREQ_DEFAULT_26M) ? EXT_CSD_PWR_CL_52_360 : EXT_CSD_PWR_CL_26_360] & 0x0f;
+	}
+
+	/* the host promises to notify the device before power is removed */
+	if (card->ext_csd.rev >= EXT_CSD_REV_4_5) {
+		err = sdmmc_mmc_switch_timeout(card, EXT_CSD_CMD_SET_NORMAL,
+				EXT_CSD_POWER_OFF_NOTIFICATION, EXT_CSD_POWERED_ON, card->ext_csd.cmd6_ms);
+		if (err == ESP_OK) {
+			card->ext_csd.power_off_notify = 1;
 		} else {
-			width = 1;
-			width_value = EXT_CSD_BUS_WIDTH_1;
-			powerclass = 0; //card must be able to do full rate at powerclass 0 in 1-bit mode
-		}
-		
-		if (powerclass != 0) {
-			log_d("setting powerclass:%X",powerclass);
-			err = sdmmc_mmc_switch(card, EXT_CSD_CMD_SET_NORMAL,
-					EXT_CSD_POWER_CLASS, powerclass);
-			if (err != ESP_OK) {
-				log_e( "%s: can't change power class"
-							" (%d bit)\n", __func__, powerclass);
-				return err;
-			}
-            ets_delay_us(10000);
+			log_w( "%s: can't enable power off notification (0x%x)", __func__, err);
 		}
-		if (width != 1) {
-			log_d("setting bus width:%u width_value:%X",width,width_value);
-			err = sdmmc_mmc_switch(card, EXT_CSD_CMD_SET_NORMAL,
-					EXT_CSD_BUS_WIDTH, width_value);
-			if (err == ESP_OK) {
-				err = (*config->set_bus_width)(config->slot, width);
-				if (err != ESP_OK) {
-					log_e( "slot->set_bus_width failed");
-					return err;
-				}
-			} else {
-				log_e( "%s: can't change bus width"
-							" (%d bit)\n", __func__, width);
-				return err;
-			}
+	}
 
-			/* XXXX: need bus test? (using by CMD14 & CMD19) */
-			ets_delay_us(10000);
-		}
+    log_d( "MMC width:%d card_type:%d speed:%d powerclass:%d  sectors:%lu",   
+        width,card_type,speed, powerclass,  sectors 
+    );
+    return ESP_OK;
+}
 
-		sectors = ext_csd[EXT_CSD_SEC_COUNT + 0] << 0 |
-			ext_csd[EXT_CSD_SEC_COUNT + 1] << 8  |
-			ext_csd[EXT_CSD_SEC_COUNT + 2] << 16 |
-			ext_csd[EXT_CSD_SEC_COUNT + 3] << 24;
+/* TAAC: bits 2:0 time unit, bits 6:3 multiplier */
+static uint32_t sdmmc_taac_to_ns(int taac)
+{
+    static const uint32_t unit_ns[8] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+    static const uint8_t mult_x10[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    return unit_ns[taac & 7] * mult_x10[(taac >> 3) & 0xf] / 10;
+}
 
-		if (sectors > (2u * 1024 * 1024 * 1024) / 512) {
-			//card->flags |= SFF_SDHC;
-			card->csd.capacity = sectors;
-		}
+/* Access time of one block, in us: TAAC plus NSAC * 100 clock cycles */
+static uint32_t sdmmc_access_time_us(const sdmmc_card_t* card)
+{
+    return card->csd.taac_ns / 1000 + card->csd.nsac * 100 * 1000 / card->freq_khz;
+}
 
-        log_d( "MMC width:%d card_type:%d speed:%d powerclass:%d  sectors:%lu",   
-            width,card_type,speed, powerclass,  sectors 
-        );
-        
+/* Worst case read, write and erase times, following the SD physical layer
+ * specification (4.6.2) for SD cards and the JEDEC eMMC specification for MMC.
+ * Called once the bus clock and width are final, and again on clock changes.
+ */
+static void sdmmc_init_timeouts(sdmmc_card_t* card)
+{
+    sdmmc_timeouts_t* t = &card->timeouts;
+    const uint32_t access_ms = (sdmmc_access_time_us(card) + 999) / 1000;
+
+    if (sdEmmc_card_is_mmc(card)) {
+        /* Nac is 10 times the typical access time, writes scale by R2W_FACTOR */
+        t->read_ms = 10 * access_ms;
+        t->write_ms = t->read_ms << card->csd.r2w_factor;
+    } else if (card->ocr & SD_OCR_SDHC_CAP) {
+        /* SDHC/SDXC: access time fields are fixed and must not be used */
+        t->read_ms = SDMMC_SD_READ_TIMEOUT_MS;
+        t->write_ms = (card->csd.capacity > 32u * 1024 * 1024 / 512 * 1024) ?
+                SDMMC_SDXC_WRITE_TIMEOUT_MS : SDMMC_SD_WRITE_TIMEOUT_MS;
     } else {
-        log_d( "Using SD protocol");
+        t->read_ms = MIN(100 * access_ms, SDMMC_SD_READ_TIMEOUT_MS);
+        t->write_ms = MIN(t->read_ms << card->csd.r2w_factor, SDMMC_SD_WRITE_TIMEOUT_MS);
+    }
+    t->read_ms = MIN(MAX(t->read_ms, SDMMC_MIN_CMD_TIMEOUT_MS), SDMMC_DEFAULT_CMD_TIMEOUT_MS);
+    t->write_ms = MIN(MAX(t->write_ms, SDMMC_MIN_CMD_TIMEOUT_MS), SDMMC_WRITE_CMD_TIMEOUT_MS);
+    t->read_ms = MAX(t->read_ms, card->quirks.min_read_ms);
+
+    if (t->erase_unit_sectors == 0) {
+        size_t au_sectors = (size_t) card->ssr.alloc_unit_kb * 1024 / card->csd.sector_size;
+        if (au_sectors != 0 && card->ssr.erase_size_au != 0 && card->ssr.erase_timeout != 0) {
+            /* SSR: ERASE_TIMEOUT seconds per ERASE_SIZE AUs, plus ERASE_OFFSET */
+            t->erase_ms = card->ssr.erase_timeout * 1000 / card->ssr.erase_size_au;
+            t->erase_offset_ms = card->ssr.erase_offset * 1000;
+            t->erase_unit_sectors = au_sectors;
+        } else {
+            t->erase_ms = MAX(t->write_ms, SDMMC_SD_ERASE_TIMEOUT_MS);
+            t->erase_unit_sectors = 1;
+        }
+    } else if (t->erase_ms == 0) {
+        /* MMC erase groups without ERASE_TIMEOUT_MULT */
+        t->erase_ms = MAX(t->write_ms, SDMMC_MMC_ERASE_TIMEOUT_MS);
     }
-    return ESP_OK;
+    /* commands without data or busy signaling are answered within 64 clocks */
+    t->cmd_ms = SDMMC_MIN_CMD_TIMEOUT_MS;
+
+    log_d( "timeouts: read=%ums write=%ums erase=%ums/%u sectors (+%ums)",
+            t->read_ms, t->write_ms, t->erase_ms, t->erase_unit_sectors, t->erase_offset_ms);
+}
+
+void sdEmmc_update_timeouts(sdmmc_card_t* card)
+{
+    sdmmc_init_timeouts(card);
 }
 
 void sdEmmc_card_print_info(FILE* stream, const sdmmc_card_t* card)
@@ -364,6 +829,13 @@ void sdEmmc_card_print_info(FILE* stream, const sdmmc_card_t* card)
             card->csd.csd_ver,
             card->csd.sector_size, card->csd.capacity, card->csd.read_block_len);
     fprintf(stream, "SCR: sd_spec=%d, bus_width=%d\n", card->scr.sd_spec, card->scr.bus_width);
+    fprintf(stream, "SSR: au=%uKB, speed_class=%u, uhs_grade=%u, erase_size=%u, erase_timeout=%u\n",
+            card->ssr.alloc_unit_kb, card->ssr.speed_class, card->ssr.uhs_speed_grade,
+            card->ssr.erase_size_au, card->ssr.erase_timeout);
+    fprintf(stream, "Bus: %ukHz, %d bit\n", card->freq_khz, card->bus_width);
+    fprintf(stream, "Timeouts: read=%ums, write=%ums, erase=%ums per %u sectors\n",
+            card->timeouts.read_ms, card->timeouts.write_ms,
+            card->timeouts.erase_ms, card->timeouts.erase_unit_sectors);
 }
 
 static esp_err_t sdmmc_send_cmd(sdmmc_card_t* card, sdmmc_command_t* cmd)
@@ -371,13 +843,18 @@ static esp_err_t sdmmc_send_cmd(sdmmc_card_t* card, sdmmc_command_t* cmd)
     if (card->host.command_timeout_ms != 0) {
         cmd->timeout_ms = card->host.command_timeout_ms;
     } else if (cmd->timeout_ms == 0) {
-        cmd->timeout_ms = SDMMC_DEFAULT_CMD_TIMEOUT_MS;
+        bool quick = card->timeouts.cmd_ms != 0 && cmd->datalen == 0 &&
+                (cmd->flags & SCF_RSP_BSY) == 0;
+        cmd->timeout_ms = quick ? card->timeouts.cmd_ms : SDMMC_DEFAULT_CMD_TIMEOUT_MS;
     }
 
     int slot = card->host.slot;
     log_v( "sending cmd slot=%d op=%d arg=%x flags=%x data=%p blklen=%d datalen=%d timeout=%d",
             slot, cmd->opcode, cmd->arg, cmd->flags, cmd->data, cmd->blklen, cmd->datalen, cmd->timeout_ms);
     esp_err_t err = (*card->host.do_transaction)(slot, cmd);
+    if (card->clock) {
+        sdEmmc_clock_on_cmd(card, (err != ESP_OK) ? err : cmd->error);
+    }
     if (err != 0) {
         log_d( "sdmmc_req_run returned 0x%x", err);
         return err;
@@ -457,7 +934,7 @@ static esp_err_t sdmmc_send_cmd_send_op_cond(sdmmc_card_t* card, uint32_t ocr, u
         bzero(&cmd, sizeof cmd);
         cmd.arg = ocr;
         cmd.flags = SCF_CMD_BCR | SCF_RSP_R3;
-        if (card->host.flags & SDMMC_HOST_MMC_CARD) { /* MMC mode */
+        if (sdEmmc_card_is_mmc(card)) { /* MMC mode */
             cmd.arg &= ~MMC_OCR_ACCESS_MODE_MASK;
             cmd.arg |= MMC_OCR_SECTOR_MODE;
             cmd.opcode = MMC_SEND_OP_COND;
@@ -518,9 +995,30 @@ static esp_err_t sdmmc_decode_cid(sdmmc_response_t resp, sdmmc_cid_t* out_cid)
     return ESP_OK;
 }
 
-static esp_err_t sdmmc_send_cmd_all_send_cid(sdmmc_card_t* card, sdmmc_cid_t* out_cid)
+static esp_err_t mmc_decode_cid(int mmc_ver, sdmmc_response_t resp, sdmmc_cid_t* out_cid)
+{
+    if (mmc_ver == MMC_CSD_MMCVER_1_0 ||
+            mmc_ver == MMC_CSD_MMCVER_1_4) {
+        out_cid->mfg_id = MMC_CID_MID_V1(resp);
+        out_cid->oem_id = 0;
+        MMC_CID_PNM_V1_CPY(resp, out_cid->name);
+        out_cid->revision = MMC_CID_REV_V1(resp);
+        out_cid->serial = MMC_CID_PSN_V1(resp);
+        out_cid->date = MMC_CID_MDT_V1(resp);
+    } else {
+        out_cid->mfg_id = MMC_CID_MID_V2(resp);
+        out_cid->oem_id = MMC_CID_OID_V2(resp);
+        MMC_CID_PNM_V2_CPY(resp, out_cid->name);
+        out_cid->revision = MMC_CID_REV_V2(resp);
+        out_cid->serial = MMC_CID_PSN_V2(resp);
+        out_cid->date = MMC_CID_MDT_V2(resp);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sdmmc_send_cmd_all_send_cid(sdmmc_card_t* card, sdmmc_response_t* out_raw_cid)
 {
-    assert(out_cid);
+    assert(out_raw_cid);
     sdmmc_command_t cmd = {
             .opcode = MMC_ALL_SEND_CID,
             .flags = SCF_CMD_BCR | SCF_RSP_R2
@@ -529,12 +1027,13 @@ static esp_err_t sdmmc_send_cmd_all_send_cid(sdmmc_card_t* card, sdmmc_cid_t* ou
     if (err != ESP_OK) {
         return err;
     }
-    return sdmmc_decode_cid(cmd.response, out_cid);
+    memcpy(out_raw_cid, &cmd.response, sizeof(*out_raw_cid));
+    return ESP_OK;
 }
 
-static esp_err_t sdmmc_send_cmd_send_cid(sdmmc_card_t *card, sdmmc_cid_t *out_cid)
+static esp_err_t sdmmc_send_cmd_send_cid(sdmmc_card_t *card, sdmmc_response_t *out_raw_cid)
 {
-    assert(out_cid);
+    assert(out_raw_cid);
     assert(host_is_spi(card) && "SEND_CID should only be used in SPI mode");
     sdmmc_response_t buf;
     sdmmc_command_t cmd = {
@@ -549,31 +1048,32 @@ static esp_err_t sdmmc_send_cmd_send_cid(sdmmc_card_t *card, sdmmc_cid_t *out_ci
         return err;
     }
     flip_byte_order(buf, sizeof(buf));
-    return sdmmc_decode_cid(buf, out_cid);
+    memcpy(out_raw_cid, &buf, sizeof(*out_raw_cid));
+    return ESP_OK;
 }
 
 
 static esp_err_t sdmmc_send_cmd_set_relative_addr(sdmmc_card_t* card, uint16_t* out_rca)
 {
-    static uint16_t next_rca_mmc = 0;
     assert(out_rca);
+    /* MMC cards expect the host to assign the RCA. There is one card per
+     * slot, so the slot number gives a unique one without shared state;
+     * 0 means deselected, so can't use that for an RCA.
+     */
+    const uint16_t mmc_rca = (uint16_t) (card->host.slot + 1);
     sdmmc_command_t cmd = {
             .opcode = SD_SEND_RELATIVE_ADDR,
             .flags = SCF_CMD_BCR | SCF_RSP_R6
     };
-    if (card->host.flags & SDMMC_HOST_MMC_CARD) {
-        // MMC cards expect you to set the RCA, so just keep a counter of them
-        next_rca_mmc++;
-        if (next_rca_mmc == 0) /* 0 means deselcted, so can't use that for an RCA */
-            next_rca_mmc++;
-        cmd.arg = MMC_ARG_RCA(next_rca_mmc);
+    if (sdEmmc_card_is_mmc(card)) {
+        cmd.arg = MMC_ARG_RCA(mmc_rca);
     }
 
     esp_err_t err = sdmmc_send_cmd(card, &cmd);
     if (err != ESP_OK) {
         return err;
     }
-    *out_rca = (card->host.flags & SDMMC_HOST_MMC_CARD) ? next_rca_mmc : SD_R6_RCA(cmd.response);
+    *out_rca = sdEmmc_card_is_mmc(card) ? mmc_rca : SD_R6_RCA(cmd.response);
     return ESP_OK;
 }
 
@@ -613,6 +1113,10 @@ static esp_err_t mmc_decode_csd(sdmmc_response_t response, sdmmc_csd_t* out_csd)
     } else {
         out_csd->tr_speed = 25000000;
     }
+    /* same bit positions in SD and MMC CSD */
+    out_csd->taac_ns = sdmmc_taac_to_ns(SD_CSD_TAAC(response));
+    out_csd->nsac = SD_CSD_NSAC(response);
+    out_csd->r2w_factor = SD_CSD_R2W_FACTOR(response);
     return ESP_OK;
 }
 
@@ -644,6 +1148,10 @@ static esp_err_t sd_decode_csd(sdmmc_response_t response, sdmmc_csd_t* out_csd)
     } else {
         out_csd->tr_speed = 25000000;
     }
+    /* same bit positions in SD and MMC CSD */
+    out_csd->taac_ns = sdmmc_taac_to_ns(SD_CSD_TAAC(response));
+    out_csd->nsac = SD_CSD_NSAC(response);
+    out_csd->r2w_factor = SD_CSD_R2W_FACTOR(response);
     return ESP_OK;
 }
 
@@ -667,50 +1175,32 @@ static esp_err_t sdmmc_send_cmd_send_csd(sdmmc_card_t* card, sdmmc_csd_t* out_cs
         return err;
     }
     
+    uint32_t* ptr = cmd.response;
     if (is_spi) {
         flip_byte_order(spi_buf,  sizeof(spi_buf));
+        ptr = spi_buf;
     }
 
-    if (card->host.flags & SDMMC_HOST_MMC_CARD) /* MMC mode */
-        err = mmc_decode_csd(cmd.response, out_csd);
+    if (sdEmmc_card_is_mmc(card)) /* MMC mode */
+        err = mmc_decode_csd(ptr, out_csd);
     else /* SD mode */
-        err = sd_decode_csd(cmd.response, out_csd);
+        err = sd_decode_csd(ptr, out_csd);
     return err;
 }
 
+/* data must be DMA capable, e.g. a buffer taken from the card's DMA pool */
 static esp_err_t sdmmc_mem_send_cxd_data(sdmmc_card_t* card , int opcode, void *data, size_t datalen)
 {
-    sdmmc_command_t cmd;
-    void *ptr = NULL;
-    esp_err_t error = ESP_OK;
-
-    ptr = malloc(datalen);
-    if (ptr == NULL) {
-        error = ESP_ERR_NO_MEM;
-        goto out;
-    }
-
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.data = ptr;
-    cmd.datalen = datalen;
-    cmd.blklen = datalen;
-    cmd.opcode = opcode;
-    cmd.arg = 0;
-    cmd.flags = SCF_CMD_ADTC | SCF_CMD_READ;
-    if (opcode == MMC_SEND_EXT_CSD)
-        cmd.flags |= SCF_RSP_R1;
-    else
-        cmd.flags |= SCF_RSP_R2;
-
-    error = sdmmc_send_cmd(card, &cmd);
-    if (error == 0)
-        memcpy(data, ptr, datalen);
-
-out:
-    if (ptr != NULL)
-        free(ptr);
-
-    return error;
+    sdmmc_command_t cmd = {
+            .data = data,
+            .datalen = datalen,
+            .blklen = datalen,
+            .opcode = opcode,
+            .arg = 0,
+            .flags = SCF_CMD_ADTC | SCF_CMD_READ |
+                    ((opcode == MMC_SEND_EXT_CSD) ? SCF_RSP_R1 : SCF_RSP_R2),
+    };
+    return sdmmc_send_cmd(card, &cmd);
 }
 
 static esp_err_t sdmmc_send_cmd_select_card(sdmmc_card_t* card, uint32_t rca)
@@ -725,7 +1215,7 @@ static esp_err_t sdmmc_send_cmd_select_card(sdmmc_card_t* card, uint32_t rca)
     return sdmmc_send_cmd(card, &cmd);
 }
 
-/*static esp_err_t sdmmc_decode_scr(uint32_t *raw_scr, sdmmc_scr_t* out_scr)
+static esp_err_t sdmmc_decode_scr(uint32_t *raw_scr, sdmmc_scr_t* out_scr)
 {
     sdmmc_response_t resp = {0xabababab, 0xabababab, 0x12345678, 0x09abcdef};
     resp[1] = __builtin_bswap32(raw_scr[0]);
@@ -736,13 +1226,14 @@ static esp_err_t sdmmc_send_cmd_select_card(sdmmc_card_t* card, uint32_t rca)
     }
     out_scr->sd_spec = SCR_SD_SPEC(resp);
     out_scr->bus_width = SCR_SD_BUS_WIDTHS(resp);
+    out_scr->data_stat_after_erase = SCR_DATA_STAT_AFTER_ERASE(resp);
     return ESP_OK;
-}*/
+}
 
-/*static esp_err_t sdmmc_send_cmd_send_scr(sdmmc_card_t* card, sdmmc_scr_t *out_scr)
+static esp_err_t sdmmc_send_cmd_send_scr(sdmmc_card_t* card, sdmmc_scr_t *out_scr)
 {
     size_t datalen = 8;
-    uint32_t* buf = (uint32_t*) heap_caps_malloc(datalen, MALLOC_CAP_DMA);
+    uint32_t* buf = (uint32_t*) sdEmmc_dma_buf_get(card);
     if (buf == NULL) {
         return ESP_ERR_NO_MEM;
     }
@@ -757,9 +1248,54 @@ static esp_err_t sdmmc_send_cmd_select_card(sdmmc_card_t* card, uint32_t rca)
     if (err == ESP_OK) {
         err = sdmmc_decode_scr(buf, out_scr);
     }
-    free(buf);
+    sdEmmc_dma_buf_put(card, buf);
     return err;
-}*/
+}
+
+static esp_err_t sdmmc_decode_ssr(uint32_t *raw_ssr, sdmmc_ssr_t* out_ssr)
+{
+    /* AU sizes for AU_SIZE values 0xA..0xF; 1..9 are 16KB << (AU_SIZE - 1) */
+    static const uint32_t au_size_large_kb[] = { 8192, 12288, 16384, 24576, 32768, 65536 };
+    static const uint8_t speed_class[] = { 0, 2, 4, 6, 10 };
+
+    uint32_t au = SSR_AU_SIZE(raw_ssr);
+    if (au == 0) {
+        out_ssr->alloc_unit_kb = 0;
+    } else if (au <= 9) {
+        out_ssr->alloc_unit_kb = 16 << (au - 1);
+    } else {
+        out_ssr->alloc_unit_kb = au_size_large_kb[au - 0xA];
+    }
+    out_ssr->erase_size_au = SSR_ERASE_SIZE(raw_ssr);
+    out_ssr->erase_timeout = SSR_ERASE_TIMEOUT(raw_ssr);
+    out_ssr->erase_offset = SSR_ERASE_OFFSET(raw_ssr);
+    uint32_t sc = SSR_SPEED_CLASS(raw_ssr);
+    out_ssr->speed_class = (sc < sizeof(speed_class)) ? speed_class[sc] : 0;
+    out_ssr->uhs_speed_grade = SSR_UHS_SPEED_GRADE(raw_ssr);
+    return ESP_OK;
+}
+
+static esp_err_t sdmmc_send_cmd_sd_status(sdmmc_card_t* card, sdmmc_ssr_t* out_ssr)
+{
+    uint32_t* buf = (uint32_t*) sdEmmc_dma_buf_get(card);
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    sdmmc_command_t cmd = {
+            .data = buf,
+            .datalen = SD_SSR_SIZE,
+            .blklen = SD_SSR_SIZE,
+            .flags = SCF_CMD_ADTC | SCF_CMD_READ | SCF_RSP_R1,
+            .opcode = SD_APP_SD_STATUS
+    };
+    esp_err_t err = sdmmc_send_app_cmd(card, &cmd);
+    if (err == ESP_OK) {
+        flip_byte_order(buf, SD_SSR_SIZE);
+        err = sdmmc_decode_ssr(buf, out_ssr);
+    }
+    sdEmmc_dma_buf_put(card, buf);
+    return err;
+}
 
 /*static esp_err_t sdmmc_send_cmd_set_bus_width(sdmmc_card_t* card, int width)
 {
@@ -796,11 +1332,19 @@ static esp_err_t sdmmc_send_cmd_select_card(sdmmc_card_t* card, uint32_t rca)
     return err;
 }*/
 static esp_err_t sdmmc_mmc_switch(sdmmc_card_t* card, uint8_t set, uint8_t index, uint8_t value)
+{
+    return sdmmc_mmc_switch_timeout(card, set, index, value, 0);
+}
+
+/* timeout_ms: busy time allowed for the switch, 0 for the default */
+static esp_err_t sdmmc_mmc_switch_timeout(sdmmc_card_t* card, uint8_t set, uint8_t index, uint8_t value,
+        uint32_t timeout_ms)
 {
     sdmmc_command_t cmd = {
             .opcode = MMC_SWITCH,
             .arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) | (index << 16) | (value << 8) | set,
             .flags = SCF_RSP_R1B | SCF_CMD_AC,
+            .timeout_ms = timeout_ms,
     };
     esp_err_t err = sdmmc_send_cmd(card, &cmd);
     if (err == ESP_OK) {
@@ -812,7 +1356,7 @@ static esp_err_t sdmmc_mmc_switch(sdmmc_card_t* card, uint8_t set, uint8_t index
     return err;
 }
 
-/*static esp_err_t sdmmc_send_cmd_stop_transmission(sdmmc_card_t* card, uint32_t* status)
+static esp_err_t sdmmc_send_cmd_stop_transmission(sdmmc_card_t* card, uint32_t* status)
 {
     sdmmc_command_t cmd = {
             .opcode = MMC_STOP_TRANSMISSION,
@@ -824,7 +1368,17 @@ static esp_err_t sdmmc_mmc_switch(sdmmc_card_t* card, uint8_t set, uint8_t index
         *status = MMC_R1(cmd.response);
     }
     return err;
-}*/
+}
+
+static esp_err_t sdmmc_send_cmd_set_block_count(sdmmc_card_t* card, size_t block_count, bool reliable)
+{
+    sdmmc_command_t cmd = {
+            .opcode = MMC_SET_BLOCK_COUNT,
+            .arg = block_count | (reliable ? MMC_SET_BLOCK_COUNT_REL_WR : 0),
+            .flags = SCF_RSP_R1 | SCF_CMD_AC
+    };
+    return sdmmc_send_cmd(card, &cmd);
+}
 
 static esp_err_t sdmmc_send_cmd_crc_on_off(sdmmc_card_t* card, bool crc_enable)
 {
@@ -874,7 +1428,7 @@ static esp_err_t sdmmc_send_cmd_send_status(sdmmc_card_t* card, uint32_t* out_st
     return ESP_OK;
 }
 
-esp_err_t sdEmmc_write_sectors(sdmmc_card_t* card, const void* src,
+static esp_err_t sdmmc_write_sectors_copy(sdmmc_card_t* card, const void* src,
         size_t start_block, size_t block_count)
 {
     esp_err_t err = ESP_OK;
@@ -883,9 +1437,9 @@ esp_err_t sdEmmc_write_sectors(sdmmc_card_t* card, const void* src,
         err = sdEmmc_write_sectors_dma(card, src, start_block, block_count);
     } else {
         // SDMMC peripheral needs DMA-capable buffers. Split the write into
-        // separate single block writes, if needed, and allocate a temporary
-        // DMA-capable buffer.
-        void* tmp_buf = heap_caps_malloc(block_size, MALLOC_CAP_DMA);
+        // separate single block writes, if needed, and bounce each block
+        // through a buffer from the card's DMA pool.
+        void* tmp_buf = sdEmmc_dma_buf_get(card);
         if (tmp_buf == NULL) {
             return ESP_ERR_NO_MEM;
         }
@@ -900,74 +1454,323 @@ esp_err_t sdEmmc_write_sectors(sdmmc_card_t* card, const void* src,
                 break;
             }
         }
-        free(tmp_buf);
+        sdEmmc_dma_buf_put(card, tmp_buf);
     }
     return err;
 }
-#define sdEmmc_MILLIS() ( (uint32_t ) (esp_timer_get_time() / 1000) )
 
-esp_err_t sdEmmc_wait_ready(sdmmc_card_t* card, uint32_t timeout_ms){
-    uint32_t status = 0;
-    size_t count = 0;
-    uint32_t t0 =  sdEmmc_MILLIS();
-    if(host_is_spi(card)) return ESP_OK;
-    do {
-        esp_err_t err = sdmmc_send_cmd_send_status(card, &status);
-        if (err != ESP_OK) {
-            return err;
+/* Word-wide scan, eight words per step; stops at the first non-zero word */
+static bool sdmmc_sector_is_zero(const void* sector, size_t size)
+{
+    if ((intptr_t) sector % 4 != 0) {
+        const uint8_t* p = (const uint8_t*) sector;
+        for (size_t i = 0; i < size; ++i) {
+            if (p[i]) {
+                return false;
+            }
         }
-        if (++count % 10 == 0) {
-            log_v( "waiting for card to become ready (%d)", count);
+        return true;
+    }
+    const uint32_t* w = (const uint32_t*) sector;
+    const uint32_t* end = w + size / sizeof(uint32_t);
+    for (; w < end; w += 8) {
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) {
+            return false;
         }
-    }while(!(status & MMC_R1_READY_FOR_DATA) && (sdEmmc_MILLIS() - t0 < timeout_ms));
-    return ESP_OK;
-}
-
-esp_err_t sdEmmc_write_sectors_dma(sdmmc_card_t* card, const void* src,
-        size_t start_block, size_t block_count){
-
-        esp_err_t err = sdEmmc_write_sectors_dma_no_wait(card,src,start_block,block_count);    
-        
-        if(ESP_OK != err) return err;
-        
-        return sdEmmc_wait_ready(card,SDMMC_DEFAULT_CMD_TIMEOUT_MS);        
-        
+    }
+    return true;
 }
 
-esp_err_t sdEmmc_write_sectors_dma_no_wait(sdmmc_card_t* card, const void* src,
+/* Runs of at least zero_erase_sectors all-zero sectors are erased, the rest
+ * is written. Shorter zero runs stay part of the surrounding writes, so data
+ * transfers aren't split for them.
+ */
+static esp_err_t sdmmc_write_sectors_elide(sdmmc_card_t* card, const void* src,
         size_t start_block, size_t block_count)
 {
-    if (start_block + block_count > card->csd.capacity) {
-        return ESP_ERR_INVALID_SIZE;
-    }
-    size_t block_size = card->csd.sector_size;
-    sdmmc_command_t cmd = {
-            .flags = SCF_CMD_ADTC | SCF_RSP_R1,
-            .blklen = block_size,
-            .data = (void*) src,
-            .datalen = block_count * block_size,
-            .timeout_ms = SDMMC_WRITE_CMD_TIMEOUT_MS
-    };
-    if (block_count == 1) {
-        cmd.opcode = MMC_WRITE_BLOCK_SINGLE;
-    } else {
-        cmd.opcode = MMC_WRITE_BLOCK_MULTIPLE;
-    }
-    if (card->ocr & SD_OCR_SDHC_CAP) {
-        cmd.arg = start_block;
+    const size_t block_size = card->csd.sector_size;
+    const uint8_t* p = (const uint8_t*) src;
+    /* without TRIM, MMC erases whole erase groups only */
+    size_t unit = 1;
+    if (sdEmmc_card_is_mmc(card) && !(card->ext_csd.sec_feature & EXT_CSD_SEC_GB_CL_EN)) {
+        unit = MAX(card->timeouts.erase_unit_sectors, 1);
+    }
+    size_t data_start = 0;
+    size_t i = 0;
+    while (i < block_count) {
+        if (!sdmmc_sector_is_zero(p + i * block_size, block_size)) {
+            ++i;
+            continue;
+        }
+        size_t zero_start = i;
+        while (i < block_count && sdmmc_sector_is_zero(p + i * block_size, block_size)) {
+            ++i;
+        }
+        size_t first = (start_block + zero_start + unit - 1) / unit * unit;
+        size_t end = (start_block + i) / unit * unit;
+        if (end <= first || end - first < card->zero_erase_sectors) {
+            continue;
+        }
+        first -= start_block;
+        end -= start_block;
+        esp_err_t err;
+        if (first > data_start) {
+            err = sdmmc_write_sectors_copy(card, p + data_start * block_size,
+                    start_block + data_start, first - data_start);
+            if (err != ESP_OK) {
+                return err;
+            }
+            data_start = first;
+        }
+        err = sdEmmc_erase_sectors(card, start_block + first, end - first);
+        if (err == ESP_ERR_NOT_SUPPORTED) {
+            /* the run is written along with the data following it */
+            continue;
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        log_v( "%s: erased %d zero sectors at %d", __func__, end - first, start_block + first);
+        data_start = end;
+    }
+    if (data_start == block_count) {
+        return ESP_OK;
+    }
+    return sdmmc_write_sectors_copy(card, p + data_start * block_size,
+            start_block + data_start, block_count - data_start);
+}
+
+esp_err_t sdEmmc_write_sectors(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count)
+{
+    if (card->zero_erase_sectors && block_count >= card->zero_erase_sectors) {
+        return sdmmc_write_sectors_elide(card, src, start_block, block_count);
+    }
+    return sdmmc_write_sectors_copy(card, src, start_block, block_count);
+}
+
+size_t sdEmmc_reliable_sectors(const sdmmc_card_t* card)
+{
+    if (!sdEmmc_card_is_mmc(card) || card->ext_csd.rel_wr_sectors == 0) {
+        return 0;
+    }
+    /* the enhanced definition keeps each sector old or new, the legacy one each REL_WR_SEC_C chunk */
+    size_t unit = (card->ext_csd.rel_param & EXT_CSD_WR_REL_PARAM_EN_REL_WR) ? 1 : card->ext_csd.rel_wr_sectors;
+    if (rel_set_active(card)) {
+        return unit;
+    }
+    /* otherwise each write needs SET_BLOCK_COUNT */
+    if (host_is_spi(card) || (card->quirks.flags & SDEMMC_QUIRK_NO_CMD23)) {
+        return 0;
+    }
+    /* and a host which stops multi-block transfers with CMD12 only leaves
+     * single block ones alone */
+    if (unit > 1 && !(card->host.flags & SDMMC_HOST_FLAG_STREAM)) {
+        return 1;
+    }
+    return unit;
+}
+
+esp_err_t sdEmmc_write_sectors_reliable(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count)
+{
+    if (start_block + block_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (block_count == 0) {
+        return ESP_OK;
+    }
+    const size_t unit = sdEmmc_reliable_sectors(card);
+    if (unit == 0 || !(block_count == 1 || (block_count == unit && start_block % unit == 0))) {
+        if (card->journal != NULL && card->part == SDEMMC_PART_USER) {
+            return sdEmmc_journal_write(card, src, start_block, block_count);
+        }
+        return (unit == 0) ? ESP_ERR_NOT_SUPPORTED : ESP_ERR_INVALID_SIZE;
+    }
+    /* one command per atomic unit, so bouncing is limited to what a pool buffer holds */
+    const size_t size = block_count * card->csd.sector_size;
+    void* tmp_buf = NULL;
+    if (!esp_ptr_dma_capable(src) || (intptr_t) src % 4 != 0) {
+        if (size > SDMMC_DMA_POOL_BUF_SIZE) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        tmp_buf = sdEmmc_dma_buf_get(card);
+        if (tmp_buf == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(tmp_buf, src, size);
+        src = tmp_buf;
+    }
+    /* with WR_REL_SET, every write to the partition is a reliable one */
+    esp_err_t err = sdmmc_write_sectors_dma_cmd(card, src, start_block, block_count,
+            !rel_set_active(card));
+    if (err == ESP_OK) {
+        err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+    }
+    sdEmmc_dma_buf_put(card, tmp_buf);
+    return err;
+}
+
+bool sdEmmc_erased_reads_zero(const sdmmc_card_t* card)
+{
+    if (sdEmmc_card_is_mmc(card)) {
+        return card->ext_csd.erased_mem_cont == 0;
+    }
+    return card->scr.data_stat_after_erase == 0;
+}
+
+esp_err_t sdEmmc_set_zero_elision(sdmmc_card_t* card, size_t min_sectors)
+{
+    if (min_sectors == 0) {
+        card->zero_erase_sectors = 0;
+        return ESP_OK;
+    }
+    if (!sdEmmc_erased_reads_zero(card)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (sdEmmc_card_is_mmc(card)) {
+        if (!(card->ext_csd.sec_feature & EXT_CSD_SEC_GB_CL_EN) && !card->ext_csd.erase_group_def) {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+    } else if ((card->csd.card_command_class & SD_CSD_CCC_ERASE) == 0) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    card->zero_erase_sectors = min_sectors;
+    return ESP_OK;
+}
+#define sdEmmc_MILLIS() ( (uint32_t ) (esp_timer_get_time() / 1000) )
+
+esp_err_t sdEmmc_wait_ready(sdmmc_card_t* card, uint32_t timeout_ms){
+    uint32_t status = 0;
+    size_t count = 0;
+    uint32_t t0 =  sdEmmc_MILLIS();
+    if(host_is_spi(card)) return ESP_OK;
+    do {
+        esp_err_t err = sdmmc_send_cmd_send_status(card, &status);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (++count % 10 == 0) {
+            log_v( "waiting for card to become ready (%d)", count);
+        }
+        if (card->quirks.busy_poll_us != 0 && !(status & MMC_R1_READY_FOR_DATA)) {
+            if (card->quirks.busy_poll_us >= portTICK_PERIOD_MS * 1000) {
+                vTaskDelay(card->quirks.busy_poll_us / 1000 / portTICK_PERIOD_MS);
+            } else {
+                ets_delay_us(card->quirks.busy_poll_us);
+            }
+        }
+    }while(!(status & MMC_R1_READY_FOR_DATA) && (sdEmmc_MILLIS() - t0 < timeout_ms));
+    if (!(status & MMC_R1_READY_FOR_DATA)) {
+        log_e( "%s: card not ready after %ums", __func__, timeout_ms);
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+uint32_t sdEmmc_data_timeout_ms(const sdmmc_card_t* card, bool is_write, size_t sector_count)
+{
+    const sdmmc_timeouts_t* t = &card->timeouts;
+    const uint32_t limit = is_write ? SDMMC_WRITE_CMD_TIMEOUT_MS : SDMMC_DEFAULT_CMD_TIMEOUT_MS;
+    if (t->read_ms == 0) {
+        return limit;   // card not initialized yet
+    }
+    /* bits / kbit/s = ms */
+    uint64_t xfer_ms = (uint64_t) sector_count * card->csd.sector_size * 8 /
+            (card->freq_khz * card->bus_width) + 1;
+    uint64_t ms = (is_write ? t->write_ms : t->read_ms) + 2 * xfer_ms;
+    return (uint32_t) MIN(ms, limit);
+}
+
+esp_err_t sdEmmc_write_sectors_dma(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count){
+
+        esp_err_t err = sdmmc_write_sectors_dma_cmd(card, src, start_block, block_count, false);
+        
+        if(ESP_OK != err) return err;
+        
+        return sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+        
+}
+
+static void sdmmc_init_rw_cmd(sdmmc_card_t* card, sdmmc_command_t* cmd, bool is_read,
+        size_t start_block, size_t block_count)
+{
+    size_t block_size = card->csd.sector_size;
+    cmd->flags = SCF_CMD_ADTC | SCF_RSP_R1 | (is_read ? SCF_CMD_READ : 0);
+    cmd->blklen = block_size;
+    cmd->datalen = block_count * block_size;
+    if (is_read) {
+        cmd->opcode = (block_count == 1) ? MMC_READ_BLOCK_SINGLE : MMC_READ_BLOCK_MULTIPLE;
     } else {
-        cmd.arg = start_block * block_size;
+        cmd->opcode = (block_count == 1) ? MMC_WRITE_BLOCK_SINGLE : MMC_WRITE_BLOCK_MULTIPLE;
     }
-    esp_err_t err = sdmmc_send_cmd(card, &cmd);
+    cmd->timeout_ms = sdEmmc_data_timeout_ms(card, !is_read, block_count);
+    if (card->ocr & SD_OCR_SDHC_CAP) {
+        cmd->arg = start_block;
+    } else {
+        cmd->arg = start_block * block_size;
+    }
+}
+
+esp_err_t sdEmmc_write_sectors_dma_no_wait(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count)
+{
+    /* persisted tags and verify readbacks wait for the data to be programmed */
+    if (integrity_active(card) && sdEmmc_integrity_waits(card, start_block, block_count)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return sdmmc_write_sectors_dma_cmd(card, src, start_block, block_count, false);
+}
+
+/* With reliable set, the write is announced by SET_BLOCK_COUNT with the
+ * reliable write flag, which also ends it: no STOP_TRANSMISSION follows.
+ */
+static esp_err_t sdmmc_write_sectors_dma_cmd(sdmmc_card_t* card, const void* src,
+        size_t start_block, size_t block_count, bool reliable)
+{
+    if (start_block + block_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err;
+    if (sparse_active(card)) {
+        /* the map is updated ahead of the data */
+        err = sdEmmc_sparse_on_write(card, start_block, block_count);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    if (integrity_active(card)) {
+        /* so are persisted tags, which become unknown until the data is written */
+        err = sdEmmc_integrity_before_write(card, start_block, block_count);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    sdmmc_command_t cmd = {
+            .data = (void*) src,
+    };
+    sdmmc_init_rw_cmd(card, &cmd, false, start_block, block_count);
+    if (reliable) {
+        err = sdmmc_send_cmd_set_block_count(card, block_count, true);
+        if (err != ESP_OK) {
+            log_e( "%s: set_block_count returned 0x%x", __func__, err);
+            return err;
+        }
+        cmd.opcode = MMC_WRITE_BLOCK_MULTIPLE;
+        cmd.flags |= SCF_NO_AUTO_STOP;
+    }
+    err = sdmmc_send_cmd(card, &cmd);
     if (err != ESP_OK) {
         log_e( "%s: sdmmc_send_cmd returned 0x%x", __func__, err);
         return err;
     }
-
+    if (integrity_active(card)) {
+        return sdEmmc_integrity_on_write(card, src, start_block, block_count);
+    }
     return ESP_OK;
 }
 
-/*
 esp_err_t sdEmmc_read_sectors(sdmmc_card_t* card, void* dst,
         size_t start_block, size_t block_count)
 {
@@ -977,9 +1780,9 @@ esp_err_t sdEmmc_read_sectors(sdmmc_card_t* card, void* dst,
         err = sdEmmc_read_sectors_dma(card, dst, start_block, block_count);
     } else {
         // SDMMC peripheral needs DMA-capable buffers. Split the read into
-        // separate single block reads, if needed, and allocate a temporary
-        // DMA-capable buffer.
-        void* tmp_buf = heap_caps_malloc(block_size, MALLOC_CAP_DMA);
+        // separate single block reads, if needed, and bounce each block
+        // through a buffer from the card's DMA pool.
+        void* tmp_buf = sdEmmc_dma_buf_get(card);
         if (tmp_buf == NULL) {
             return ESP_ERR_NO_MEM;
         }
@@ -987,18 +1790,17 @@ esp_err_t sdEmmc_read_sectors(sdmmc_card_t* card, void* dst,
         for (size_t i = 0; i < block_count; ++i) {
             err = sdEmmc_read_sectors_dma(card, tmp_buf, start_block + i, 1);
             if (err != ESP_OK) {
-                log_d( "%s: error 0x%x writing block %d+%d",
+                log_d( "%s: error 0x%x reading block %d+%d",
                         __func__, err, start_block, i);
                 break;
             }
             memcpy(cur_dst, tmp_buf, block_size);
             cur_dst += block_size;
         }
-        free(tmp_buf);
+        sdEmmc_dma_buf_put(card, tmp_buf);
     }
     return err;
 }
-*/
 
 esp_err_t sdEmmc_read_sectors_dma(sdmmc_card_t* card, void* dst,
         size_t start_block, size_t block_count)
@@ -1012,43 +1814,724 @@ esp_err_t sdEmmc_read_sectors_dma(sdmmc_card_t* card, void* dst,
 		log_e( "%s: sector range would exceed card capacity", __func__);
         return ESP_ERR_INVALID_SIZE;
     }
-    size_t block_size = card->csd.sector_size;
+    if (!sparse_active(card)) {
+        return sdmmc_read_sectors_dma_bus(card, dst, start_block, block_count);
+    }
+    /* never written granules read as zeros, without a transfer */
+    uint8_t* cur_dst = (uint8_t*) dst;
+    while (block_count > 0) {
+        bool written;
+        size_t n = sdEmmc_sparse_run(card, start_block, block_count, &written);
+        if (written) {
+            esp_err_t err = sdmmc_read_sectors_dma_bus(card, cur_dst, start_block, n);
+            if (err != ESP_OK) {
+                return err;
+            }
+        } else {
+            memset(cur_dst, 0, n * card->csd.sector_size);
+            card->sparse->elided_sectors += n;
+        }
+        cur_dst += n * card->csd.sector_size;
+        start_block += n;
+        block_count -= n;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sdmmc_read_sectors_dma_bus(sdmmc_card_t* card, void* dst,
+        size_t start_block, size_t block_count)
+{
     sdmmc_command_t cmd = {
-            .flags = SCF_CMD_ADTC | SCF_CMD_READ | SCF_RSP_R1,
-            .blklen = block_size,
             .data = (void*) dst,
-            .datalen = block_count * block_size
     };
-    if (block_count == 1) {
-        cmd.opcode = MMC_READ_BLOCK_SINGLE;
+    sdmmc_init_rw_cmd(card, &cmd, true, start_block, block_count);
+    esp_err_t err = sdmmc_send_cmd(card, &cmd);
+    if (err != ESP_OK) {
+        log_e( "%s: sdmmc_send_cmd returned 0x%x", __func__, err);
+        return err;
+    }
+    err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, false, 0));
+    if (err == ESP_OK && integrity_active(card)) {
+        err = sdEmmc_integrity_on_read(card, dst, start_block, block_count);
+    }
+    return err;
+}
+
+esp_err_t sdEmmc_recover(sdmmc_card_t* card)
+{
+    /* SPI hosts end multi-block transfers themselves; there's no state to restore */
+    if (host_is_spi(card)) {
+        return ESP_OK;
+    }
+    const uint32_t timeout_ms = sdEmmc_data_timeout_ms(card, true, 0);
+    const uint32_t t0 = sdEmmc_MILLIS();
+    uint32_t status = 0;
+    int stops = 0;
+    esp_err_t err;
+    do {
+        err = sdmmc_send_cmd_send_status(card, &status);
+        if (err == ESP_OK) {
+            int state = MMC_R1_STATE(status);
+            if (state == MMC_R1_STATE_TRAN) {
+                return ESP_OK;
+            }
+            if (state == MMC_R1_STATE_STBY) {
+                err = sdmmc_send_cmd_select_card(card, card->rca);
+                continue;
+            }
+            if ((state == MMC_R1_STATE_DATA || state == MMC_R1_STATE_RCV) &&
+                stops < SDMMC_RECOVER_MAX_STOPS) {
+                ++stops;
+                err = sdmmc_send_cmd_stop_transmission(card, &status);
+                log_d( "%s: stop_transmission in state %d returned 0x%x", __func__, state, err);
+                continue;
+            }
+            /* programming: wait */
+        } else if (stops < SDMMC_RECOVER_MAX_STOPS) {
+            /* no status: the card may be sending data over the response line */
+            ++stops;
+            sdmmc_send_cmd_stop_transmission(card, &status);
+        }
+        vTaskDelay(1);
+    } while (sdEmmc_MILLIS() - t0 < timeout_ms);
+    log_e( "%s: card not in transfer state after %ums (status 0x%x, err 0x%x)",
+            __func__, timeout_ms, status, err);
+    return (err != ESP_OK) ? err : ESP_ERR_TIMEOUT;
+}
+
+/* Errors which may go away if the transfer is repeated */
+static bool sdmmc_is_transient(esp_err_t err)
+{
+    return err == ESP_ERR_TIMEOUT || err == ESP_ERR_INVALID_CRC ||
+           err == ESP_ERR_INVALID_RESPONSE;
+}
+
+/* Transfer the range, recovering and retrying on transient errors.
+ * Ranges which keep failing are split in half, and the rest of the range is
+ * transferred in pieces of that size, until a single sector fails.
+ */
+static esp_err_t sdmmc_rw_sectors_retry(sdmmc_card_t* card, uint8_t* buf,
+        size_t start_block, size_t block_count, bool is_read,
+        const sdmmc_retry_policy_t* policy, size_t* out_done)
+{
+    static const sdmmc_retry_policy_t default_policy = {
+        .retries = SDMMC_DEFAULT_RETRIES,
+        .delay_ms = SDMMC_DEFAULT_RETRY_DELAY_MS,
+    };
+    if (policy == NULL) {
+        policy = &default_policy;
+    }
+    const size_t block_size = card->csd.sector_size;
+    esp_err_t err = ESP_OK;
+    size_t done = 0;
+    size_t chunk = block_count;
+    while (done < block_count) {
+        size_t n = MIN(chunk, block_count - done);
+        uint8_t* p = buf + done * block_size;
+        for (int attempt = 0; ; ++attempt) {
+            err = is_read ? sdEmmc_read_sectors(card, p, start_block + done, n) :
+                    sdEmmc_write_sectors(card, p, start_block + done, n);
+            if (err == ESP_OK || !sdmmc_is_transient(err)) {
+                break;
+            }
+            /* the card may still be sending or receiving data */
+            esp_err_t rerr = sdEmmc_recover(card);
+            if (rerr != ESP_OK) {
+                err = rerr;
+                goto out;
+            }
+            if (attempt == policy->retries) {
+                break;
+            }
+            log_w( "%s: %d+%d failed (0x%x), retry %d", __func__,
+                    start_block + done, n, err, attempt + 1);
+            if (policy->delay_ms) {
+                vTaskDelay(MAX(policy->delay_ms / portTICK_PERIOD_MS, 1));
+            }
+        }
+        if (err == ESP_OK) {
+            done += n;
+        } else if (n > 1 && sdmmc_is_transient(err)) {
+            chunk = (n + 1) / 2;
+        } else {
+            log_e( "%s: sector %d failed (0x%x)", __func__, start_block + done, err);
+            break;
+        }
+    }
+out:
+    if (out_done) {
+        *out_done = done;
+    }
+    return err;
+}
+
+esp_err_t sdEmmc_read_sectors_retry(sdmmc_card_t* card, void* dst,
+        size_t start_sector, size_t sector_count,
+        const sdmmc_retry_policy_t* policy, size_t* out_done)
+{
+    return sdmmc_rw_sectors_retry(card, (uint8_t*) dst, start_sector, sector_count,
+            true, policy, out_done);
+}
+
+esp_err_t sdEmmc_write_sectors_retry(sdmmc_card_t* card, const void* src,
+        size_t start_sector, size_t sector_count,
+        const sdmmc_retry_policy_t* policy, size_t* out_done)
+{
+    return sdmmc_rw_sectors_retry(card, (uint8_t*) src, start_sector, sector_count,
+            false, policy, out_done);
+}
+
+/* Copy len bytes between buf and the segment list, starting at segment *seg
+ * offset *off, and advance the position.
+ */
+static void sdmmc_segs_copy(const sdmmc_segment_t* segs, size_t* seg, size_t* off,
+        uint8_t* buf, size_t len, bool to_segs)
+{
+    while (len > 0) {
+        const sdmmc_segment_t* s = &segs[*seg];
+        size_t n = MIN(len, s->len - *off);
+        uint8_t* p = (uint8_t*) s->data + *off;
+        if (to_segs) {
+            memcpy(p, buf, n);
+        } else {
+            memcpy(buf, p, n);
+        }
+        buf += n;
+        len -= n;
+        *off += n;
+        if (*off == s->len) {
+            ++*seg;
+            *off = 0;
+        }
+    }
+}
+
+static esp_err_t sdmmc_rw_sectorsv(sdmmc_card_t* card, const sdmmc_segment_t* segs, size_t nsegs,
+        size_t start_block, size_t block_count, bool is_read)
+{
+    size_t block_size = card->csd.sector_size;
+    size_t total = 0;
+    bool dma_capable = true;
+    for (size_t i = 0; i < nsegs; ++i) {
+        total += segs[i].len;
+        if (!esp_ptr_dma_capable(segs[i].data) || (intptr_t) segs[i].data % 4 != 0) {
+            dma_capable = false;
+        }
+    }
+    if (total != block_count * block_size) {
+        log_e( "%s: segments hold %d bytes, %d expected", __func__, total, block_count * block_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (start_block + block_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    /* Host maps the segments onto a descriptor chain: one multi-block transfer.
+     * Not with integrity attached, which checks whole sectors in one buffer,
+     * nor with a written-sector map, which has to see each write. */
+    if (dma_capable && (card->host.flags & SDMMC_HOST_FLAG_SG) &&
+        card->integrity == NULL && card->sparse == NULL) {
+        sdmmc_command_t cmd = {
+                .segs = segs,
+                .nsegs = nsegs,
+        };
+        sdmmc_init_rw_cmd(card, &cmd, is_read, start_block, block_count);
+        esp_err_t err = sdmmc_send_cmd(card, &cmd);
+        if (err != ESP_OK) {
+            log_e( "%s: sdmmc_send_cmd returned 0x%x", __func__, err);
+            return err;
+        }
+        return sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, !is_read, 0));
+    }
+
+    /* Otherwise transfer the sector aligned, DMA capable part of each segment
+     * directly, and bounce the sectors which straddle segments through a
+     * temporary buffer.
+     */
+    esp_err_t err = ESP_OK;
+    uint8_t* tmp_buf = NULL;
+    size_t seg = 0;
+    size_t off = 0;
+    size_t block = start_block;
+    size_t left = block_count;
+    while (left > 0) {
+        while (off == segs[seg].len) {
+            ++seg;
+            off = 0;
+        }
+        uint8_t* p = (uint8_t*) segs[seg].data + off;
+        size_t whole = (segs[seg].len - off) / block_size;
+        if (whole > 0 && esp_ptr_dma_capable(p) && (intptr_t) p % 4 == 0) {
+            size_t n = MIN(whole, left);
+            if (is_read) {
+                err = sdEmmc_read_sectors_dma(card, p, block, n);
+            } else {
+                err = sdEmmc_write_sectors_dma(card, p, block, n);
+            }
+            off += n * block_size;
+            block += n;
+            left -= n;
+        } else {
+            if (tmp_buf == NULL) {
+                tmp_buf = (uint8_t*) sdEmmc_dma_buf_get(card);
+                if (tmp_buf == NULL) {
+                    return ESP_ERR_NO_MEM;
+                }
+            }
+            if (is_read) {
+                err = sdEmmc_read_sectors_dma(card, tmp_buf, block, 1);
+                if (err == ESP_OK) {
+                    sdmmc_segs_copy(segs, &seg, &off, tmp_buf, block_size, true);
+                }
+            } else {
+                sdmmc_segs_copy(segs, &seg, &off, tmp_buf, block_size, false);
+                err = sdEmmc_write_sectors_dma(card, tmp_buf, block, 1);
+            }
+            block += 1;
+            left -= 1;
+        }
+        if (err != ESP_OK) {
+            log_d( "%s: error 0x%x at block %d", __func__, err, block);
+            break;
+        }
+    }
+    sdEmmc_dma_buf_put(card, tmp_buf);
+    return err;
+}
+
+esp_err_t sdEmmc_write_sectorsv(sdmmc_card_t* card, const sdmmc_segment_t* segs, size_t nsegs,
+        size_t start_sector, size_t sector_count)
+{
+    return sdmmc_rw_sectorsv(card, segs, nsegs, start_sector, sector_count, false);
+}
+
+esp_err_t sdEmmc_read_sectorsv(sdmmc_card_t* card, const sdmmc_segment_t* segs, size_t nsegs,
+        size_t start_sector, size_t sector_count)
+{
+    return sdmmc_rw_sectorsv(card, segs, nsegs, start_sector, sector_count, true);
+}
+
+void sdEmmc_merge_init(sdEmmc_merge_t* merge, const sdmmc_card_t* card,
+        sdmmc_segment_t* segs, size_t max_segs, size_t max_sectors)
+{
+    *merge = (sdEmmc_merge_t) {
+        .max_sectors = max_sectors,
+        .sector_size = card->csd.sector_size,
+        .segs = segs,
+        .max_segs = max_segs,
+    };
+}
+
+bool sdEmmc_merge_add(sdEmmc_merge_t* merge, bool is_write, size_t start_sector,
+        size_t sector_count, void* buf)
+{
+    const size_t len = sector_count * merge->sector_size;
+    if (merge->nsegs == 0) {
+        merge->is_write = is_write;
+        merge->start_sector = start_sector;
+        merge->sector_count = sector_count;
+        merge->segs[0] = (sdmmc_segment_t) { .data = buf, .len = len };
+        merge->nsegs = 1;
+        return true;
+    }
+    if (is_write != merge->is_write ||
+        start_sector != merge->start_sector + merge->sector_count ||
+        sector_count > merge->max_sectors - merge->sector_count) {
+        return false;
+    }
+    /* requests which also continue each other in memory share a segment */
+    sdmmc_segment_t* last = &merge->segs[merge->nsegs - 1];
+    if (buf == (uint8_t*) last->data + last->len) {
+        last->len += len;
+    } else if (merge->nsegs < merge->max_segs) {
+        merge->segs[merge->nsegs++] = (sdmmc_segment_t) { .data = buf, .len = len };
     } else {
-        cmd.opcode = MMC_READ_BLOCK_MULTIPLE;
+        return false;
     }
-    if (card->ocr & SD_OCR_SDHC_CAP) {
-        cmd.arg = start_block;
+    merge->sector_count += sector_count;
+    return true;
+}
+
+esp_err_t sdEmmc_merge_transfer(sdmmc_card_t* card, const sdEmmc_merge_t* merge)
+{
+    if (merge->nsegs == 1) {
+        return merge->is_write ?
+                sdEmmc_write_sectors(card, merge->segs[0].data, merge->start_sector, merge->sector_count) :
+                sdEmmc_read_sectors(card, merge->segs[0].data, merge->start_sector, merge->sector_count);
+    }
+    return merge->is_write ?
+            sdEmmc_write_sectorsv(card, merge->segs, merge->nsegs, merge->start_sector, merge->sector_count) :
+            sdEmmc_read_sectorsv(card, merge->segs, merge->nsegs, merge->start_sector, merge->sector_count);
+}
+
+esp_err_t sdEmmc_stream_open(sdEmmc_stream_t* stream, sdmmc_card_t* card,
+        size_t start_sector, sdEmmc_stream_dir_t dir)
+{
+    if (start_sector > card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->card = card;
+    stream->dir = dir;
+    stream->next_sector = start_sector;
+    return ESP_OK;
+}
+
+/* End the open transfer, or wait for the last per-call write */
+static esp_err_t sdmmc_stream_end(sdEmmc_stream_t* stream)
+{
+    sdmmc_card_t* card = stream->card;
+    const bool is_write = stream->dir == SDEMMC_STREAM_WRITE;
+    esp_err_t err = ESP_OK;
+    if (stream->open) {
+        stream->open = false;
+        uint32_t status = 0;
+        err = sdmmc_send_cmd_stop_transmission(card, &status);
+        if (err != ESP_OK) {
+            log_e( "%s: stop_transmission returned 0x%x", __func__, err);
+            return sdEmmc_recover(card) == ESP_OK ? err : ESP_ERR_INVALID_STATE;
+        }
+    } else if (!stream->busy) {
+        return ESP_OK;
+    }
+    stream->busy = false;
+    return sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, is_write, 0));
+}
+
+static esp_err_t sdmmc_stream_rw(sdEmmc_stream_t* stream, void* buf, size_t sector_count,
+        sdEmmc_stream_dir_t dir)
+{
+    sdmmc_card_t* card = stream->card;
+    const bool is_read = dir == SDEMMC_STREAM_READ;
+    if (stream->dir != dir || !esp_ptr_dma_capable(buf) || (intptr_t) buf % 4 != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (stream->next_sector + sector_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (sector_count == 0) {
+        return ESP_OK;
+    }
+    esp_err_t err;
+    if ((card->host.flags & SDMMC_HOST_FLAG_STREAM) && card->integrity == NULL && card->sparse == NULL) {
+        sdmmc_command_t cmd = {
+                .data = buf,
+        };
+        /* always a multi-block command, so that it can be continued */
+        sdmmc_init_rw_cmd(card, &cmd, is_read, stream->next_sector, MAX(sector_count, 2));
+        cmd.datalen = sector_count * card->csd.sector_size;
+        cmd.flags |= SCF_NO_AUTO_STOP | (stream->open ? SCF_DATA_ONLY : 0);
+        if (!stream->open) {
+            stream->commands++;
+        }
+        err = sdmmc_send_cmd(card, &cmd);
+        if (err != ESP_OK) {
+            log_e( "%s: sdmmc_send_cmd returned 0x%x", __func__, err);
+            stream->open = false;
+            sdEmmc_recover(card);
+            return err;
+        }
+        stream->open = true;
     } else {
-        cmd.arg = start_block * block_size;
+        if (stream->busy) {
+            stream->busy = false;
+            err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        stream->commands++;
+        if (is_read) {
+            err = sdEmmc_read_sectors_dma(card, buf, stream->next_sector, sector_count);
+        } else {
+            err = sdEmmc_write_sectors_dma_no_wait(card, buf, stream->next_sector, sector_count);
+            stream->busy = (err == ESP_OK);
+            if (err == ESP_ERR_NOT_SUPPORTED) {
+                err = sdEmmc_write_sectors_dma(card, buf, stream->next_sector, sector_count);
+            }
+        }
+        if (err != ESP_OK) {
+            sdEmmc_recover(card);
+            return err;
+        }
+    }
+    stream->next_sector += sector_count;
+    stream->sectors += sector_count;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_stream_write(sdEmmc_stream_t* stream, const void* src, size_t sector_count)
+{
+    return sdmmc_stream_rw(stream, (void*) src, sector_count, SDEMMC_STREAM_WRITE);
+}
+
+esp_err_t sdEmmc_stream_read(sdEmmc_stream_t* stream, void* dst, size_t sector_count)
+{
+    return sdmmc_stream_rw(stream, dst, sector_count, SDEMMC_STREAM_READ);
+}
+
+esp_err_t sdEmmc_stream_seek(sdEmmc_stream_t* stream, size_t sector)
+{
+    if (sector > stream->card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (sector == stream->next_sector) {
+        return ESP_OK;
+    }
+    esp_err_t err = stream->open ? sdmmc_stream_end(stream) : ESP_OK;
+    stream->next_sector = sector;
+    return err;
+}
+
+esp_err_t sdEmmc_stream_close(sdEmmc_stream_t* stream)
+{
+    return sdmmc_stream_end(stream);
+}
+
+static uint32_t sdmmc_erase_timeout_ms(const sdmmc_card_t* card, size_t block_count)
+{
+    const sdmmc_timeouts_t* t = &card->timeouts;
+    if (t->erase_unit_sectors == 0) {
+        return SDMMC_WRITE_CMD_TIMEOUT_MS;  // card not initialized yet
+    }
+    uint64_t units = (block_count + t->erase_unit_sectors - 1) / t->erase_unit_sectors;
+    uint64_t ms = units * t->erase_ms + t->erase_offset_ms;
+    return (uint32_t) MIN(MAX(ms, SDMMC_MIN_CMD_TIMEOUT_MS), UINT32_MAX);
+}
+
+esp_err_t sdEmmc_erase_sectors(sdmmc_card_t* card, size_t start_block, size_t block_count)
+{
+    if (block_count == 0) {
+        return ESP_OK;
+    }
+    if (start_block + block_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const bool is_mmc = sdEmmc_card_is_mmc(card);
+    uint32_t erase_arg = MMC_ERASE_ARG_ERASE;
+    if (is_mmc) {
+        /* plain erase works on whole erase groups; TRIM on write blocks */
+        size_t unit = card->timeouts.erase_unit_sectors;
+        if (card->ext_csd.sec_feature & EXT_CSD_SEC_GB_CL_EN) {
+            erase_arg = MMC_ERASE_ARG_TRIM;
+        } else if (!card->ext_csd.erase_group_def ||
+                   start_block % unit != 0 || block_count % unit != 0) {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+    } else if ((card->csd.card_command_class & SD_CSD_CCC_ERASE) == 0) {
+        return ESP_ERR_NOT_SUPPORTED;
     }
+
+    const size_t first_block = start_block;
+    size_t end_block = start_block + block_count - 1;
+    if ((card->ocr & SD_OCR_SDHC_CAP) == 0) {
+        start_block *= card->csd.sector_size;
+        end_block *= card->csd.sector_size;
+    }
+    sdmmc_command_t cmd = {
+        .opcode = is_mmc ? MMC_ERASE_GROUP_START : SD_ERASE_WR_BLK_START,
+        .arg = start_block,
+        .flags = SCF_CMD_AC | SCF_RSP_R1,
+    };
     esp_err_t err = sdmmc_send_cmd(card, &cmd);
+    if (err == ESP_OK) {
+        cmd = (sdmmc_command_t) {
+            .opcode = is_mmc ? MMC_ERASE_GROUP_END : SD_ERASE_WR_BLK_END,
+            .arg = end_block,
+            .flags = SCF_CMD_AC | SCF_RSP_R1,
+        };
+        err = sdmmc_send_cmd(card, &cmd);
+    }
     if (err != ESP_OK) {
-        log_e( "%s: sdmmc_send_cmd returned 0x%x", __func__, err);
+        log_e( "%s: setting erase range returned 0x%x", __func__, err);
         return err;
     }
-    uint32_t status = 0;
-    size_t count = 0;
-    while (!host_is_spi(card) && !(status & MMC_R1_READY_FOR_DATA)) {
-        // TODO: add some timeout here
-        err = sdmmc_send_cmd_send_status(card, &status);
+    uint32_t timeout_ms = sdmmc_erase_timeout_ms(card, block_count);
+    cmd = (sdmmc_command_t) {
+        .opcode = MMC_ERASE,
+        .arg = erase_arg,
+        .flags = SCF_CMD_AC | SCF_RSP_R1B,
+        .timeout_ms = timeout_ms,
+    };
+    err = sdmmc_send_cmd(card, &cmd);
+    if (err != ESP_OK) {
+        log_e( "%s: erase returned 0x%x", __func__, err);
+        return err;
+    }
+    err = sdEmmc_wait_ready(card, timeout_ms);
+    if (err == ESP_OK && integrity_active(card)) {
+        err = sdEmmc_integrity_on_erase(card, first_block, block_count);
+    }
+    if (err == ESP_OK && sparse_active(card)) {
+        err = sdEmmc_sparse_on_erase(card, first_block, block_count);
+    }
+    return err;
+}
+
+static esp_err_t sdmmc_send_cmd_sleep_awake(sdmmc_card_t* card, bool sleep)
+{
+    sdmmc_command_t cmd = {
+            .opcode = MMC_SLEEP_AWAKE,
+            .arg = MMC_ARG_RCA(card->rca) | (sleep ? MMC_SLEEP_AWAKE_SLEEP : 0),
+            .flags = SCF_CMD_AC | SCF_RSP_R1B,
+            .timeout_ms = card->ext_csd.sleep_awake_ms,
+    };
+    return sdmmc_send_cmd(card, &cmd);
+}
+
+esp_err_t sdEmmc_sleep(sdmmc_card_t* card)
+{
+    if (!sdEmmc_card_is_mmc(card) || host_is_spi(card)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    esp_err_t err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (card->ext_csd.power_off_notify && card->ext_csd.sleep_notify_ms != 0) {
+        err = sdmmc_mmc_switch_timeout(card, EXT_CSD_CMD_SET_NORMAL,
+                EXT_CSD_POWER_OFF_NOTIFICATION, EXT_CSD_SLEEP_NOTIFICATION,
+                card->ext_csd.sleep_notify_ms);
         if (err != ESP_OK) {
+            log_e( "%s: sleep notification returned 0x%x", __func__, err);
             return err;
         }
-        if (++count % 10 == 0) {
-            log_v( "waiting for card to become ready (%d)", count);
+    }
+    /* SLEEP is only accepted in stand-by state */
+    err = sdmmc_send_cmd_select_card(card, 0);
+    if (err != ESP_OK) {
+        log_e( "%s: deselect returned 0x%x", __func__, err);
+        return err;
+    }
+    err = sdmmc_send_cmd_sleep_awake(card, true);
+    if (err != ESP_OK) {
+        log_e( "%s: sleep returned 0x%x", __func__, err);
+        return err;
+    }
+    log_d( "%s: card asleep", __func__);
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_awake(sdmmc_card_t* card)
+{
+    if (!sdEmmc_card_is_mmc(card) || host_is_spi(card)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    esp_err_t err = sdmmc_send_cmd_sleep_awake(card, false);
+    if (err != ESP_OK) {
+        log_e( "%s: awake returned 0x%x", __func__, err);
+        return err;
+    }
+    err = sdmmc_send_cmd_select_card(card, card->rca);
+    if (err != ESP_OK) {
+        log_e( "%s: select_card returned 0x%x", __func__, err);
+        return err;
+    }
+    /* sleep notification replaced POWERED_ON */
+    if (card->ext_csd.power_off_notify && card->ext_csd.sleep_notify_ms != 0) {
+        err = sdmmc_mmc_switch_timeout(card, EXT_CSD_CMD_SET_NORMAL,
+                EXT_CSD_POWER_OFF_NOTIFICATION, EXT_CSD_POWERED_ON, card->ext_csd.cmd6_ms);
+        if (err != ESP_OK) {
+            log_e( "%s: setting POWERED_ON returned 0x%x", __func__, err);
+            return err;
         }
     }
+    log_d( "%s: card awake", __func__);
+    return ESP_OK;
+}
+
+size_t sdEmmc_part_sectors(const sdmmc_card_t* card, sdEmmc_part_t part)
+{
+    if (part == SDEMMC_PART_USER) {
+        return card->csd.capacity;
+    }
+    if (!sdEmmc_card_is_mmc(card) || part < 0 || part > SDEMMC_PART_GP4 ||
+        part == EXT_CSD_PART_CONFIG_ACC_RPMB) {
+        return 0;
+    }
+    return card->ext_csd.part_sectors[part];
+}
+
+esp_err_t sdEmmc_part_select(sdmmc_card_t* card, sdEmmc_part_t part)
+{
+    if (part == card->part) {
+        return ESP_OK;
+    }
+    if (sdEmmc_part_sectors(card, part) == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    /* the switch is rejected while the card is programming */
+    esp_err_t err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint8_t value = (card->ext_csd.part_config & ~EXT_CSD_PART_CONFIG_ACC_MASK) | part;
+    err = sdmmc_mmc_switch_timeout(card, EXT_CSD_CMD_SET_NORMAL, EXT_CSD_PART_CONFIG, value,
+            card->ext_csd.part_switch_ms);
+    if (err != ESP_OK) {
+        log_e( "%s: switch to partition %d returned 0x%x", __func__, part, err);
+        return err;
+    }
+    log_v( "%s: partition %d -> %d", __func__, card->part, part);
+    card->ext_csd.part_config = value;
+    card->part = part;
     return ESP_OK;
 }
 
+/* Back to the user area after a partition access, so that calls which don't
+ * name a partition (diskio, sdEmmc_log, sdEmmc_stage...) keep going there.
+ * No switch if the access was to the user area.
+ */
+static esp_err_t part_restore_user(sdmmc_card_t* card, esp_err_t err)
+{
+    esp_err_t restore = sdEmmc_part_select(card, SDEMMC_PART_USER);
+    return (err != ESP_OK) ? err : restore;
+}
+
+esp_err_t sdEmmc_part_read(sdmmc_card_t* card, sdEmmc_part_t part, void* dst,
+        size_t start_sector, size_t sector_count)
+{
+    if (start_sector + sector_count > sdEmmc_part_sectors(card, part)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = sdEmmc_part_select(card, part);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = sdEmmc_read_sectors(card, dst, start_sector, sector_count);
+    return part_restore_user(card, err);
+}
+
+esp_err_t sdEmmc_part_write(sdmmc_card_t* card, sdEmmc_part_t part, const void* src,
+        size_t start_sector, size_t sector_count)
+{
+    if (start_sector + sector_count > sdEmmc_part_sectors(card, part)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = sdEmmc_part_select(card, part);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = sdEmmc_write_sectors(card, src, start_sector, sector_count);
+    return part_restore_user(card, err);
+}
+
+esp_err_t sdEmmc_power_off_notify(sdmmc_card_t* card)
+{
+    if (!sdEmmc_card_is_mmc(card) || !card->ext_csd.power_off_notify) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    esp_err_t err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+    if (err == ESP_OK) {
+        err = sdmmc_mmc_switch_timeout(card, EXT_CSD_CMD_SET_NORMAL,
+                EXT_CSD_POWER_OFF_NOTIFICATION, EXT_CSD_POWER_OFF_SHORT, card->ext_csd.cmd6_ms);
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: returned 0x%x", __func__, err);
+    }
+    return err;
+}
+
 /*static esp_err_t sdmmc_send_cmd_switch_func(sdmmc_card_t* card,
         uint32_t mode, uint32_t group, uint32_t function,
         sdmmc_switch_func_rsp_t* resp)
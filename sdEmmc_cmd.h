@@ -15,11 +15,96 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdbool.h>
 #include "esp_err.h"
 #include "sdEmmc_types.h"
 #include "sdEmmc_defs.h"
 #include "sdEmmc_host.h"
 
+/* Build time protocol selection. By default SD and MMC cards are detected at
+ * run time, on either the SD/MMC bus or the SPI bus. Defining any of these to 0
+ * (e.g. -DSDEMMC_CONFIG_SD=0 for an eMMC-only product) turns the corresponding
+ * run time checks into constants, so the code of the disabled protocols is
+ * dropped and the command paths don't test the card type or bus at all.
+ */
+#ifndef SDEMMC_CONFIG_SD
+#define SDEMMC_CONFIG_SD            1   // SD memory cards (SDSC, SDHC, SDXC)
+#endif
+#ifndef SDEMMC_CONFIG_MMC
+#define SDEMMC_CONFIG_MMC           1   // MMC and eMMC
+#endif
+#ifndef SDEMMC_CONFIG_SDMMC_BUS
+#define SDEMMC_CONFIG_SDMMC_BUS     1   // hosts driving the SD/MMC bus
+#endif
+#ifndef SDEMMC_CONFIG_SPI_BUS
+#define SDEMMC_CONFIG_SPI_BUS       1   // hosts driving the card in SPI mode (SDMMC_HOST_FLAG_SPI)
+#endif
+
+#if !SDEMMC_CONFIG_SD && !SDEMMC_CONFIG_MMC
+#error "sdEmmc: SDEMMC_CONFIG_SD and SDEMMC_CONFIG_MMC can't both be disabled"
+#endif
+#if !SDEMMC_CONFIG_SDMMC_BUS && !SDEMMC_CONFIG_SPI_BUS
+#error "sdEmmc: SDEMMC_CONFIG_SDMMC_BUS and SDEMMC_CONFIG_SPI_BUS can't both be disabled"
+#endif
+
+/**
+ * Whether an initialized card is an MMC/eMMC rather than an SD card
+ *
+ * With only one of SDEMMC_CONFIG_SD and SDEMMC_CONFIG_MMC enabled this is a
+ * constant, so callers' branches for the other card type are compiled out.
+ *
+ * @param card  card information structure initialized using sdEmmc_card_init
+ * @return true for MMC/eMMC cards
+ */
+static inline bool sdEmmc_card_is_mmc(const sdmmc_card_t* card)
+{
+#if !SDEMMC_CONFIG_SD
+    return true;
+#elif !SDEMMC_CONFIG_MMC
+    return false;
+#else
+    return (card->host.flags & SDMMC_HOST_MMC_CARD) != 0;
+#endif
+}
+
+/* Stack. The driver keeps no sector sized buffers on the stack: EXT_CSD, SSR
+ * and bounce sectors come from the card's DMA pool, so a call only needs its
+ * command descriptors and call frames. Worst case driver stack per call, as
+ * computed by extras/stack_usage.py from the call graph of a -Os build:
+ *
+ *   for f in *.c; do $CC $CFLAGS -Os -fcallgraph-info=su -c $f; done
+ *   python3 extras/stack_usage.py *.ci
+ *
+ * The figures below come from GCC 12 for x86-64; frames of the Xtensa
+ * windowed ABI differ, so re-run the script over an xtensa-esp32-elf-gcc
+ * build before sizing a task on them. They include the metadata writes of
+ * an attached sdEmmc_sparse, sdEmmc_integrity or sdEmmc_journal, but not
+ * the host's do_transaction nor log output (keep CORE_DEBUG_LEVEL below the
+ * driver's log_d/log_v calls on small stacks, as log formatting needs far more):
+ *
+ *   sdEmmc_wait_ready, _recover, _sleep, _awake, _part_select     320 bytes
+ *   sdEmmc_power_off_notify, _stream_close, _stream_seek           384 bytes
+ *   sdEmmc_read_sectors, _read_sectors_dma, _part_read             624 bytes
+ *   sdEmmc_card_init, _card_init_multi                             672 bytes
+ *   sdEmmc_log_read_segment, _log_mount                            704 bytes
+ *   sdEmmc_host_spi_do_transaction                                 744 bytes
+ *   sdEmmc_write_sectors_dma, _write_sectors_dma_no_wait          1216 bytes
+ *   sdEmmc_stage_write, _stage_flush                              1328 bytes
+ *   sdEmmc_sparse_attach, _journal_attach                         1392 bytes
+ *   sdEmmc_log_format, _log_append, _log_sync                     1408 bytes
+ *   sdEmmc_stream_read/write, _read/write_sectorsv                1432 bytes
+ *   sdEmmc_erase_sectors                                          1504 bytes
+ *   sdEmmc_tune                                                   1616 bytes
+ *   sdEmmc_write_sectors, _part_write                             1696 bytes
+ *   sdEmmc_read/write_sectors_retry                               1792 bytes
+ *   sdEmmc_journal_write, _write_sectors_reliable                 1824 bytes
+ *   sdEmmc_submit_batch                                           2056 bytes
+ *
+ * sdEmmc_io_* and sdEmmc_ring_* only queue requests (under 160 bytes); the
+ * transfers run on the service task, whose stack_size must cover the rows
+ * above for the calls it makes.
+ */
+
 #define SDMMC_GO_IDLE_DELAY_MS      20
 
 /* These delay values are mostly useful for cases when CD pin is not used, and
@@ -30,6 +115,33 @@
 #define SDMMC_DEFAULT_CMD_TIMEOUT_MS  1000   // Max timeout of ordinary commands
 #define SDMMC_WRITE_CMD_TIMEOUT_MS    5000   // Max timeout of write commands
 
+/* Once the card is initialized, data commands are given timeouts computed from
+ * the access times the card reports, plus twice the time the transfer takes on
+ * the bus. The limits below come from the SD physical layer specification;
+ * SDMMC_DEFAULT_CMD_TIMEOUT_MS and SDMMC_WRITE_CMD_TIMEOUT_MS remain the caps.
+ */
+#define SDMMC_MIN_CMD_TIMEOUT_MS      20     // Floor of card-derived timeouts, leaves room for task scheduling
+#define SDMMC_SD_READ_TIMEOUT_MS      100    // Max read access time of SD cards
+#define SDMMC_SD_WRITE_TIMEOUT_MS     250    // Max busy time of SDSC/SDHC cards per written block
+#define SDMMC_SDXC_WRITE_TIMEOUT_MS   500    // Max busy time of SDXC cards per written block
+#define SDMMC_SD_ERASE_TIMEOUT_MS     250    // Erase time per block if the card doesn't report erase timing
+#define SDMMC_MMC_ERASE_TIMEOUT_MS    300    // Unit of EXT_CSD ERASE_TIMEOUT_MULT
+
+#define SDMMC_DEFAULT_RETRIES         2      // Retries of a failed range if no retry policy is given
+#define SDMMC_DEFAULT_RETRY_DELAY_MS  10     // Delay before each retry if no retry policy is given
+#define SDMMC_RECOVER_MAX_STOPS       3      // STOP_TRANSMISSION attempts while recovering a card
+
+#define SDMMC_INIT_TASK_STACK_SIZE      4096   // Stack of the tasks started by sdEmmc_card_init_multi
+
+#if SDEMMC_CONFIG_LOW_MEMORY
+/* enough for the transfer paths; sdEmmc_log and verify_after_write integrity take one more each */
+#define SDMMC_DEFAULT_DMA_POOL_BUFFERS  2      // DMA pool size if sdmmc_host_t::dma_pool_buffers is 0
+#else
+#define SDMMC_DEFAULT_DMA_POOL_BUFFERS  4      // DMA pool size if sdmmc_host_t::dma_pool_buffers is 0
+#endif
+#define SDMMC_DMA_POOL_BUF_SIZE         512    // Size of each DMA pool buffer (a sector, or EXT_CSD)
+#define SDMMC_MAX_LIVE_POOLS            8      // Pools tracked so that sdEmmc_card_init can release them on re-init
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,15 +152,69 @@ extern "C" {
  * @note Only SD cards (SDSC and SDHC/SDXC) are supported now.
  *       Support for MMC/eMMC cards will be added later.
  *
+ * A pool of host.dma_pool_buffers DMA capable buffers is allocated for the
+ * card and used for all driver-internal transfers; the driver doesn't
+ * allocate memory after this call. Release the pool with sdEmmc_card_deinit
+ * before the card structure is discarded. Initializing a card structure
+ * again releases the pool of its previous initialization first; out_card
+ * may otherwise be uninitialized.
+ *
  * @param host  pointer to structure defining host controller
  * @param out_card  pointer to structure which will receive information about the card when the function completes
  * @return
  *      - ESP_OK on success
+ *      - ESP_ERR_NO_MEM if the DMA buffer pool can not be allocated
  *      - One of the error codes from SDMMC host controller
  */
 esp_err_t sdEmmc_card_init(const sdmmc_host_t* host,
         sdmmc_card_t* out_card);
 
+/**
+ * Initialize several cards concurrently
+ *
+ * Each card past the first is initialized by sdEmmc_card_init in a task of
+ * its own, at the caller's priority, while the calling task initializes the
+ * first one, so the OCR polling, EXT_CSD reads and switch delays of the cards
+ * overlap. Commands still go through each host's do_transaction, which
+ * serializes access to a shared controller.
+ *
+ * @param hosts  host of each card; each on a different slot
+ * @param cards  card information structures to fill in
+ * @param n  number of cards
+ * @param out_errs  if not NULL, receives the result of sdEmmc_card_init for each card
+ * @return
+ *      - ESP_OK if all cards were initialized, or n is 0
+ *      - ESP_ERR_INVALID_ARG if two hosts use the same slot
+ *      - ESP_ERR_NO_MEM if the bookkeeping can't be allocated
+ *      - otherwise the error of the first card which failed; the other cards may be usable
+ */
+esp_err_t sdEmmc_card_init_multi(const sdmmc_host_t* hosts, sdmmc_card_t* cards, size_t n,
+        esp_err_t* out_errs);
+
+/**
+ * Release resources allocated by sdEmmc_card_init
+ *
+ * @param card  card information structure initialized using sdEmmc_card_init
+ */
+void sdEmmc_card_deinit(sdmmc_card_t* card);
+
+/**
+ * Take a buffer from the card's DMA pool
+ *
+ * @param card  card information structure initialized using sdEmmc_card_init
+ * @return DMA capable, word aligned buffer of SDMMC_DMA_POOL_BUF_SIZE bytes,
+ *         or NULL if all buffers are in use
+ */
+void* sdEmmc_dma_buf_get(sdmmc_card_t* card);
+
+/**
+ * Return a buffer taken with sdEmmc_dma_buf_get to the card's DMA pool
+ *
+ * @param card  card information structure initialized using sdEmmc_card_init
+ * @param buf  buffer to return; NULL is ignored
+ */
+void sdEmmc_dma_buf_put(sdmmc_card_t* card, void* buf);
+
 /**
  * @brief Print information about the card to a stream
  * @param stream  stream obtained using fopen or fdopen
@@ -59,6 +225,9 @@ void sdEmmc_card_print_info(FILE* stream, const sdmmc_card_t* card);
 /**
  * Write given number of sectors to SD/MMC card
  *
+ * With zero elision enabled (sdEmmc_set_zero_elision), runs of all-zero
+ * sectors are erased instead of transferred.
+ *
  * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
  * @param src   pointer to data buffer to read data from; data size must be equal to sector_count * card->csd.sector_size
  * @param start_sector  sector where to start writing
@@ -75,14 +244,62 @@ esp_err_t sdEmmc_write_sectors(sdmmc_card_t* card, const void* src,
 esp_err_t sdEmmc_write_sectors_dma(sdmmc_card_t* card, const void* src,
         size_t start_block, size_t block_count);    
 
+/**
+ * Write sectors from a DMA capable buffer, returning once the data is
+ * transferred, without waiting for the card to program it
+ *
+ * Call sdEmmc_wait_ready before the next command to the card.
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_SUPPORTED if an attached sdEmmc_integrity would have to
+ *        wait for the write (sdEmmc_integrity_waits); use sdEmmc_write_sectors_dma
+ *      - One of the error codes from SDMMC host controller
+ */
 esp_err_t sdEmmc_write_sectors_dma_no_wait(sdmmc_card_t* card, const void* src,
         size_t start_block, size_t block_count);    
 
-esp_err_t sdEmmc_wait_ready(sdmmc_card_t* card, uint32_t timeout_ms);        
+/**
+ * Poll card status until the card is ready for data
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param timeout_ms  how long to poll, in milliseconds
+ * @return
+ *      - ESP_OK if the card is ready (always, in SPI mode)
+ *      - ESP_ERR_TIMEOUT if the card didn't become ready in time
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_wait_ready(sdmmc_card_t* card, uint32_t timeout_ms);
+
+/**
+ * Timeout of a data transfer, scaled by its size
+ *
+ * Access time reported by the card plus twice the time the data takes on
+ * the bus at the current clock and bus width.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param is_write  true for writes, false for reads
+ * @param sector_count  number of sectors transferred
+ * @return timeout in milliseconds
+ */
+uint32_t sdEmmc_data_timeout_ms(const sdmmc_card_t* card, bool is_write, size_t sector_count);
+
+/**
+ * Recompute card->timeouts after card->freq_khz was changed
+ *
+ * The clock dependent part of the access time (NSAC) scales with the card
+ * clock. Used by sdEmmc_clock when it changes steps.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ */
+void sdEmmc_update_timeouts(sdmmc_card_t* card);
 
 /**
  * Read given number of sectors to SD/MMC card
  *
+ * With a written-sector map attached (sdEmmc_sparse_attach), sectors which
+ * were never written are zero filled instead of read.
+ *
  * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
  * @param dst   pointer to DMA buffer to read into; buffer size must be at least sector_count * card->csd.sector_size
  * @param start_sector  sector where to start reading
@@ -94,6 +311,395 @@ esp_err_t sdEmmc_wait_ready(sdmmc_card_t* card, uint32_t timeout_ms);
 esp_err_t sdEmmc_read_sectors_dma(sdmmc_card_t* card, void* dst,
         size_t start_sector, size_t sector_count);
 
+/**
+ * Return the card to transfer state after a failed transfer
+ *
+ * Polls the card state with SEND_STATUS (CMD13), ends a data transfer the
+ * card is still in with STOP_TRANSMISSION (CMD12), waits out programming and
+ * re-selects a card which fell back to stand-by. This takes a few commands,
+ * instead of the full re-initialization with sdEmmc_card_init.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @return
+ *      - ESP_OK if the card is in transfer state (always, in SPI mode)
+ *      - ESP_ERR_TIMEOUT if it didn't get there within the card's write timeout
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_recover(sdmmc_card_t* card);
+
+/**
+ * Read sectors, recovering from transient errors
+ *
+ * A range failing with a timeout or CRC error is retried after
+ * sdEmmc_recover, up to policy->retries times, then split in half until the
+ * failing sector is isolated. Ranges which succeed are not read again.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param dst   pointer to buffer to read into, as for sdEmmc_read_sectors
+ * @param start_sector  sector where to start reading
+ * @param sector_count  number of sectors to read
+ * @param policy  retry policy, or NULL for SDMMC_DEFAULT_RETRIES and SDMMC_DEFAULT_RETRY_DELAY_MS
+ * @param out_done  if not NULL, receives the number of sectors read; on error,
+ *                  start_sector + *out_done is the sector which failed
+ * @return
+ *      - ESP_OK on success
+ *      - Error of the sector which couldn't be read
+ */
+esp_err_t sdEmmc_read_sectors_retry(sdmmc_card_t* card, void* dst,
+        size_t start_sector, size_t sector_count,
+        const sdmmc_retry_policy_t* policy, size_t* out_done);
+
+/**
+ * Write sectors, recovering from transient errors
+ *
+ * Counterpart of sdEmmc_read_sectors_retry. Sectors before start_sector + *out_done
+ * are written; the failed sector and the ones after it may be partially written.
+ */
+esp_err_t sdEmmc_write_sectors_retry(sdmmc_card_t* card, const void* src,
+        size_t start_sector, size_t sector_count,
+        const sdmmc_retry_policy_t* policy, size_t* out_done);
+
+/**
+ * Read given number of sectors from SD/MMC card into any buffer
+ *
+ * DMA capable, word aligned buffers are read directly; other buffers are
+ * filled one sector at a time through a buffer from the card's DMA pool.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param dst   pointer to buffer to read into; buffer size must be at least sector_count * card->csd.sector_size
+ * @param start_sector  sector where to start reading
+ * @param sector_count  number of sectors to read
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NO_MEM if no DMA pool buffer is free
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_read_sectors(sdmmc_card_t* card, void* dst,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Erase given range of sectors
+ *
+ * SD cards erase exactly the given sectors. MMC cards use TRIM if they
+ * support it; otherwise the range must cover whole high capacity erase
+ * groups (card->timeouts.erase_unit_sectors). Erased sectors read back as
+ * all 0 or all 1, depending on the card.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param start_sector  first sector to erase
+ * @param sector_count  number of sectors to erase
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the range exceeds card capacity
+ *      - ESP_ERR_NOT_SUPPORTED if the card can't erase exactly this range
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_erase_sectors(sdmmc_card_t* card, size_t start_sector, size_t sector_count);
+
+/**
+ * Put an eMMC device into Sleep state
+ *
+ * Waits for programming to end, sends the sleep notification on EXT_CSD
+ * revision 7 and later devices, deselects the device and sends SLEEP (CMD5).
+ * Only CMD0, CMD5 and CMD13 are accepted until sdEmmc_awake; the device
+ * keeps its configuration, and VCC may be removed while it sleeps.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_SUPPORTED if the card is not MMC, or in SPI mode
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_sleep(sdmmc_card_t* card);
+
+/**
+ * Wake an eMMC device put to sleep with sdEmmc_sleep
+ *
+ * Sends AWAKE (CMD5), re-selects the device and re-enables power off
+ * notification. Bus width, timing and clock are those set at init.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_SUPPORTED if the card is not MMC, or in SPI mode
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_awake(sdmmc_card_t* card);
+
+/**
+ * Tell an eMMC device that its power is about to be removed
+ *
+ * Sets POWER_OFF_NOTIFICATION to POWER_OFF_SHORT and waits for the device
+ * to prepare. Afterwards the card must be re-initialized with sdEmmc_card_init.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_SUPPORTED if power off notification is not enabled on the card
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_power_off_notify(sdmmc_card_t* card);
+
+/**
+ * Erase zero sectors instead of writing them
+ *
+ * Once enabled, sdEmmc_write_sectors scans the data it is given, and turns
+ * each run of at least min_sectors all-zero sectors into an erase (TRIM on
+ * eMMC); the card reads erased sectors back as zeros. Without TRIM, eMMC
+ * erases whole erase groups only, so just the groups within a run are
+ * erased. Only worth it for runs long enough that the erase is faster than
+ * the transfer, e.g. 64 sectors or more.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param min_sectors  shortest run of zero sectors to erase, 0 to disable
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_SUPPORTED if erased sectors don't read back as zeros
+ *        (SCR DATA_STAT_AFTER_ERASE, EXT_CSD ERASED_MEM_CONT) or the card can't erase
+ */
+esp_err_t sdEmmc_set_zero_elision(sdmmc_card_t* card, size_t min_sectors);
+
+/**
+ * Whether erased sectors read back as zeros
+ *
+ * From SCR DATA_STAT_AFTER_ERASE on SD cards (false if the SCR couldn't be
+ * read), EXT_CSD ERASED_MEM_CONT on eMMC. Other cards read them as 0xff.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @return true if erased sectors read as zeros
+ */
+bool sdEmmc_erased_reads_zero(const sdmmc_card_t* card);
+
+/**
+ * Sectors an eMMC writes atomically with sdEmmc_write_sectors_reliable
+ *
+ * A reliable write leaves the sectors it covers with either their old or
+ * their new contents after a power loss: a single sector, or with the
+ * legacy definition of reliable write (WR_REL_PARAM EN_REL_WR clear) a
+ * chunk of REL_WR_SEC_C sectors aligned to its size. Reliable writes need
+ * SET_BLOCK_COUNT (CMD23), so not in SPI mode, unless WR_REL_SET already
+ * makes all writes to the selected partition reliable. Writes of more than
+ * one sector also need a host leaving out CMD12 (SDMMC_HOST_FLAG_STREAM);
+ * with other hosts a legacy card gives 1.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @return 1 or REL_WR_SEC_C; 0 if the card or host can't do reliable writes
+ */
+size_t sdEmmc_reliable_sectors(const sdmmc_card_t* card);
+
+/**
+ * Write sectors so that a power loss leaves them either all old or all new
+ *
+ * A single sector, or sdEmmc_reliable_sectors() sectors aligned to that
+ * count, are written once, as an eMMC reliable write. Other ranges, and all
+ * writes to SD cards, go through the journal attached with
+ * sdEmmc_journal_attach, which writes the data twice.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param src   data to write; DMA capable and word aligned if larger than
+ *              SDMMC_DMA_POOL_BUF_SIZE and written as a reliable write
+ * @param start_sector  sector where to start writing
+ * @param sector_count  number of sectors to write
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the range exceeds the card, or neither a
+ *        reliable write nor the journal can hold it
+ *      - ESP_ERR_NOT_SUPPORTED if there is no reliable write and no journal
+ *      - ESP_ERR_INVALID_ARG if src must be DMA capable and isn't
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_write_sectors_reliable(sdmmc_card_t* card, const void* src,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Size of an eMMC hardware partition
+ *
+ * Boot partitions come from BOOT_SIZE_MULT, general purpose partitions from
+ * GP_SIZE_MULT once partitioning is completed, the user area from SEC_COUNT.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param part  partition
+ * @return number of sectors, 0 if the partition doesn't exist
+ */
+size_t sdEmmc_part_sectors(const sdmmc_card_t* card, sdEmmc_part_t part);
+
+/**
+ * Select the eMMC hardware partition all following transfers go to
+ *
+ * PARTITION_CONFIG is only switched if part differs from card->part. The
+ * partition stays selected for every call which doesn't name one, including
+ * diskio and sdEmmc_log; prefer sdEmmc_part_read and sdEmmc_part_write,
+ * which return to the user area. Integrity tracking (sdEmmc_integrity_attach) applies to the user area only.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param part  partition
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_FOUND if the partition doesn't exist (SD cards only have SDEMMC_PART_USER)
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_part_select(sdmmc_card_t* card, sdEmmc_part_t part);
+
+/**
+ * Read sectors of an eMMC hardware partition, selecting it first
+ *
+ * The user area is selected again before returning, also on errors.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param part  partition
+ * @param dst  buffer to read into, as for sdEmmc_read_sectors
+ * @param start_sector  sector where to start reading, within the partition
+ * @param sector_count  number of sectors to read
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the range exceeds the partition
+ *      - One of the error codes of sdEmmc_part_select and sdEmmc_read_sectors
+ */
+esp_err_t sdEmmc_part_read(sdmmc_card_t* card, sdEmmc_part_t part, void* dst,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Write sectors of an eMMC hardware partition, selecting it first
+ *
+ * Counterpart of sdEmmc_part_read. The data is programmed before the user
+ * area is selected again.
+ */
+esp_err_t sdEmmc_part_write(sdmmc_card_t* card, sdEmmc_part_t part, const void* src,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Write a contiguous range of sectors from a list of buffer segments
+ *
+ * Segment lengths need not be multiples of the sector size, but must add up
+ * to sector_count * card->csd.sector_size. If the host supports segment lists
+ * (SDMMC_HOST_FLAG_SG) and all segments are DMA capable and word aligned, the
+ * range is written with a single multi-block transfer. Otherwise each
+ * segment is written directly, and sectors straddling two segments go
+ * through a temporary buffer.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param segs  array of segments holding the data to write, in order
+ * @param nsegs  number of segments
+ * @param start_sector  sector where to start writing
+ * @param sector_count  number of sectors to write
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if segment lengths don't add up, or the range exceeds card capacity
+ *      - One of the error codes from SDMMC host controller
+ */
+esp_err_t sdEmmc_write_sectorsv(sdmmc_card_t* card, const sdmmc_segment_t* segs, size_t nsegs,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Read a contiguous range of sectors into a list of buffer segments
+ *
+ * Counterpart of sdEmmc_write_sectorsv, with the same requirements.
+ */
+esp_err_t sdEmmc_read_sectorsv(sdmmc_card_t* card, const sdmmc_segment_t* segs, size_t nsegs,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Start merging requests into one multi-block transfer
+ *
+ * @param merge  merge state to initialize
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param segs  array receiving the buffers of the merged requests
+ * @param max_segs  number of entries of segs, at least 1
+ * @param max_sectors  upper bound of the merged transfer, in sectors
+ */
+void sdEmmc_merge_init(sdEmmc_merge_t* merge, const sdmmc_card_t* card,
+        sdmmc_segment_t* segs, size_t max_segs, size_t max_sectors);
+
+/**
+ * Add a request to a merged transfer if it continues it
+ *
+ * The first request is always taken. A following one is taken if it goes in
+ * the same direction, starts at the sector after the transfer, and keeps it
+ * within max_sectors; its buffer extends the last segment if it follows it in
+ * memory, and takes a new segment otherwise, if one is left.
+ *
+ * @param merge  merge state initialized using sdEmmc_merge_init
+ * @param is_write  direction of the request
+ * @param start_sector  first sector of the request
+ * @param sector_count  number of sectors of the request, not 0
+ * @param buf  data of the request
+ * @return true if the request was merged, false if it has to start a new transfer
+ */
+bool sdEmmc_merge_add(sdEmmc_merge_t* merge, bool is_write, size_t start_sector,
+        size_t sector_count, void* buf);
+
+/**
+ * Execute a merged transfer
+ *
+ * A single segment is transferred with sdEmmc_write_sectors or
+ * sdEmmc_read_sectors, several with sdEmmc_write_sectorsv or
+ * sdEmmc_read_sectorsv.
+ *
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param merge  requests merged using sdEmmc_merge_add
+ * @return One of the error codes of the functions above
+ */
+esp_err_t sdEmmc_merge_transfer(sdmmc_card_t* card, const sdEmmc_merge_t* merge);
+
+/**
+ * Start a sequential transfer session
+ *
+ * On hosts with SDMMC_HOST_FLAG_STREAM, the first sdEmmc_stream_write or
+ * sdEmmc_stream_read sends one open-ended WRITE_MULTIPLE_BLOCK (CMD25) or
+ * READ_MULTIPLE_BLOCK (CMD18), and the following calls only add data to it.
+ * STOP_TRANSMISSION is sent by sdEmmc_stream_close, or by sdEmmc_stream_seek
+ * when the stream moves. Nothing else may be sent to the card while the
+ * transfer is open.
+ *
+ * Other hosts, and cards with integrity or a written-sector map attached,
+ * get one multi-block transfer per call; the wait for a write to be
+ * programmed is deferred to the next call or to close.
+ *
+ * @param stream  session to initialize
+ * @param card  pointer to card information structure previously initialized using sdEmmc_card_init
+ * @param start_sector  sector where the stream starts
+ * @param dir  SDEMMC_STREAM_READ or SDEMMC_STREAM_WRITE
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if start_sector is beyond card capacity
+ */
+esp_err_t sdEmmc_stream_open(sdEmmc_stream_t* stream, sdmmc_card_t* card,
+        size_t start_sector, sdEmmc_stream_dir_t dir);
+
+/**
+ * Write the next sectors of a stream
+ *
+ * @param stream  session opened with SDEMMC_STREAM_WRITE
+ * @param src  DMA capable, word aligned buffer of sector_count sectors
+ * @param sector_count  number of sectors to write
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the buffer is not DMA capable or the stream is for reading
+ *      - ESP_ERR_INVALID_SIZE if the stream would pass the end of the card
+ *      - One of the error codes from SDMMC host controller; the transfer is ended
+ *        and the card recovered with sdEmmc_recover
+ */
+esp_err_t sdEmmc_stream_write(sdEmmc_stream_t* stream, const void* src, size_t sector_count);
+
+/**
+ * Read the next sectors of a stream
+ *
+ * Counterpart of sdEmmc_stream_write, for sessions opened with SDEMMC_STREAM_READ.
+ */
+esp_err_t sdEmmc_stream_read(sdEmmc_stream_t* stream, void* dst, size_t sector_count);
+
+/**
+ * Continue the stream at another sector
+ *
+ * Ends the open transfer if the sector is not the one the stream is at.
+ */
+esp_err_t sdEmmc_stream_seek(sdEmmc_stream_t* stream, size_t sector);
+
+/**
+ * End the stream: stop the open transfer and wait until written data is programmed
+ */
+esp_err_t sdEmmc_stream_close(sdEmmc_stream_t* stream);
+
 #ifdef __cplusplus
 }
-#endif
+#endif
@@ -0,0 +1,218 @@
+#include <stdbool.h>
+#include "sdEmmc_crc.h"
+
+#if SDEMMC_CRC_TABLES
+/* CRC-32C (Castagnoli), reflected polynomial 0x82F63B78, slicing-by-8.
+ * s_crc32c_table[k][n] advances the CRC of byte n over k more zero bytes.
+ * Tables are built in RAM on first use, like the CRC16 ones below.
+ */
+static uint32_t s_crc32c_table[8][256];
+static volatile bool s_crc32c_table_ready;
+
+static void crc32c_table_init(void)
+{
+    if (s_crc32c_table_ready) {
+        return;
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+        uint32_t crc = n;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
+        }
+        s_crc32c_table[0][n] = crc;
+    }
+    for (int k = 1; k < 8; ++k) {
+        for (int n = 0; n < 256; ++n) {
+            uint32_t prev = s_crc32c_table[k - 1][n];
+            s_crc32c_table[k][n] = (prev >> 8) ^ s_crc32c_table[0][prev & 0xff];
+        }
+    }
+    s_crc32c_table_ready = true;
+}
+
+uint32_t sdEmmc_crc32c(uint32_t crc, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    crc32c_table_init();
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        crc = s_crc32c_table[7][lo & 0xff] ^ s_crc32c_table[6][(lo >> 8) & 0xff] ^
+              s_crc32c_table[5][(lo >> 16) & 0xff] ^ s_crc32c_table[4][lo >> 24] ^
+              s_crc32c_table[3][p[4]] ^ s_crc32c_table[2][p[5]] ^
+              s_crc32c_table[1][p[6]] ^ s_crc32c_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = s_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+#else
+/* CRC-32C, reflected polynomial 0x82F63B78, a nibble at a time */
+static const uint32_t s_crc32c_nibble_table[16] = {
+    0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+    0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75,
+};
+
+uint32_t sdEmmc_crc32c(uint32_t crc, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ s_crc32c_nibble_table[crc & 0x0f];
+        crc = (crc >> 4) ^ s_crc32c_nibble_table[crc & 0x0f];
+    }
+    return ~crc;
+}
+#endif
+
+/* CRC7, polynomial x^7 + x^3 + 1, kept in the upper 7 bits of each entry */
+static const uint8_t s_crc7_table[256] = {
+    0x00, 0x12, 0x24, 0x36, 0x48, 0x5a, 0x6c, 0x7e,
+    0x90, 0x82, 0xb4, 0xa6, 0xd8, 0xca, 0xfc, 0xee,
+    0x32, 0x20, 0x16, 0x04, 0x7a, 0x68, 0x5e, 0x4c,
+    0xa2, 0xb0, 0x86, 0x94, 0xea, 0xf8, 0xce, 0xdc,
+    0x64, 0x76, 0x40, 0x52, 0x2c, 0x3e, 0x08, 0x1a,
+    0xf4, 0xe6, 0xd0, 0xc2, 0xbc, 0xae, 0x98, 0x8a,
+    0x56, 0x44, 0x72, 0x60, 0x1e, 0x0c, 0x3a, 0x28,
+    0xc6, 0xd4, 0xe2, 0xf0, 0x8e, 0x9c, 0xaa, 0xb8,
+    0xc8, 0xda, 0xec, 0xfe, 0x80, 0x92, 0xa4, 0xb6,
+    0x58, 0x4a, 0x7c, 0x6e, 0x10, 0x02, 0x34, 0x26,
+    0xfa, 0xe8, 0xde, 0xcc, 0xb2, 0xa0, 0x96, 0x84,
+    0x6a, 0x78, 0x4e, 0x5c, 0x22, 0x30, 0x06, 0x14,
+    0xac, 0xbe, 0x88, 0x9a, 0xe4, 0xf6, 0xc0, 0xd2,
+    0x3c, 0x2e, 0x18, 0x0a, 0x74, 0x66, 0x50, 0x42,
+    0x9e, 0x8c, 0xba, 0xa8, 0xd6, 0xc4, 0xf2, 0xe0,
+    0x0e, 0x1c, 0x2a, 0x38, 0x46, 0x54, 0x62, 0x70,
+    0x82, 0x90, 0xa6, 0xb4, 0xca, 0xd8, 0xee, 0xfc,
+    0x12, 0x00, 0x36, 0x24, 0x5a, 0x48, 0x7e, 0x6c,
+    0xb0, 0xa2, 0x94, 0x86, 0xf8, 0xea, 0xdc, 0xce,
+    0x20, 0x32, 0x04, 0x16, 0x68, 0x7a, 0x4c, 0x5e,
+    0xe6, 0xf4, 0xc2, 0xd0, 0xae, 0xbc, 0x8a, 0x98,
+    0x76, 0x64, 0x52, 0x40, 0x3e, 0x2c, 0x1a, 0x08,
+    0xd4, 0xc6, 0xf0, 0xe2, 0x9c, 0x8e, 0xb8, 0xaa,
+    0x44, 0x56, 0x60, 0x72, 0x0c, 0x1e, 0x28, 0x3a,
+    0x4a, 0x58, 0x6e, 0x7c, 0x02, 0x10, 0x26, 0x34,
+    0xda, 0xc8, 0xfe, 0xec, 0x92, 0x80, 0xb6, 0xa4,
+    0x78, 0x6a, 0x5c, 0x4e, 0x30, 0x22, 0x14, 0x06,
+    0xe8, 0xfa, 0xcc, 0xde, 0xa0, 0xb2, 0x84, 0x96,
+    0x2e, 0x3c, 0x0a, 0x18, 0x66, 0x74, 0x42, 0x50,
+    0xbe, 0xac, 0x9a, 0x88, 0xf6, 0xe4, 0xd2, 0xc0,
+    0x1c, 0x0e, 0x38, 0x2a, 0x54, 0x46, 0x70, 0x62,
+    0x8c, 0x9e, 0xa8, 0xba, 0xc4, 0xd6, 0xe0, 0xf2,
+};
+
+uint8_t sdEmmc_crc7(const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    uint8_t crc = 0;
+    while (len--) {
+        crc = s_crc7_table[crc ^ *p++];
+    }
+    return crc >> 1;
+}
+
+#if SDEMMC_CRC_TABLES
+/* CRC16-CCITT, polynomial 0x1021, MSB first, as used for SD data blocks.
+ *
+ * s_crc16_table[k][n] is the CRC of byte n followed by k zero bytes, so one
+ * step of slicing-by-N folds N input bytes with N independent lookups. The
+ * tables are built in RAM on first use: lookups from flash would go through
+ * the cache, which is what the kernels are trying to avoid. Concurrent first
+ * calls fill in identical values.
+ */
+static uint16_t s_crc16_table[8][256];
+static volatile bool s_crc16_table_ready;
+
+static void crc16_table_init(void)
+{
+    if (s_crc16_table_ready) {
+        return;
+    }
+    for (int n = 0; n < 256; ++n) {
+        uint16_t crc = n << 8;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+        s_crc16_table[0][n] = crc;
+    }
+    for (int k = 1; k < 8; ++k) {
+        for (int n = 0; n < 256; ++n) {
+            uint16_t prev = s_crc16_table[k - 1][n];
+            s_crc16_table[k][n] = (prev << 8) ^ s_crc16_table[0][prev >> 8];
+        }
+    }
+    s_crc16_table_ready = true;
+}
+
+static inline uint16_t crc16_byte(uint16_t crc, uint8_t b)
+{
+    return (crc << 8) ^ s_crc16_table[0][(crc >> 8) ^ b];
+}
+
+uint16_t sdEmmc_crc16_slice8(uint16_t crc, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    crc16_table_init();
+    while (len >= 8) {
+        crc = s_crc16_table[7][(crc >> 8) ^ p[0]] ^ s_crc16_table[6][(crc & 0xff) ^ p[1]] ^
+              s_crc16_table[5][p[2]] ^ s_crc16_table[4][p[3]] ^
+              s_crc16_table[3][p[4]] ^ s_crc16_table[2][p[5]] ^
+              s_crc16_table[1][p[6]] ^ s_crc16_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = crc16_byte(crc, *p++);
+    }
+    return crc;
+}
+
+uint16_t sdEmmc_crc16_slice4(uint16_t crc, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    crc16_table_init();
+    while (len >= 4) {
+        crc = s_crc16_table[3][(crc >> 8) ^ p[0]] ^ s_crc16_table[2][(crc & 0xff) ^ p[1]] ^
+              s_crc16_table[1][p[2]] ^ s_crc16_table[0][p[3]];
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        crc = crc16_byte(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+/* two lookups per byte in a 32 byte table, for targets without room for the
+ * slicing tables */
+static const uint16_t s_crc16_nibble_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+};
+
+uint16_t sdEmmc_crc16_nibble(uint16_t crc, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    while (len--) {
+        uint8_t b = *p++;
+        crc = (crc << 4) ^ s_crc16_nibble_table[(crc >> 12) ^ (b >> 4)];
+        crc = (crc << 4) ^ s_crc16_nibble_table[(crc >> 12) ^ (b & 0x0f)];
+    }
+    return crc;
+}
+
+uint16_t sdEmmc_crc16(uint16_t crc, const void* data, size_t len)
+{
+#if SDEMMC_CRC16_KERNEL == 8
+    return sdEmmc_crc16_slice8(crc, data, len);
+#elif SDEMMC_CRC16_KERNEL == 4
+    return sdEmmc_crc16_slice4(crc, data, len);
+#else
+    return sdEmmc_crc16_nibble(crc, data, len);
+#endif
+}
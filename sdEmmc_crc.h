@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef SDEMMC_CONFIG_LOW_MEMORY
+#define SDEMMC_CONFIG_LOW_MEMORY    0
+#endif
+
+/* Slicing tables. When set, sdEmmc_crc32c uses slicing-by-8 over 8 KB of
+ * tables and the CRC16 slicing kernels are built, with 4 KB more; all are
+ * filled in RAM on first use. When clear (the default of the low-memory
+ * profile), sdEmmc_crc32c and sdEmmc_crc16 use nibble tables of 64 and 32
+ * bytes in flash, and the slicing kernels don't exist.
+ */
+#ifndef SDEMMC_CRC_TABLES
+#define SDEMMC_CRC_TABLES   (!SDEMMC_CONFIG_LOW_MEMORY)
+#endif
+
+/* CRC16 kernel used by sdEmmc_crc16:
+ *   8 - slicing-by-8, 4 KB of tables in RAM (default)
+ *   4 - slicing-by-4, shares the slicing-by-8 tables, shorter loop body
+ *   0 - nibble table, 32 bytes, for targets short on RAM or cache
+ *       (default without SDEMMC_CRC_TABLES)
+ */
+#ifndef SDEMMC_CRC16_KERNEL
+#define SDEMMC_CRC16_KERNEL (SDEMMC_CRC_TABLES ? 8 : 0)
+#endif
+
+#if SDEMMC_CRC16_KERNEL != 0 && !SDEMMC_CRC_TABLES
+#error "sdEmmc: SDEMMC_CRC16_KERNEL 4 and 8 need SDEMMC_CRC_TABLES"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * CRC-32C (Castagnoli) of a buffer
+ *
+ * Calls can be chained: pass 0 for the first block, then the previous result.
+ * sdEmmc_crc32c(0, "123456789", 9) is 0xe3069283.
+ *
+ * @param crc  CRC of the preceding data, or 0
+ * @param data  data to checksum
+ * @param len  length of data, in bytes
+ * @return CRC of the preceding data followed by data
+ */
+uint32_t sdEmmc_crc32c(uint32_t crc, const void* data, size_t len);
+
+/**
+ * CRC7 of an SD/MMC command or register
+ *
+ * The CRC byte sent after a command is (sdEmmc_crc7(cmd, 5) << 1) | 1.
+ * sdEmmc_crc7("123456789", 9) is 0x75; for CMD0 (40 00 00 00 00) it is 0x4a.
+ *
+ * @param data  command or register contents, first byte sent first
+ * @param len  length of data, in bytes
+ * @return 7 bit CRC
+ */
+uint8_t sdEmmc_crc7(const void* data, size_t len);
+
+/**
+ * CRC16-CCITT (XMODEM) of a data block, as sent after each block in SPI mode
+ *
+ * Calls can be chained: pass 0 for the first block, then the previous result.
+ * sdEmmc_crc16(0, "123456789", 9) is 0x31c3; a 512 byte block of 0xff gives 0x7fa1.
+ *
+ * @param crc  CRC of the preceding data, or 0
+ * @param data  data to checksum
+ * @param len  length of data, in bytes
+ * @return CRC of the preceding data followed by data
+ */
+uint16_t sdEmmc_crc16(uint16_t crc, const void* data, size_t len);
+
+/**
+ * sdEmmc_crc16 kernels, callable directly to compare them on the target
+ */
+#if SDEMMC_CRC_TABLES
+uint16_t sdEmmc_crc16_slice8(uint16_t crc, const void* data, size_t len);
+uint16_t sdEmmc_crc16_slice4(uint16_t crc, const void* data, size_t len);
+#endif
+uint16_t sdEmmc_crc16_nibble(uint16_t crc, const void* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -26,6 +26,7 @@
 #define MMC_SEND_OP_COND                1       /* R3 */
 #define MMC_ALL_SEND_CID                2       /* R2 */
 #define MMC_SET_RELATIVE_ADDR           3       /* R1 */
+#define MMC_SLEEP_AWAKE                 5       /* R1B */
 #define MMC_SWITCH                      6       /* R1B */
 #define MMC_SELECT_CARD                 7       /* R1 */
 #define MMC_SEND_EXT_CSD                8       /* R1 */
@@ -39,12 +40,17 @@
 #define MMC_SET_BLOCK_COUNT             23      /* R1 */
 #define MMC_WRITE_BLOCK_SINGLE          24      /* R1 */
 #define MMC_WRITE_BLOCK_MULTIPLE        25      /* R1 */
+#define MMC_ERASE_GROUP_START           35      /* R1 */
+#define MMC_ERASE_GROUP_END             36      /* R1 */
+#define MMC_ERASE                       38      /* R1B */
 #define MMC_APP_CMD                     55      /* R1 */
 
 /* SD commands */                               /* response type */
 #define SD_SEND_RELATIVE_ADDR           3       /* R6 */
 #define SD_SEND_SWITCH_FUNC             6       /* R1 */
 #define SD_SEND_IF_COND                 8       /* R7 */
+#define SD_ERASE_WR_BLK_START           32      /* R1 */
+#define SD_ERASE_WR_BLK_END             33      /* R1 */
 #define SD_READ_OCR                     58      /* R3 */
 #define SD_CRC_ON_OFF                   59      /* R1 */
 
@@ -84,11 +90,45 @@
 #define MMC_R1_READY_FOR_DATA           (1<<8)  /* ready for next transfer */
 #define MMC_R1_APP_CMD                  (1<<5)  /* app. commands supported */
 #define MMC_R1_SWITCH_ERROR             (1<<7)  /* switch command did not succeed */
+#define MMC_R1_OUT_OF_RANGE             (1<<31) /* argument out of range */
+#define MMC_R1_ADDRESS_ERROR            (1<<30) /* misaligned address */
+#define MMC_R1_WP_VIOLATION             (1<<26) /* write to protected block */
+#define MMC_R1_STATE(status)            (((status) >> 9) & 0xf)
+
+/* Card states (CURRENT_STATE field of R1) */
+#define MMC_R1_STATE_STBY               3
+#define MMC_R1_STATE_TRAN               4
+#define MMC_R1_STATE_DATA               5
+#define MMC_R1_STATE_RCV                6
+#define MMC_R1_STATE_PRG                7
 
 
 /* SPI mode R1 response type bits */
 #define SD_SPI_R1_IDLE_STATE            (1<<0)
+#define SD_SPI_R1_ERASE_RST             (1<<1)
+#define SD_SPI_R1_ILLEGAL_CMD           (1<<2)
 #define SD_SPI_R1_CMD_CRC_ERR           (1<<3)
+#define SD_SPI_R1_ERASE_SEQ_ERR         (1<<4)
+#define SD_SPI_R1_ADDR_ERR              (1<<5)
+#define SD_SPI_R1_PARAM_ERR             (1<<6)
+#define SD_SPI_R1_NO_RESPONSE           (1<<7)
+
+/* SPI mode data tokens */
+#define SD_SPI_TOKEN_START_BLOCK        0xfe    /* single block read/write, multi-block read */
+#define SD_SPI_TOKEN_START_MULTI_WRITE  0xfc    /* each block of a multi-block write */
+#define SD_SPI_TOKEN_STOP_TRAN          0xfd    /* ends a multi-block write */
+
+/* SPI mode data error token (000xxxxx), sent instead of a start token */
+#define SD_SPI_DATA_ERR_ERROR           (1<<0)
+#define SD_SPI_DATA_ERR_CC              (1<<1)
+#define SD_SPI_DATA_ERR_ECC             (1<<2)
+#define SD_SPI_DATA_ERR_RANGE           (1<<3)
+
+/* SPI mode data response (xxx0sss1) to each written block */
+#define SD_SPI_DATA_RSP_MASK            0x1f
+#define SD_SPI_DATA_RSP_ACCEPTED        0x05
+#define SD_SPI_DATA_RSP_CRC_ERR         0x0b
+#define SD_SPI_DATA_RSP_WRITE_ERR       0x0d
 
 /* 48-bit response decoding (32 bits w/o CRC) */
 #define MMC_R1(resp)                    ((resp)[0])
@@ -106,17 +146,45 @@
 #define MMC_ARG_RCA(rca)                ((rca) << 16)
 #define SD_R6_RCA(resp)                 (SD_R6((resp)) >> 16)
 
+/* MMC_SET_BLOCK_COUNT argument */
+#define MMC_SET_BLOCK_COUNT_REL_WR      (1U << 31)      /* reliable write request */
+
+/* MMC_ERASE argument */
+#define MMC_ERASE_ARG_ERASE             0x00000000
+#define MMC_ERASE_ARG_TRIM              0x00000001
+
 /* bus width argument */
 #define SD_ARG_BUS_WIDTH_1              0
 #define SD_ARG_BUS_WIDTH_4              2
 
+/* EXT_CSD size, in bytes */
+#define EXT_CSD_MMC_SIZE                512
+
 /* EXT_CSD fields */
+#define EXT_CSD_POWER_OFF_NOTIFICATION  34      /* R/W */
+#define EXT_CSD_GP_SIZE_MULT            143     /* R/W, 3 bytes for each of 4 partitions */
+#define EXT_CSD_PARTITION_SETTING       155     /* R/W */
+#define EXT_CSD_WR_REL_PARAM            166     /* RO */
+#define EXT_CSD_WR_REL_SET              167     /* R/W */
+#define EXT_CSD_ERASE_GROUP_DEF         175     /* R/W */
+#define EXT_CSD_PART_CONFIG             179     /* R/W */
+#define EXT_CSD_ERASED_MEM_CONT         181     /* RO */
+#define EXT_CSD_PART_SWITCH_TIME        199     /* RO */
 #define EXT_CSD_BUS_WIDTH               183     /* WO */
 #define EXT_CSD_HS_TIMING               185     /* R/W */
 #define EXT_CSD_REV                     192     /* RO */
 #define EXT_CSD_STRUCTURE               194     /* RO */
 #define EXT_CSD_CARD_TYPE               196     /* RO */
 #define EXT_CSD_SEC_COUNT               212     /* RO */
+#define EXT_CSD_SLEEP_NOTIFICATION_TIME 216     /* RO */
+#define EXT_CSD_S_A_TIMEOUT             217     /* RO */
+#define EXT_CSD_HC_WP_GRP_SIZE          221     /* RO */
+#define EXT_CSD_REL_WR_SEC_C            222     /* RO */
+#define EXT_CSD_ERASE_TIMEOUT_MULT      223     /* RO */
+#define EXT_CSD_HC_ERASE_GRP_SIZE       224     /* RO */
+#define EXT_CSD_BOOT_SIZE_MULT          226     /* RO */
+#define EXT_CSD_SEC_FEATURE_SUPPORT     231     /* RO */
+#define EXT_CSD_GENERIC_CMD6_TIME       248     /* RO */
 #define EXT_CSD_PWR_CL_26_360           203     /* RO */
 #define EXT_CSD_PWR_CL_52_360           202     /* RO */
 #define EXT_CSD_PWR_CL_26_195           201     /* RO */
@@ -130,6 +198,37 @@
 #define EXT_CSD_CMD_SET_SECURE          (1U << 1)
 #define EXT_CSD_CMD_SET_CPSECURE        (1U << 2)
 
+/* EXT_CSD_PART_CONFIG */
+#define EXT_CSD_PART_CONFIG_ACC_MASK    0x7     /* PARTITION_ACCESS */
+#define EXT_CSD_PART_CONFIG_ACC_RPMB    3
+
+/* EXT_CSD_PARTITION_SETTING */
+#define EXT_CSD_PARTITION_SETTING_COMPLETED (1U << 0)
+
+/* EXT_CSD_WR_REL_PARAM */
+#define EXT_CSD_WR_REL_PARAM_HS_CTRL_REL (1U << 0)      /* WR_REL_SET is writable */
+#define EXT_CSD_WR_REL_PARAM_EN_REL_WR  (1U << 2)       /* enhanced reliable write */
+
+/* EXT_CSD_WR_REL_SET: one bit per partition, user area in bit 0, GP1..4 in bits 1..4 */
+#define EXT_CSD_WR_REL_SET_USER         (1U << 0)
+
+/* EXT_CSD_POWER_OFF_NOTIFICATION */
+#define EXT_CSD_NO_POWER_NOTIFICATION   0
+#define EXT_CSD_POWERED_ON              1
+#define EXT_CSD_POWER_OFF_SHORT         2
+#define EXT_CSD_POWER_OFF_LONG          3
+#define EXT_CSD_SLEEP_NOTIFICATION      4
+
+/* EXT_CSD_REV */
+#define EXT_CSD_REV_4_5                 6       /* power off notification */
+#define EXT_CSD_REV_5_0                 7       /* sleep notification */
+
+/* MMC_SLEEP_AWAKE argument */
+#define MMC_SLEEP_AWAKE_SLEEP           (1U << 15)
+
+/* EXT_CSD_SEC_FEATURE_SUPPORT */
+#define EXT_CSD_SEC_GB_CL_EN            (1U << 4)       /* TRIM supported */
+
 /* EXT_CSD_HS_TIMING */
 #define EXT_CSD_HS_TIMING_BC            0
 #define EXT_CSD_HS_TIMING_HS            1
@@ -209,7 +308,9 @@
                 (pnm)[5] = MMC_RSP_BITS((resp), 56, 8);                 \
                 (pnm)[6] = '\0';                                        \
         } while (0)
+#define MMC_CID_REV_V2(resp)            MMC_RSP_BITS((resp), 48, 8)
 #define MMC_CID_PSN_V2(resp)            MMC_RSP_BITS((resp), 16, 32)
+#define MMC_CID_MDT_V2(resp)            MMC_RSP_BITS((resp), 8, 8)
 
 /* SD R2 response (CSD) */
 #define SD_CSD_CSDVER(resp)             MMC_RSP_BITS((resp), 126, 2)
@@ -303,6 +404,18 @@
 #define SCR_CMD_SUPPORT_CMD20(scr)      MMC_RSP_BITS((scr), 32, 1)
 #define SCR_RESERVED2(scr)              MMC_RSP_BITS((scr), 0, 32)
 
+/* SSR (SD Status Register), ACMD13 */
+#define SD_SSR_SIZE                     64      /* in bytes */
+#define SSR_DAT_BUS_WIDTH(ssr)          MMC_RSP_BITS((ssr), 510, 2)
+#define SSR_SPEED_CLASS(ssr)            MMC_RSP_BITS((ssr), 440, 8)
+#define SSR_AU_SIZE(ssr)                MMC_RSP_BITS((ssr), 428, 4)
+#define SSR_ERASE_SIZE(ssr)             MMC_RSP_BITS((ssr), 408, 16)
+#define SSR_ERASE_TIMEOUT(ssr)          MMC_RSP_BITS((ssr), 402, 6)
+#define SSR_ERASE_OFFSET(ssr)           MMC_RSP_BITS((ssr), 400, 2)
+#define SSR_UHS_SPEED_GRADE(ssr)        MMC_RSP_BITS((ssr), 396, 4)
+#define SSR_UHS_AU_SIZE(ssr)            MMC_RSP_BITS((ssr), 392, 4)
+#define SSR_VIDEO_SPEED_CLASS(ssr)      MMC_RSP_BITS((ssr), 384, 8)
+
 /* Max supply current in SWITCH_FUNC response (in mA) */
 #define SD_SFUNC_I_MAX(status) (MMC_RSP_BITS((uint32_t *)(status), 496, 16))
 
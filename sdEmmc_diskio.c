@@ -0,0 +1,205 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "esp_heap_caps.h"
+#include "diskio.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_diskio.h"
+#include "sys/param.h"
+
+#define DISKIO_MAX_CLUSTER_SIZE (64 * 1024)
+
+static sdmmc_card_t* s_cards[FF_VOLUMES] = { NULL };
+
+static DSTATUS sdEmmc_diskio_init(BYTE pdrv)
+{
+    return (s_cards[pdrv] != NULL) ? 0 : STA_NOINIT;
+}
+
+static DSTATUS sdEmmc_diskio_status(BYTE pdrv)
+{
+    return (s_cards[pdrv] != NULL) ? 0 : STA_NOINIT;
+}
+
+static DRESULT sdEmmc_diskio_read(BYTE pdrv, BYTE* buff, DWORD sector, UINT count)
+{
+    sdmmc_card_t* card = s_cards[pdrv];
+    assert(card);
+    esp_err_t err = sdEmmc_read_sectors(card, buff, sector, count);
+    if (err != ESP_OK) {
+        log_e( "%s: reading %u+%u returned 0x%x", __func__, sector, count, err);
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+static DRESULT sdEmmc_diskio_write(BYTE pdrv, const BYTE* buff, DWORD sector, UINT count)
+{
+    sdmmc_card_t* card = s_cards[pdrv];
+    assert(card);
+    esp_err_t err = sdEmmc_write_sectors(card, buff, sector, count);
+    if (err != ESP_OK) {
+        log_e( "%s: writing %u+%u returned 0x%x", __func__, sector, count, err);
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+/* TRIM is a hint: ranges the card can't erase exactly are narrowed to whole
+ * erase groups (MMC without TRIM support) or skipped.
+ */
+static DRESULT sdEmmc_diskio_trim(sdmmc_card_t* card, DWORD start, DWORD end)
+{
+    size_t count = end - start + 1;
+    esp_err_t err = sdEmmc_erase_sectors(card, start, count);
+    if (err == ESP_ERR_NOT_SUPPORTED && card->ext_csd.erase_group_def) {
+        size_t unit = card->timeouts.erase_unit_sectors;
+        size_t first = (start + unit - 1) / unit * unit;
+        size_t last = (start + count) / unit * unit;
+        err = (last > first) ? sdEmmc_erase_sectors(card, first, last - first) : ESP_OK;
+    }
+    if (err == ESP_ERR_NOT_SUPPORTED) {
+        return RES_OK;
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: erasing %u..%u returned 0x%x", __func__, start, end, err);
+        return RES_ERROR;
+    }
+    return RES_OK;
+}
+
+static DRESULT sdEmmc_diskio_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    sdmmc_card_t* card = s_cards[pdrv];
+    assert(card);
+    switch (cmd) {
+        case CTRL_SYNC:
+            /* writes return once the data is transferred; wait for programming */
+            if (sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0)) != ESP_OK) {
+                return RES_ERROR;
+            }
+            return RES_OK;
+        case GET_SECTOR_COUNT:
+            *((DWORD*) buff) = card->csd.capacity;
+            return RES_OK;
+        case GET_SECTOR_SIZE:
+            *((WORD*) buff) = card->csd.sector_size;
+            return RES_OK;
+        case GET_BLOCK_SIZE:
+            /* AU (SD) or high capacity erase group (MMC), in sectors */
+            *((DWORD*) buff) = MAX(card->timeouts.erase_unit_sectors, 1);
+            return RES_OK;
+        case CTRL_TRIM: {
+            const DWORD* range = (const DWORD*) buff;
+            return sdEmmc_diskio_trim(card, range[0], range[1]);
+        }
+    }
+    return RES_PARERR;
+}
+
+void sdEmmc_diskio_register(BYTE pdrv, sdmmc_card_t* card)
+{
+    static const ff_diskio_impl_t sdEmmc_impl = {
+        .init = &sdEmmc_diskio_init,
+        .status = &sdEmmc_diskio_status,
+        .read = &sdEmmc_diskio_read,
+        .write = &sdEmmc_diskio_write,
+        .ioctl = &sdEmmc_diskio_ioctl
+    };
+    s_cards[pdrv] = card;
+    ff_diskio_register(pdrv, card ? &sdEmmc_impl : NULL);
+}
+
+BYTE sdEmmc_diskio_get_pdrv(const sdmmc_card_t* card)
+{
+    for (BYTE i = 0; i < FF_VOLUMES; ++i) {
+        if (card != NULL && s_cards[i] == card) {
+            return i;
+        }
+    }
+    return 0xff;
+}
+
+static esp_err_t sdEmmc_vfs_fat_format(sdmmc_card_t* card, const char* drv,
+        const esp_vfs_fat_mount_config_t* mount_config)
+{
+    size_t au = mount_config->allocation_unit_size;
+    if (au == 0) {
+        au = MIN((size_t) card->ssr.alloc_unit_kb * 1024, DISKIO_MAX_CLUSTER_SIZE);
+    }
+    au = MAX(au, (size_t) card->csd.sector_size);
+    const size_t workbuf_size = 4096;
+    void* workbuf = heap_caps_malloc(workbuf_size, MALLOC_CAP_DMA);
+    if (workbuf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    log_w( "%s: formatting card, allocation unit size=%d", __func__, au);
+    FRESULT res = f_mkfs(drv, FM_ANY, au, workbuf, workbuf_size);
+    free(workbuf);
+    if (res != FR_OK) {
+        log_e( "%s: f_mkfs failed (%d)", __func__, res);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_vfs_fat_mount(const char* base_path, sdmmc_card_t* card,
+        const esp_vfs_fat_mount_config_t* mount_config, FATFS** out_fs)
+{
+    BYTE pdrv = 0xff;
+    if (ff_diskio_get_drive(&pdrv) != ESP_OK || pdrv == 0xff) {
+        log_e( "%s: the maximum count of volumes is already mounted", __func__);
+        return ESP_ERR_NO_MEM;
+    }
+    sdEmmc_diskio_register(pdrv, card);
+    char drv[3] = {(char) ('0' + pdrv), ':', 0};
+
+    FATFS* fs = NULL;
+    esp_err_t err = esp_vfs_fat_register(base_path, drv, mount_config->max_files, &fs);
+    if (err != ESP_OK) {
+        log_e( "%s: esp_vfs_fat_register failed 0x%x", __func__, err);
+        goto fail;
+    }
+    FRESULT res = f_mount(fs, drv, 1);
+    if (res != FR_OK) {
+        log_w( "%s: failed to mount card (%d)", __func__, res);
+        if (!((res == FR_NO_FILESYSTEM || res == FR_INT_ERR) &&
+              mount_config->format_if_mount_failed)) {
+            err = ESP_FAIL;
+            goto fail;
+        }
+        err = sdEmmc_vfs_fat_format(card, drv, mount_config);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+        res = f_mount(fs, drv, 0);
+        if (res != FR_OK) {
+            log_e( "%s: f_mount failed after formatting (%d)", __func__, res);
+            err = ESP_FAIL;
+            goto fail;
+        }
+    }
+    if (out_fs) {
+        *out_fs = fs;
+    }
+    return ESP_OK;
+
+fail:
+    if (fs) {
+        f_mount(NULL, drv, 0);
+        esp_vfs_fat_unregister_path(base_path);
+    }
+    sdEmmc_diskio_register(pdrv, NULL);
+    return err;
+}
+
+esp_err_t sdEmmc_vfs_fat_unmount(const char* base_path, sdmmc_card_t* card)
+{
+    BYTE pdrv = sdEmmc_diskio_get_pdrv(card);
+    if (pdrv == 0xff) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    char drv[3] = {(char) ('0' + pdrv), ':', 0};
+    f_mount(NULL, drv, 0);
+    sdEmmc_diskio_register(pdrv, NULL);
+    return esp_vfs_fat_unregister_path(base_path);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "ff.h"
+#include "esp_vfs_fat.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * FatFs disk I/O and VFS glue
+ *
+ * Multi-sector FatFs reads and writes are passed to the card as single
+ * multi-block transfers; only buffers which are not DMA capable are bounced
+ * through the card's DMA pool, one sector at a time. CTRL_SYNC waits for the
+ * card to finish programming, GET_BLOCK_SIZE reports the allocation unit
+ * (SD) or erase group (MMC), and CTRL_TRIM erases the freed sectors.
+ */
+
+/**
+ * Register the card as FatFs physical drive pdrv
+ *
+ * @param pdrv  drive number, e.g. obtained with ff_diskio_get_drive
+ * @param card  card initialized using sdEmmc_card_init, or NULL to unregister the drive
+ */
+void sdEmmc_diskio_register(BYTE pdrv, sdmmc_card_t* card);
+
+/**
+ * Drive number the card is registered as
+ *
+ * @return drive number, or 0xFF if the card is not registered
+ */
+BYTE sdEmmc_diskio_get_pdrv(const sdmmc_card_t* card);
+
+/**
+ * Register the card with FatFs and mount it in the VFS at base_path
+ *
+ * Same behavior as esp_vfs_fat_sdmmc_mount, for a card which has already
+ * been initialized. If allocation_unit_size is 0 and the card is formatted,
+ * the cluster size follows the card's allocation unit, up to 64 KB.
+ *
+ * @param base_path  path where the partition is registered, e.g. "/sdcard"
+ * @param card  card initialized using sdEmmc_card_init
+ * @param mount_config  mount options
+ * @param out_fs  if not NULL, receives the FatFs object
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NO_MEM if no FatFs drive number or memory is available
+ *      - ESP_FAIL if the file system can't be mounted or created
+ *      - One of the error codes of esp_vfs_fat_register
+ */
+esp_err_t sdEmmc_vfs_fat_mount(const char* base_path, sdmmc_card_t* card,
+        const esp_vfs_fat_mount_config_t* mount_config, FATFS** out_fs);
+
+/**
+ * Unmount the file system mounted with sdEmmc_vfs_fat_mount and unregister the card
+ *
+ * The card itself stays initialized.
+ */
+esp_err_t sdEmmc_vfs_fat_unmount(const char* base_path, sdmmc_card_t* card);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,585 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdEmmc_defs.h"
+#include "sdEmmc_crc.h"
+#include "sdEmmc_host_spi.h"
+#include "sys/param.h"
+
+#define SPI_SLOT_COUNT      3       // SPI peripherals, by spi_host_device_t
+#define SPI_BLOCK_SIZE      512     // largest data block
+#define SPI_CMD_FRAME       8       // command, and the first two bytes after it
+#define SPI_NCR_MAX         8       // bytes the card may take to answer a command
+#define SPI_SPIN_US         1000    // time polled back to back before sleeping between polls
+#define SPI_QUEUE_SIZE      3       // token, block and CRC of one block
+#define SPI_INIT_FREQ_KHZ   400
+
+#define SPI_MILLIS() ( (uint32_t ) (esp_timer_get_time() / 1000) )
+
+typedef enum {
+    SPI_OPEN_NONE,
+    SPI_OPEN_READ,              /*!< READ_MULTIPLE_BLOCK in progress */
+    SPI_OPEN_WRITE,             /*!< WRITE_MULTIPLE_BLOCK in progress */
+} spi_open_t;
+
+typedef struct {
+    spi_device_handle_t handle;
+    gpio_num_t gpio_cs;
+    gpio_num_t gpio_cd;
+    gpio_num_t gpio_wp;
+    spi_open_t open;            /*!< multi-block transfer left open by SCF_NO_AUTO_STOP */
+    uint8_t* ones;              /*!< DMA capable, SPI_BLOCK_SIZE bytes of 0xff clocked out while receiving */
+    uint8_t* cmd_tx;            /*!< DMA capable, SPI_CMD_FRAME bytes */
+    uint8_t* cmd_rx;            /*!< DMA capable, SPI_CMD_FRAME bytes */
+    const uint8_t* rx_left;     /*!< bytes of cmd_rx received after R1, not consumed yet */
+    size_t rx_left_count;
+} spi_slot_t;
+
+static spi_slot_t s_slots[SPI_SLOT_COUNT];
+
+static spi_slot_t* spi_get_slot(int slot)
+{
+    if (slot < 0 || slot >= SPI_SLOT_COUNT || s_slots[slot].handle == NULL) {
+        return NULL;
+    }
+    return &s_slots[slot];
+}
+
+static esp_err_t spi_add_device(int slot, spi_slot_t* s, uint32_t freq_khz)
+{
+    spi_device_interface_config_t devcfg = {
+        .clock_speed_hz = freq_khz * 1000,
+        .mode = 0,
+        /* CS is a GPIO driven here, so that it stays asserted across transactions */
+        .spics_io_num = -1,
+        .queue_size = SPI_QUEUE_SIZE,
+    };
+    return spi_bus_add_device((spi_host_device_t) slot, &devcfg, &s->handle);
+}
+
+/* Full duplex transfer of DMA capable buffers; rx may be NULL */
+static esp_err_t spi_xfer(spi_slot_t* s, const void* tx, void* rx, size_t len)
+{
+    spi_transaction_t t = {
+        .length = len * 8,
+        .tx_buffer = tx,
+        .rx_buffer = rx,
+    };
+    return spi_device_polling_transmit(s->handle, &t);
+}
+
+/* Transfer of up to 4 bytes through the transaction itself; 0xff is sent if tx is NULL */
+static esp_err_t spi_xfer_small(spi_slot_t* s, const uint8_t* tx, uint8_t* rx, size_t len)
+{
+    spi_transaction_t t = {
+        .flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA,
+        .length = len * 8,
+    };
+    memset(t.tx_data, 0xff, sizeof(t.tx_data));
+    if (tx) {
+        memcpy(t.tx_data, tx, len);
+    }
+    esp_err_t err = spi_device_polling_transmit(s->handle, &t);
+    if (rx) {
+        memcpy(rx, t.rx_data, len);
+    }
+    return err;
+}
+
+/* Queue n transactions back to back, then wait for all of them;
+ * between the two, the caller's work overlaps the transfer */
+static esp_err_t spi_queue(spi_slot_t* s, spi_transaction_t* t, size_t n, size_t* out_queued)
+{
+    esp_err_t err = ESP_OK;
+    size_t i = 0;
+    for (; i < n && err == ESP_OK; ++i) {
+        err = spi_device_queue_trans(s->handle, &t[i], portMAX_DELAY);
+    }
+    *out_queued = (err == ESP_OK) ? i : i - 1;
+    return err;
+}
+
+static esp_err_t spi_collect(spi_slot_t* s, size_t n)
+{
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < n; ++i) {
+        spi_transaction_t* done;
+        esp_err_t e = spi_device_get_trans_result(s->handle, &done, portMAX_DELAY);
+        if (err == ESP_OK) {
+            err = e;
+        }
+    }
+    return err;
+}
+
+/* Receive bytes following R1: first those which came with the command frame */
+static esp_err_t spi_read_rsp(spi_slot_t* s, uint8_t* rx, size_t len)
+{
+    for (; len > 0 && s->rx_left_count > 0; --len, --s->rx_left_count) {
+        *rx++ = *s->rx_left++;
+    }
+    return (len > 0) ? spi_xfer_small(s, NULL, rx, len) : ESP_OK;
+}
+
+/* Clock in single bytes until one differs from `idle` (0xff while waiting for
+ * a token, 0x00 while the card signals busy). The first SPI_SPIN_US are polled
+ * back to back, which covers the usual token and block programming times
+ * without the latency of a tick; past that the task sleeps a tick between
+ * polls, so long waits such as erases don't hold the CPU.
+ */
+static esp_err_t spi_poll(spi_slot_t* s, uint8_t idle, uint8_t* out, uint32_t timeout_ms)
+{
+    const uint32_t t0 = SPI_MILLIS();
+    const int64_t spin_end = esp_timer_get_time() + SPI_SPIN_US;
+    for (;;) {
+        uint8_t b;
+        esp_err_t err = spi_read_rsp(s, &b, 1);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (b != idle) {
+            if (out) {
+                *out = b;
+            }
+            return ESP_OK;
+        }
+        if (SPI_MILLIS() - t0 >= timeout_ms) {
+            return ESP_ERR_TIMEOUT;
+        }
+        if (esp_timer_get_time() >= spin_end) {
+            vTaskDelay(1);
+        }
+    }
+}
+
+static esp_err_t spi_wait_busy(spi_slot_t* s, uint32_t timeout_ms)
+{
+    esp_err_t err = spi_poll(s, 0x00, NULL, timeout_ms);
+    if (err == ESP_ERR_TIMEOUT) {
+        log_e( "%s: card busy after %ums", __func__, timeout_ms);
+    }
+    return err;
+}
+
+static esp_err_t spi_r1_to_err(uint8_t r1)
+{
+    if (r1 & SD_SPI_R1_NO_RESPONSE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (r1 & SD_SPI_R1_CMD_CRC_ERR) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    if (r1 & SD_SPI_R1_ILLEGAL_CMD) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (r1 & (SD_SPI_R1_ADDR_ERR | SD_SPI_R1_PARAM_ERR)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (r1 & (SD_SPI_R1_ERASE_RST | SD_SPI_R1_ERASE_SEQ_ERR)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+/* Send a command frame and receive R1, 0xff if the card didn't answer */
+static esp_err_t spi_send_cmd(spi_slot_t* s, uint8_t opcode, uint32_t arg, uint8_t* out_r1)
+{
+    uint8_t* tx = s->cmd_tx;
+    uint8_t* rx = s->cmd_rx;
+    tx[0] = 0x40 | opcode;
+    tx[1] = arg >> 24;
+    tx[2] = arg >> 16;
+    tx[3] = arg >> 8;
+    tx[4] = arg;
+    tx[5] = (sdEmmc_crc7(tx, 5) << 1) | 1;
+    tx[6] = 0xff;
+    tx[7] = 0xff;
+    s->rx_left_count = 0;
+    esp_err_t err = spi_xfer(s, tx, rx, SPI_CMD_FRAME);
+    if (err != ESP_OK) {
+        return err;
+    }
+    /* the byte following STOP_TRANSMISSION is a stuff byte */
+    size_t first = (opcode == MMC_STOP_TRANSMISSION) ? 7 : 6;
+    for (size_t i = first; i < SPI_CMD_FRAME; ++i) {
+        if (!(rx[i] & SD_SPI_R1_NO_RESPONSE)) {
+            *out_r1 = rx[i];
+            s->rx_left = rx + i + 1;
+            s->rx_left_count = SPI_CMD_FRAME - i - 1;
+            return ESP_OK;
+        }
+    }
+    for (size_t seen = SPI_CMD_FRAME - first; seen < SPI_NCR_MAX; ++seen) {
+        err = spi_xfer_small(s, NULL, out_r1, 1);
+        if (err != ESP_OK || !(*out_r1 & SD_SPI_R1_NO_RESPONSE)) {
+            return err;
+        }
+    }
+    *out_r1 = 0xff;
+    return ESP_OK;
+}
+
+/* Receive blocks, each after its start token. The CRC of a block is checked
+ * while the next one is on the wire.
+ */
+static esp_err_t spi_read_blocks(spi_slot_t* s, uint8_t* dst, size_t block_size, size_t block_count,
+        uint32_t timeout_ms)
+{
+    const uint8_t* prev = NULL;
+    uint16_t prev_crc = 0;
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < block_count && err == ESP_OK; ++i, dst += block_size) {
+        uint8_t token;
+        err = spi_poll(s, 0xff, &token, timeout_ms);
+        if (err != ESP_OK) {
+            log_e( "%s: no data token after %ums", __func__, timeout_ms);
+            break;
+        }
+        if (token != SD_SPI_TOKEN_START_BLOCK) {
+            log_e( "%s: data error token 0x%02x", __func__, token);
+            err = (token & SD_SPI_DATA_ERR_RANGE) ? ESP_ERR_INVALID_ARG : ESP_ERR_INVALID_RESPONSE;
+            break;
+        }
+        spi_transaction_t t[2] = {
+            { .length = block_size * 8, .tx_buffer = s->ones, .rx_buffer = dst },
+            { .flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA, .length = 16,
+              .tx_data = { 0xff, 0xff } },
+        };
+        size_t queued;
+        err = spi_queue(s, t, 2, &queued);
+        if (prev != NULL && sdEmmc_crc16(0, prev, block_size) != prev_crc) {
+            log_e( "%s: block %d: CRC mismatch", __func__, i - 1);
+            err = ESP_ERR_INVALID_CRC;
+        }
+        esp_err_t done = spi_collect(s, queued);
+        if (err == ESP_OK) {
+            err = done;
+        }
+        prev = dst;
+        prev_crc = (t[1].rx_data[0] << 8) | t[1].rx_data[1];
+    }
+    if (err == ESP_OK && prev != NULL && sdEmmc_crc16(0, prev, block_size) != prev_crc) {
+        log_e( "%s: block %d: CRC mismatch", __func__, block_count - 1);
+        err = ESP_ERR_INVALID_CRC;
+    }
+    return err;
+}
+
+/* Send blocks, each after the token, and wait while the card programs it.
+ * The CRC of the next block is computed while one is on the wire.
+ */
+static esp_err_t spi_write_blocks(spi_slot_t* s, const uint8_t* src, size_t block_size, size_t block_count,
+        uint8_t token, uint32_t timeout_ms)
+{
+    uint16_t crc = sdEmmc_crc16(0, src, block_size);
+    for (size_t i = 0; i < block_count; ++i, src += block_size) {
+        spi_transaction_t t[3] = {
+            { .flags = SPI_TRANS_USE_TXDATA, .length = 8, .tx_data = { token } },
+            { .length = block_size * 8, .tx_buffer = src },
+            /* CRC, then the data response */
+            { .flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA, .length = 32,
+              .tx_data = { crc >> 8, crc & 0xff, 0xff, 0xff } },
+        };
+        size_t queued;
+        esp_err_t err = spi_queue(s, t, 3, &queued);
+        if (i + 1 < block_count) {
+            crc = sdEmmc_crc16(0, src + block_size, block_size);
+        }
+        esp_err_t done = spi_collect(s, queued);
+        if (err != ESP_OK || done != ESP_OK) {
+            return (err != ESP_OK) ? err : done;
+        }
+        uint8_t rsp = t[2].rx_data[2];
+        if ((rsp & 0x11) != 0x01) {
+            rsp = t[2].rx_data[3];
+        }
+        switch (rsp & SD_SPI_DATA_RSP_MASK) {
+        case SD_SPI_DATA_RSP_ACCEPTED:
+            break;
+        case SD_SPI_DATA_RSP_CRC_ERR:
+            log_e( "%s: block %d: CRC error", __func__, i);
+            return ESP_ERR_INVALID_CRC;
+        case SD_SPI_DATA_RSP_WRITE_ERR:
+            log_e( "%s: block %d: write error", __func__, i);
+            return ESP_FAIL;
+        default:
+            log_e( "%s: block %d: data response 0x%02x", __func__, i, rsp);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        err = spi_wait_busy(s, timeout_ms);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+/* End the open multi-block transfer: Stop Tran token after writes,
+ * STOP_TRANSMISSION after reads; then wait while the card is busy */
+static esp_err_t spi_end_transfer(spi_slot_t* s, uint32_t timeout_ms)
+{
+    esp_err_t err;
+    if (s->open == SPI_OPEN_WRITE) {
+        /* busy starts one byte after the token */
+        const uint8_t stop[2] = { SD_SPI_TOKEN_STOP_TRAN, 0xff };
+        err = spi_xfer_small(s, stop, NULL, sizeof(stop));
+    } else {
+        uint8_t r1;
+        err = spi_send_cmd(s, MMC_STOP_TRANSMISSION, 0, &r1);
+        if (err == ESP_OK) {
+            err = spi_r1_to_err(r1);
+        }
+    }
+    s->open = SPI_OPEN_NONE;
+    esp_err_t busy = spi_wait_busy(s, timeout_ms);
+    return (err != ESP_OK) ? err : busy;
+}
+
+/* Command, its response, and its data blocks */
+static esp_err_t spi_run_cmd(spi_slot_t* s, sdmmc_command_t* cmd)
+{
+    const bool is_read = (cmd->flags & SCF_CMD_READ) != 0;
+    const bool has_data = cmd->data != NULL && cmd->datalen > 0;
+    esp_err_t err;
+    if (!(cmd->flags & SCF_DATA_ONLY)) {
+        uint8_t r1;
+        err = spi_send_cmd(s, cmd->opcode, cmd->arg, &r1);
+        if (err != ESP_OK) {
+            return err;
+        }
+        cmd->response[0] = r1;
+        err = spi_r1_to_err(r1);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (cmd->opcode == MMC_SEND_STATUS) {
+            /* R2; SD_STATUS shares the opcode and the response */
+            uint8_t status;
+            err = spi_read_rsp(s, &status, 1);
+            cmd->response[0] |= status << 8;
+        } else if (!has_data && (cmd->opcode == SD_SEND_IF_COND || cmd->opcode == SD_READ_OCR)) {
+            /* R7, R3 */
+            uint8_t rsp[4];
+            err = spi_read_rsp(s, rsp, sizeof(rsp));
+            cmd->response[0] = (rsp[0] << 24) | (rsp[1] << 16) | (rsp[2] << 8) | rsp[3];
+        }
+        if (err == ESP_OK && (cmd->flags & SCF_RSP_BSY)) {
+            err = spi_wait_busy(s, cmd->timeout_ms);
+        }
+        if (!is_read) {
+            /* only a data token may follow, and only when reading */
+            s->rx_left_count = 0;
+        }
+        if (err != ESP_OK || !has_data) {
+            return err;
+        }
+    }
+    const size_t block_size = (cmd->blklen != 0 && cmd->blklen < cmd->datalen) ? cmd->blklen : cmd->datalen;
+    const size_t block_count = cmd->datalen / block_size;
+    if (block_size > SPI_BLOCK_SIZE || block_size % 4 != 0 || cmd->datalen % block_size != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const bool multi = cmd->opcode == MMC_READ_BLOCK_MULTIPLE || cmd->opcode == MMC_WRITE_BLOCK_MULTIPLE;
+    if (multi) {
+        s->open = is_read ? SPI_OPEN_READ : SPI_OPEN_WRITE;
+    }
+    if (is_read) {
+        err = spi_read_blocks(s, cmd->data, block_size, block_count, cmd->timeout_ms);
+    } else {
+        err = spi_write_blocks(s, cmd->data, block_size, block_count,
+                multi ? SD_SPI_TOKEN_START_MULTI_WRITE : SD_SPI_TOKEN_START_BLOCK, cmd->timeout_ms);
+    }
+    if (err == ESP_OK && multi && !(cmd->flags & SCF_NO_AUTO_STOP)) {
+        err = spi_end_transfer(s, cmd->timeout_ms);
+    }
+    return err;
+}
+
+static void spi_select(spi_slot_t* s, bool go_idle)
+{
+    spi_device_acquire_bus(s->handle, portMAX_DELAY);
+    if (go_idle) {
+        /* at least 74 clocks with CS high before GO_IDLE_STATE */
+        spi_xfer(s, s->ones, NULL, 12);
+    }
+    gpio_set_level(s->gpio_cs, 0);
+}
+
+static void spi_deselect(spi_slot_t* s)
+{
+    gpio_set_level(s->gpio_cs, 1);
+    /* 8 more clocks, so that the card releases MISO */
+    spi_xfer_small(s, NULL, NULL, 1);
+    spi_device_release_bus(s->handle);
+}
+
+esp_err_t sdEmmc_host_spi_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_host_spi_init_slot(int slot, const sdEmmc_host_spi_slot_config_t* slot_config)
+{
+    if (slot != HSPI_HOST && slot != VSPI_HOST) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    spi_slot_t* s = &s_slots[slot];
+    if (s->handle != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    spi_bus_config_t buscfg = {
+        .mosi_io_num = slot_config->gpio_mosi,
+        .miso_io_num = slot_config->gpio_miso,
+        .sclk_io_num = slot_config->gpio_sck,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = SPI_BLOCK_SIZE,
+    };
+    esp_err_t err = spi_bus_initialize((spi_host_device_t) slot, &buscfg, slot_config->dma_channel);
+    if (err != ESP_OK) {
+        log_e( "%s: spi_bus_initialize returned 0x%x", __func__, err);
+        return err;
+    }
+    uint8_t* buf = (uint8_t*) heap_caps_malloc(SPI_BLOCK_SIZE + 2 * SPI_CMD_FRAME, MALLOC_CAP_DMA);
+    if (buf == NULL) {
+        spi_bus_free((spi_host_device_t) slot);
+        return ESP_ERR_NO_MEM;
+    }
+    memset(buf, 0xff, SPI_BLOCK_SIZE);
+    s->ones = buf;
+    s->cmd_tx = buf + SPI_BLOCK_SIZE;
+    s->cmd_rx = buf + SPI_BLOCK_SIZE + SPI_CMD_FRAME;
+    s->gpio_cs = slot_config->gpio_cs;
+    s->gpio_cd = slot_config->gpio_cd;
+    s->gpio_wp = slot_config->gpio_wp;
+    s->open = SPI_OPEN_NONE;
+
+    gpio_config_t io_conf = {
+        .pin_bit_mask = 1ULL << s->gpio_cs,
+        .mode = GPIO_MODE_OUTPUT,
+    };
+    gpio_config(&io_conf);
+    gpio_set_level(s->gpio_cs, 1);
+    io_conf.pin_bit_mask = 0;
+    if (s->gpio_cd != SDEMMC_HOST_SPI_NO_CD) {
+        io_conf.pin_bit_mask |= 1ULL << s->gpio_cd;
+    }
+    if (s->gpio_wp != SDEMMC_HOST_SPI_NO_WP) {
+        io_conf.pin_bit_mask |= 1ULL << s->gpio_wp;
+    }
+    if (io_conf.pin_bit_mask != 0) {
+        io_conf.mode = GPIO_MODE_INPUT;
+        io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+        gpio_config(&io_conf);
+    }
+
+    err = spi_add_device(slot, s, SPI_INIT_FREQ_KHZ);
+    if (err != ESP_OK) {
+        log_e( "%s: spi_bus_add_device returned 0x%x", __func__, err);
+        s->handle = NULL;
+        heap_caps_free(buf);
+        spi_bus_free((spi_host_device_t) slot);
+    }
+    return err;
+}
+
+esp_err_t sdEmmc_host_spi_set_bus_width(int slot, size_t width)
+{
+    (void) slot;
+    return (width == 1) ? ESP_OK : ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t sdEmmc_host_spi_set_card_clk(int slot, uint32_t freq_khz)
+{
+    spi_slot_t* s = spi_get_slot(slot);
+    if (s == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s->open != SPI_OPEN_NONE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* the clock of an SPI device is fixed when it is added */
+    spi_bus_remove_device(s->handle);
+    esp_err_t err = spi_add_device(slot, s, freq_khz);
+    if (err != ESP_OK) {
+        log_e( "%s: spi_bus_add_device returned 0x%x", __func__, err);
+        /* stay usable at the probing clock */
+        esp_err_t readd = spi_add_device(slot, s, SPI_INIT_FREQ_KHZ);
+        if (readd != ESP_OK) {
+            /* no device left on the bus; release the slot as init_slot would */
+            log_e( "%s: slot %d lost, spi_bus_add_device returned 0x%x", __func__, slot, readd);
+            s->handle = NULL;
+            heap_caps_free(s->ones);
+            spi_bus_free((spi_host_device_t) slot);
+            return readd;
+        }
+    }
+    return err;
+}
+
+esp_err_t sdEmmc_host_spi_do_transaction(int slot, sdmmc_command_t* cmdinfo)
+{
+    spi_slot_t* s = spi_get_slot(slot);
+    if (s == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s->gpio_cd != SDEMMC_HOST_SPI_NO_CD && gpio_get_level(s->gpio_cd) != 0) {
+        /* the card is gone along with its open transfer; give the bus back */
+        if (s->open != SPI_OPEN_NONE) {
+            s->open = SPI_OPEN_NONE;
+            spi_deselect(s);
+        }
+        return ESP_ERR_NOT_FOUND;
+    }
+    const bool is_write = cmdinfo->datalen > 0 && !(cmdinfo->flags & SCF_CMD_READ);
+    if (is_write && s->gpio_wp != SDEMMC_HOST_SPI_NO_WP && gpio_get_level(s->gpio_wp) != 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((cmdinfo->flags & SCF_DATA_ONLY) && s->open == SPI_OPEN_NONE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    cmdinfo->response[0] = 0;
+
+    esp_err_t err;
+    if (s->open == SPI_OPEN_NONE) {
+        spi_select(s, cmdinfo->opcode == MMC_GO_IDLE_STATE);
+        err = spi_run_cmd(s, cmdinfo);
+    } else if (cmdinfo->flags & SCF_DATA_ONLY) {
+        err = spi_run_cmd(s, cmdinfo);
+    } else if (cmdinfo->opcode == MMC_STOP_TRANSMISSION) {
+        err = spi_end_transfer(s, cmdinfo->timeout_ms);
+    } else {
+        /* any other command ends the open transfer first */
+        err = spi_end_transfer(s, cmdinfo->timeout_ms);
+        if (err == ESP_OK) {
+            err = spi_run_cmd(s, cmdinfo);
+        }
+    }
+    /* errors end the transfer, so that the card is ready for the next command */
+    if (err != ESP_OK && s->open != SPI_OPEN_NONE) {
+        spi_end_transfer(s, cmdinfo->timeout_ms);
+    }
+    if (s->open == SPI_OPEN_NONE) {
+        spi_deselect(s);
+    }
+    cmdinfo->error = err;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_host_spi_deinit(void)
+{
+    for (int slot = 0; slot < SPI_SLOT_COUNT; ++slot) {
+        spi_slot_t* s = &s_slots[slot];
+        if (s->handle == NULL) {
+            continue;
+        }
+        spi_bus_remove_device(s->handle);
+        spi_bus_free((spi_host_device_t) slot);
+        heap_caps_free(s->ones);
+        memset(s, 0, sizeof(*s));
+    }
+    return ESP_OK;
+}
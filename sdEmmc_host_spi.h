@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * SPI bus host
+ *
+ * Drives the card in SPI mode through an ESP32 SPI peripheral (HSPI_HOST or
+ * VSPI_HOST, passed as the slot number), for boards which only route SPI to
+ * the card slot.
+ *
+ * Multi-block reads and writes are sent as one command followed by a stream
+ * of data tokens, not as a command per block. The token, the block and its
+ * CRC are queued back to back as DMA transactions; while a block is on the
+ * wire, the CPU computes the CRC16 of the next block to write, or checks
+ * the one of the block received before it. Waits for a data token or for
+ * the end of busy poll the card a few times, then sleep a tick between
+ * polls rather than spin.
+ *
+ * Chip select is driven as a GPIO, so it can stay asserted across calls:
+ * the host accepts SCF_NO_AUTO_STOP and SCF_DATA_ONLY (SDMMC_HOST_FLAG_STREAM).
+ * While such a transfer is open the SPI bus is held, and other devices on
+ * the same bus wait until the stream ends. The transfer is ended by
+ * STOP_TRANSMISSION, sent as the Stop Tran token after writes, and by any
+ * error.
+ */
+
+/**
+ * @brief Default sdmmc_host_t structure initializer for the SPI host
+ *
+ * Uses HSPI_HOST, with the default speed clock of 20MHz
+ */
+#define SDEMMC_HOST_SPI_DEFAULT() {\
+    .flags = SDMMC_HOST_FLAG_SPI | SDMMC_HOST_FLAG_STREAM | SDMMC_HOST_MEM_CARD, \
+    .slot = HSPI_HOST, \
+    .max_freq_khz = 20000, \
+    .io_voltage = 3.3f, \
+    .init = &sdEmmc_host_spi_init, \
+    .set_bus_width = &sdEmmc_host_spi_set_bus_width, \
+    .set_card_clk = &sdEmmc_host_spi_set_card_clk, \
+    .do_transaction = &sdEmmc_host_spi_do_transaction, \
+    .deinit = &sdEmmc_host_spi_deinit, \
+}
+
+/**
+ * Extra configuration for an SPI host slot
+ */
+typedef struct {
+    gpio_num_t gpio_miso;   ///< GPIO number of MISO signal
+    gpio_num_t gpio_mosi;   ///< GPIO number of MOSI signal
+    gpio_num_t gpio_sck;    ///< GPIO number of SCK signal
+    gpio_num_t gpio_cs;     ///< GPIO number of CS signal
+    gpio_num_t gpio_cd;     ///< GPIO number of card detect signal (low when a card is present)
+    gpio_num_t gpio_wp;     ///< GPIO number of write protect signal (high when protected)
+    int dma_channel;        ///< DMA channel used by the SPI peripheral (1 or 2)
+} sdEmmc_host_spi_slot_config_t;
+
+#define SDEMMC_HOST_SPI_NO_CD     ((gpio_num_t) -1)     ///< indicates that card detect line is not used
+#define SDEMMC_HOST_SPI_NO_WP     ((gpio_num_t) -1)     ///< indicates that write protect line is not used
+
+/**
+ * Macro defining default configuration of an SPI host slot, on the pins
+ * of SDMMC slot 1
+ */
+#define SDEMMC_HOST_SPI_SLOT_CONFIG_DEFAULT() {\
+    .gpio_miso = GPIO_NUM_2, \
+    .gpio_mosi = GPIO_NUM_15, \
+    .gpio_sck  = GPIO_NUM_14, \
+    .gpio_cs   = GPIO_NUM_13, \
+    .gpio_cd   = SDEMMC_HOST_SPI_NO_CD, \
+    .gpio_wp   = SDEMMC_HOST_SPI_NO_WP, \
+    .dma_channel = 1, \
+}
+
+/**
+ * @brief Initialize the SPI host driver
+ *
+ * Slots are set up by sdEmmc_host_spi_init_slot; this only exists for
+ * sdmmc_host_t::init.
+ *
+ * @return ESP_OK
+ */
+esp_err_t sdEmmc_host_spi_init(void);
+
+/**
+ * @brief Initialize an SPI peripheral as the host of one card
+ *
+ * Initializes the SPI bus, configures CS as an output and CD/WP as inputs,
+ * and allocates the DMA buffers the slot needs. The card clock starts at
+ * 400kHz.
+ *
+ * @note This function is not thread safe
+ *
+ * @param slot  SPI peripheral (HSPI_HOST or VSPI_HOST)
+ * @param slot_config  pins and DMA channel of the slot
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the slot number is not valid
+ *      - ESP_ERR_INVALID_STATE if the slot was already initialized
+ *      - ESP_ERR_NO_MEM if memory can not be allocated
+ *      - other error codes of spi_bus_initialize and spi_bus_add_device
+ */
+esp_err_t sdEmmc_host_spi_init_slot(int slot, const sdEmmc_host_spi_slot_config_t* slot_config);
+
+/**
+ * @brief Select bus width to be used for data transfer
+ *
+ * @param slot  SPI peripheral
+ * @param width  bus width; only 1 is valid in SPI mode
+ * @return
+ *      - ESP_OK if width is 1
+ *      - ESP_ERR_NOT_SUPPORTED otherwise
+ */
+esp_err_t sdEmmc_host_spi_set_bus_width(int slot, size_t width);
+
+/**
+ * @brief Set card clock frequency
+ *
+ * @note This function is not thread safe
+ *
+ * @param slot  SPI peripheral
+ * @param freq_khz  card clock frequency, in kHz
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the slot is not initialized
+ *      - ESP_ERR_INVALID_STATE if a multi-block transfer is open
+ *      - error of spi_bus_add_device if the new clock is refused; the slot
+ *        stays usable at 400kHz, unless that fails too, in which case the slot
+ *        is released and has to be initialized again with sdEmmc_host_spi_init_slot
+ */
+esp_err_t sdEmmc_host_spi_set_card_clk(int slot, uint32_t freq_khz);
+
+/**
+ * @brief Send command to the card and get response
+ *
+ * Returns when the response is received, data is transferred and the card
+ * is no longer busy, or on timeout. Response and data errors are reported
+ * in cmdinfo->error. cmdinfo->response[0] holds R1; for SEND_STATUS, R2
+ * (R1 in the low byte); for READ_OCR and SEND_IF_COND, the 32 bits which
+ * follow R1.
+ *
+ * @attention Data buffer passed in cmdinfo->data must be in DMA capable memory
+ *
+ * @param slot  SPI peripheral
+ * @param cmdinfo  pointer to structure describing command and data to transfer
+ * @return
+ *      - ESP_OK if the command was carried out; see cmdinfo->error
+ *      - ESP_ERR_INVALID_ARG if the slot is not initialized
+ *      - ESP_ERR_NOT_FOUND if the card detect line reports no card
+ *      - ESP_ERR_INVALID_STATE if the card is write protected, or for
+ *        SCF_DATA_ONLY without an open transfer
+ */
+esp_err_t sdEmmc_host_spi_do_transaction(int slot, sdmmc_command_t* cmdinfo);
+
+/**
+ * @brief Release all initialized SPI slots
+ *
+ * @note This function is not thread safe
+ *
+ * @return ESP_OK
+ */
+esp_err_t sdEmmc_host_spi_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
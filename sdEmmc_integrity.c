@@ -0,0 +1,182 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_crc.h"
+#include "sdEmmc_integrity.h"
+#include "sys/param.h"
+#include "soc/soc_memory_layout.h"
+
+#define INTEGRITY_SECTOR_SIZE   512
+
+size_t sdEmmc_integrity_tag_count(size_t sector_count)
+{
+    return (sector_count + SDEMMC_INTEGRITY_TAGS_PER_SECTOR - 1) /
+            SDEMMC_INTEGRITY_TAGS_PER_SECTOR * SDEMMC_INTEGRITY_TAGS_PER_SECTOR;
+}
+
+/* 0 is reserved for "unknown"; a sector whose CRC happens to be 0 gets tag 1 */
+static uint32_t integrity_tag(const void* sector)
+{
+    uint32_t crc = sdEmmc_crc32c(0, sector, INTEGRITY_SECTOR_SIZE);
+    return crc ? crc : 1;
+}
+
+/* Intersect [start, start + count) with the covered range */
+static bool integrity_clip(const sdEmmc_integrity_config_t* c, size_t start, size_t count,
+        size_t* out_first, size_t* out_end)
+{
+    *out_first = MAX(start, c->first_sector);
+    *out_end = MIN(start + count, c->first_sector + c->sector_count);
+    return *out_first < *out_end;
+}
+
+/* Write the tag sectors holding the tags of [first, end) to the metadata area */
+static esp_err_t integrity_persist(sdmmc_card_t* card, size_t first, size_t end)
+{
+    const sdEmmc_integrity_config_t* c = &card->integrity->config;
+    size_t m0 = (first - c->first_sector) / SDEMMC_INTEGRITY_TAGS_PER_SECTOR;
+    size_t m1 = (end - 1 - c->first_sector) / SDEMMC_INTEGRITY_TAGS_PER_SECTOR;
+    esp_err_t err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+    if (err == ESP_OK) {
+        err = sdEmmc_write_sectors_dma(card, c->tags + m0 * SDEMMC_INTEGRITY_TAGS_PER_SECTOR,
+                c->meta_sector + m0, m1 - m0 + 1);
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: writing tag sectors %d..%d returned 0x%x", __func__, m0, m1, err);
+    }
+    return err;
+}
+
+esp_err_t sdEmmc_integrity_attach(sdmmc_card_t* card, sdEmmc_integrity_t* integ,
+        const sdEmmc_integrity_config_t* config)
+{
+    const size_t tag_count = sdEmmc_integrity_tag_count(config->sector_count);
+    const size_t meta_count = tag_count / SDEMMC_INTEGRITY_TAGS_PER_SECTOR;
+    if (config->tags == NULL || config->sector_count == 0 ||
+        config->first_sector + config->sector_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config->persist) {
+        if (!esp_ptr_dma_capable(config->tags) || (intptr_t) config->tags % 4 != 0 ||
+            config->meta_sector + meta_count > card->csd.capacity ||
+            (config->meta_sector < config->first_sector + config->sector_count &&
+             config->first_sector < config->meta_sector + meta_count)) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        esp_err_t err = sdEmmc_read_sectors_dma(card, config->tags, config->meta_sector, meta_count);
+        if (err != ESP_OK) {
+            log_e( "%s: loading tags returned 0x%x", __func__, err);
+            return err;
+        }
+    }
+    memset(integ, 0, sizeof(*integ));
+    integ->config = *config;
+    card->integrity = integ;
+    log_d( "%s: %d sectors from %d, %s", __func__, config->sector_count, config->first_sector,
+            config->persist ? "persistent" : "RAM tags");
+    return ESP_OK;
+}
+
+void sdEmmc_integrity_detach(sdmmc_card_t* card)
+{
+    card->integrity = NULL;
+}
+
+esp_err_t sdEmmc_integrity_on_read(sdmmc_card_t* card, const void* dst,
+        size_t start_sector, size_t sector_count)
+{
+    sdEmmc_integrity_t* integ = card->integrity;
+    const sdEmmc_integrity_config_t* c = &integ->config;
+    size_t first, end;
+    if (!integrity_clip(c, start_sector, sector_count, &first, &end)) {
+        return ESP_OK;
+    }
+    esp_err_t err = ESP_OK;
+    const uint8_t* p = (const uint8_t*) dst + (first - start_sector) * INTEGRITY_SECTOR_SIZE;
+    for (size_t s = first; s < end; ++s, p += INTEGRITY_SECTOR_SIZE) {
+        uint32_t tag = c->tags[s - c->first_sector];
+        if (tag == 0) {
+            continue;
+        }
+        uint32_t actual = integrity_tag(p);
+        if (actual != tag) {
+            log_e( "%s: sector %d: CRC %08x, written as %08x", __func__, s, actual, tag);
+            integ->errors++;
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    return err;
+}
+
+/* Read each sector back through a pool buffer; sdEmmc_read_sectors_dma
+ * checks it against the tag just stored */
+static esp_err_t integrity_verify(sdmmc_card_t* card, size_t first, size_t end)
+{
+    void* buf = sdEmmc_dma_buf_get(card);
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+    for (size_t s = first; s < end && err == ESP_OK; ++s) {
+        err = sdEmmc_read_sectors_dma(card, buf, s, 1);
+    }
+    sdEmmc_dma_buf_put(card, buf);
+    return err;
+}
+
+bool sdEmmc_integrity_waits(const sdmmc_card_t* card, size_t start_sector, size_t sector_count)
+{
+    const sdEmmc_integrity_config_t* c = &card->integrity->config;
+    size_t first, end;
+    return (c->persist || c->verify_after_write) &&
+           integrity_clip(c, start_sector, sector_count, &first, &end);
+}
+
+esp_err_t sdEmmc_integrity_before_write(sdmmc_card_t* card, size_t start_sector, size_t sector_count)
+{
+    const sdEmmc_integrity_config_t* c = &card->integrity->config;
+    size_t first, end;
+    if (!c->persist || !integrity_clip(c, start_sector, sector_count, &first, &end)) {
+        return ESP_OK;
+    }
+    bool changed = false;
+    for (size_t s = first; s < end; ++s) {
+        changed |= c->tags[s - c->first_sector] != 0;
+        c->tags[s - c->first_sector] = 0;
+    }
+    /* sectors already unknown cost nothing extra */
+    return changed ? integrity_persist(card, first, end) : ESP_OK;
+}
+
+esp_err_t sdEmmc_integrity_on_write(sdmmc_card_t* card, const void* src,
+        size_t start_sector, size_t sector_count)
+{
+    const sdEmmc_integrity_config_t* c = &card->integrity->config;
+    size_t first, end;
+    if (!integrity_clip(c, start_sector, sector_count, &first, &end)) {
+        return ESP_OK;
+    }
+    const uint8_t* p = (const uint8_t*) src + (first - start_sector) * INTEGRITY_SECTOR_SIZE;
+    for (size_t s = first; s < end; ++s, p += INTEGRITY_SECTOR_SIZE) {
+        c->tags[s - c->first_sector] = integrity_tag(p);
+    }
+    esp_err_t err = ESP_OK;
+    if (c->persist) {
+        err = integrity_persist(card, first, end);
+    }
+    if (err == ESP_OK && c->verify_after_write) {
+        err = integrity_verify(card, first, end);
+    }
+    return err;
+}
+
+esp_err_t sdEmmc_integrity_on_erase(sdmmc_card_t* card, size_t start_sector, size_t sector_count)
+{
+    const sdEmmc_integrity_config_t* c = &card->integrity->config;
+    size_t first, end;
+    if (!integrity_clip(c, start_sector, sector_count, &first, &end)) {
+        return ESP_OK;
+    }
+    memset(c->tags + (first - c->first_sector), 0, (end - first) * sizeof(uint32_t));
+    return c->persist ? integrity_persist(card, first, end) : ESP_OK;
+}
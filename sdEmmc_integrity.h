@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * End-to-end sector integrity
+ *
+ * While attached to a card, every sector written through the driver within
+ * the covered range gets a CRC-32C tag, and every sector read back is checked
+ * against its tag, so data silently corrupted by the card is reported as
+ * ESP_ERR_INVALID_CRC instead of being returned.
+ *
+ * Tags live in a caller-provided array, one uint32_t per covered sector.
+ * With persist set, the array is loaded from a metadata area on the card at
+ * attach, and the tag sectors touched by each write are written through to
+ * that area twice: with the tags of the range set to "unknown" before the
+ * data, and with the new tags right after it. A power loss in between
+ * leaves the sectors unchecked rather than failing with the old tags. A tag
+ * of 0 means "unknown": such sectors aren't checked, and erased sectors go
+ * back to this state.
+ *
+ * Vectored transfers don't use host scatter-gather while integrity is
+ * attached, so that all data passes through the checked paths. Writes with
+ * persist or verify_after_write wait for the card to program each step, so
+ * sdEmmc_write_sectors_dma_no_wait rejects them in the covered range;
+ * sdEmmc_log and streams then write and wait instead.
+ */
+
+#define SDEMMC_INTEGRITY_TAGS_PER_SECTOR    (512 / sizeof(uint32_t))
+
+/**
+ * Integrity configuration
+ */
+typedef struct {
+    uint32_t* tags;             /*!< sdEmmc_integrity_tag_count(sector_count) tags; DMA capable and word aligned if persist is set */
+    size_t first_sector;        /*!< first covered sector */
+    size_t sector_count;        /*!< number of covered sectors */
+    bool persist;               /*!< keep tags in the metadata area starting at meta_sector */
+    size_t meta_sector;         /*!< first sector of the metadata area, outside the covered range; zero filled before first use */
+    bool verify_after_write;    /*!< read back every written sector and check it against its tag */
+} sdEmmc_integrity_config_t;
+
+/**
+ * Integrity state, attached to a card
+ */
+typedef struct sdEmmc_integrity_s {
+    sdEmmc_integrity_config_t config;
+    uint32_t errors;            /*!< number of sectors which failed the check so far */
+} sdEmmc_integrity_t;
+
+/**
+ * Size of the tag array, and of the metadata area in sectors
+ *
+ * @param sector_count  number of covered sectors
+ * @return number of tags; the metadata area takes this / SDEMMC_INTEGRITY_TAGS_PER_SECTOR sectors
+ */
+size_t sdEmmc_integrity_tag_count(size_t sector_count);
+
+/**
+ * Start tracking sector CRCs on the card
+ *
+ * @param card  card initialized using sdEmmc_card_init
+ * @param integ  state; must stay valid until sdEmmc_integrity_detach
+ * @param config  configuration; without persist the caller initializes the tags (0 = unknown)
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the ranges don't fit the card, overlap, or the tags can't be written to the card
+ *      - One of the error codes of sdEmmc_read_sectors_dma, when loading persisted tags
+ */
+esp_err_t sdEmmc_integrity_attach(sdmmc_card_t* card, sdEmmc_integrity_t* integ,
+        const sdEmmc_integrity_config_t* config);
+
+/**
+ * Stop tracking sector CRCs on the card
+ */
+void sdEmmc_integrity_detach(sdmmc_card_t* card);
+
+/**
+ * Whether writes to a range wait for programming, to write tags through or
+ * read the data back
+ *
+ * sdEmmc_write_sectors_dma_no_wait doesn't accept such writes.
+ */
+bool sdEmmc_integrity_waits(const sdmmc_card_t* card, size_t start_sector, size_t sector_count);
+
+/**
+ * Called by the command layer before sectors are written
+ *
+ * With persist set, marks the tags of the range unknown and writes them to
+ * the metadata area, unless they already were.
+ */
+esp_err_t sdEmmc_integrity_before_write(sdmmc_card_t* card, size_t start_sector, size_t sector_count);
+
+/**
+ * Called by the command layer after sectors have been written
+ *
+ * Updates the tags, writes them through to the metadata area and performs
+ * the verify-after-write readback, as configured.
+ */
+esp_err_t sdEmmc_integrity_on_write(sdmmc_card_t* card, const void* src,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Called by the command layer after sectors have been read
+ *
+ * @return
+ *      - ESP_OK if all tagged sectors match
+ *      - ESP_ERR_INVALID_CRC if a sector doesn't match its tag
+ */
+esp_err_t sdEmmc_integrity_on_read(sdmmc_card_t* card, const void* dst,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Called by the command layer after sectors have been erased; their tags become unknown
+ */
+esp_err_t sdEmmc_integrity_on_erase(sdmmc_card_t* card, size_t start_sector, size_t sector_count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,255 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_io.h"
+
+/* Pending requests are kept in two lists sorted by start sector:
+ * reads and foreground writes in one, background writes in the other.
+ */
+#define IO_CLASS_FG     0
+#define IO_CLASS_BG     1
+
+struct sdEmmc_io_s {
+    sdmmc_card_t* card;
+    sdEmmc_io_config_t config;
+    QueueHandle_t queue;
+    TaskHandle_t task;
+    TaskHandle_t stopper;
+    sdEmmc_io_req_t* pending[2];    // sorted by start_sector
+    sdEmmc_io_req_t* deferred;      // request waiting for the conflicting pending ones to complete
+    size_t head;                    // sector following the last dispatched transfer
+    uint32_t bg_passed;             // dispatches done while background writes were pending
+};
+
+static bool io_is_write(const sdEmmc_io_req_t* req)
+{
+    return req->op != SDEMMC_IO_READ;
+}
+
+static bool io_overlaps(const sdEmmc_io_req_t* a, const sdEmmc_io_req_t* b)
+{
+    return a->start_sector < b->start_sector + b->sector_count &&
+           b->start_sector < a->start_sector + a->sector_count;
+}
+
+/* Elevator order may only be applied to requests which don't depend on each
+ * other. A request overlapping a pending one, where either of them is a write,
+ * acts as a barrier: everything pending is completed before it is queued.
+ */
+static bool io_conflicts(sdEmmc_io_handle_t io, const sdEmmc_io_req_t* req)
+{
+    for (int c = IO_CLASS_FG; c <= IO_CLASS_BG; ++c) {
+        for (const sdEmmc_io_req_t* p = io->pending[c]; p != NULL; p = p->next) {
+            if ((io_is_write(p) || io_is_write(req)) && io_overlaps(p, req)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void io_insert(sdEmmc_io_handle_t io, sdEmmc_io_req_t* req)
+{
+    sdEmmc_io_req_t** link = &io->pending[(req->op == SDEMMC_IO_WRITE_BG) ? IO_CLASS_BG : IO_CLASS_FG];
+    while (*link != NULL && (*link)->start_sector <= req->start_sector) {
+        link = &(*link)->next;
+    }
+    req->next = *link;
+    *link = req;
+}
+
+static void io_complete(sdEmmc_io_req_t* chain, esp_err_t err)
+{
+    while (chain != NULL) {
+        /* once done runs, the request belongs to the caller again */
+        sdEmmc_io_req_t* next = chain->next;
+        TaskHandle_t waiter = chain->waiter;
+        chain->err = err;
+        if (chain->done) {
+            (*chain->done)(chain, err);
+        }
+        if (waiter) {
+            xTaskNotifyGive(waiter);
+        }
+        chain = next;
+    }
+}
+
+static void io_dispatch(sdEmmc_io_handle_t io)
+{
+    int cls = IO_CLASS_FG;
+    if (io->pending[IO_CLASS_BG] != NULL) {
+        if (io->pending[IO_CLASS_FG] == NULL || io->bg_passed >= io->config.bg_starve_limit) {
+            cls = IO_CLASS_BG;
+            io->bg_passed = 0;
+        } else {
+            io->bg_passed++;
+        }
+    }
+
+    /* C-LOOK: first request at or after the head, or wrap to the lowest sector */
+    sdEmmc_io_req_t** link = &io->pending[cls];
+    while (*link != NULL && (*link)->start_sector < io->head) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        link = &io->pending[cls];
+    }
+
+    sdEmmc_io_req_t* first = *link;
+    *link = first->next;
+    first->next = NULL;
+
+    /* merge followers which continue the transfer both on the card and in memory */
+    sdmmc_segment_t seg;
+    sdEmmc_merge_t merge;
+    sdEmmc_merge_init(&merge, io->card, &seg, 1, io->config.max_merge_sectors);
+    sdEmmc_merge_add(&merge, io_is_write(first), first->start_sector, first->sector_count, first->buf);
+    sdEmmc_io_req_t* last = first;
+    while (*link != NULL) {
+        sdEmmc_io_req_t* n = *link;
+        if (!sdEmmc_merge_add(&merge, io_is_write(n), n->start_sector, n->sector_count, n->buf)) {
+            break;
+        }
+        *link = n->next;
+        n->next = NULL;
+        last->next = n;
+        last = n;
+    }
+
+    esp_err_t err = sdEmmc_merge_transfer(io->card, &merge);
+    if (err != ESP_OK) {
+        log_d( "%s: %s %d+%d returned 0x%x", __func__, merge.is_write ? "write" : "read",
+                merge.start_sector, merge.sector_count, err);
+    }
+    io->head = merge.start_sector + merge.sector_count;
+    io_complete(first, err);
+}
+
+static void sdEmmc_io_task(void* arg)
+{
+    sdEmmc_io_handle_t io = (sdEmmc_io_handle_t) arg;
+    bool stopping = false;
+    for (;;) {
+        /* pick up new requests, unless a barrier is waiting for the pending ones */
+        bool idle = io->pending[IO_CLASS_FG] == NULL && io->pending[IO_CLASS_BG] == NULL;
+        if (io->deferred != NULL && idle) {
+            io_insert(io, io->deferred);
+            io->deferred = NULL;
+            idle = false;
+        }
+        TickType_t wait = (idle && !stopping) ? portMAX_DELAY : 0;
+        sdEmmc_io_req_t* req;
+        while (io->deferred == NULL && xQueueReceive(io->queue, &req, wait) == pdTRUE) {
+            wait = 0;
+            if (req == NULL) {
+                stopping = true;
+            } else if (io_conflicts(io, req)) {
+                io->deferred = req;
+            } else {
+                io_insert(io, req);
+            }
+        }
+        if (io->pending[IO_CLASS_FG] == NULL && io->pending[IO_CLASS_BG] == NULL) {
+            if (stopping && io->deferred == NULL) {
+                break;
+            }
+            continue;
+        }
+        io_dispatch(io);
+    }
+    xTaskNotifyGive(io->stopper);
+    vTaskDelete(NULL);
+}
+
+esp_err_t sdEmmc_io_start(sdmmc_card_t* card, const sdEmmc_io_config_t* config,
+        sdEmmc_io_handle_t* out_handle)
+{
+    const sdEmmc_io_config_t default_config = SDEMMC_IO_CONFIG_DEFAULT();
+    sdEmmc_io_handle_t io = (sdEmmc_io_handle_t) calloc(1, sizeof(*io));
+    if (io == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    io->card = card;
+    io->config = config ? *config : default_config;
+    if (io->config.max_merge_sectors == 0) {
+        io->config.max_merge_sectors = 1;
+    }
+    io->queue = xQueueCreate(io->config.queue_len, sizeof(sdEmmc_io_req_t*));
+    if (io->queue == NULL) {
+        free(io);
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreatePinnedToCore(&sdEmmc_io_task, "sdEmmc_io", io->config.stack_size, io,
+            io->config.priority, &io->task, io->config.core_id) != pdPASS) {
+        vQueueDelete(io->queue);
+        free(io);
+        return ESP_ERR_NO_MEM;
+    }
+    *out_handle = io;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_io_stop(sdEmmc_io_handle_t io)
+{
+    sdEmmc_io_req_t* stop = NULL;
+    io->stopper = xTaskGetCurrentTaskHandle();
+    xQueueSend(io->queue, &stop, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    vQueueDelete(io->queue);
+    free(io);
+    return ESP_OK;
+}
+
+static esp_err_t io_submit(sdEmmc_io_handle_t io, sdEmmc_io_req_t* req, TickType_t ticks)
+{
+    if (req->sector_count == 0 || req->buf == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    req->next = NULL;
+    req->err = ESP_OK;
+    if (xQueueSend(io->queue, &req, ticks) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_io_submit(sdEmmc_io_handle_t io, sdEmmc_io_req_t* req, uint32_t timeout_ms)
+{
+    req->waiter = NULL;
+    return io_submit(io, req, timeout_ms / portTICK_PERIOD_MS);
+}
+
+static esp_err_t io_do_blocking(sdEmmc_io_handle_t io, sdEmmc_io_op_t op, void* buf,
+        size_t start_sector, size_t sector_count)
+{
+    sdEmmc_io_req_t req = {
+        .op = op,
+        .buf = buf,
+        .start_sector = start_sector,
+        .sector_count = sector_count,
+        .waiter = xTaskGetCurrentTaskHandle(),
+    };
+    esp_err_t err = io_submit(io, &req, portMAX_DELAY);
+    if (err != ESP_OK) {
+        return err;
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return req.err;
+}
+
+esp_err_t sdEmmc_io_read(sdEmmc_io_handle_t io, void* dst,
+        size_t start_sector, size_t sector_count)
+{
+    return io_do_blocking(io, SDEMMC_IO_READ, dst, start_sector, sector_count);
+}
+
+esp_err_t sdEmmc_io_write(sdEmmc_io_handle_t io, const void* src,
+        size_t start_sector, size_t sector_count, bool background)
+{
+    return io_do_blocking(io, background ? SDEMMC_IO_WRITE_BG : SDEMMC_IO_WRITE,
+            (void*) src, start_sector, sector_count);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * I/O service
+ *
+ * A dedicated task which owns the card and executes sector requests
+ * submitted by any number of tasks. Pending requests are served in
+ * elevator (C-LOOK) order by sector, reads and foreground writes are
+ * served before background writes, and requests which are adjacent both
+ * on the card and in memory are merged into one multi-block transfer.
+ * Requests overlapping a pending write (or a pending write overlapping
+ * them) are never reordered with it.
+ *
+ * Once the service is started, the card must only be accessed through it.
+ */
+
+/**
+ * Request type
+ */
+typedef enum {
+    SDEMMC_IO_READ = 0,     /*!< read sectors into buf */
+    SDEMMC_IO_WRITE,        /*!< write sectors from buf */
+    SDEMMC_IO_WRITE_BG,     /*!< write sectors from buf, served after pending reads and writes */
+} sdEmmc_io_op_t;
+
+typedef struct sdEmmc_io_req_s sdEmmc_io_req_t;
+
+/**
+ * Completion callback, called from the I/O service task
+ */
+typedef void (*sdEmmc_io_done_cb_t)(sdEmmc_io_req_t* req, esp_err_t err);
+
+/**
+ * Sector request. Must stay valid until it is completed.
+ */
+struct sdEmmc_io_req_s {
+    sdEmmc_io_op_t op;          /*!< request type */
+    void* buf;                  /*!< DMA capable buffer of sector_count sectors */
+    size_t start_sector;        /*!< first sector */
+    size_t sector_count;        /*!< number of sectors */
+    sdEmmc_io_done_cb_t done;   /*!< completion callback, may be NULL */
+    void* ctx;                  /*!< user context, not used by the service */
+    /* private, owned by the service while the request is in flight */
+    sdEmmc_io_req_t* next;
+    TaskHandle_t waiter;
+    esp_err_t err;
+};
+
+/**
+ * I/O service configuration
+ */
+typedef struct {
+    size_t queue_len;           /*!< max number of submitted requests not yet picked up by the service */
+    uint32_t stack_size;        /*!< service task stack size, in bytes */
+    UBaseType_t priority;       /*!< service task priority */
+    BaseType_t core_id;         /*!< core to pin the service task to, or tskNO_AFFINITY */
+    size_t max_merge_sectors;   /*!< upper bound of one merged transfer, in sectors */
+    uint32_t bg_starve_limit;   /*!< dispatches a background write may be passed over before it is served anyway */
+} sdEmmc_io_config_t;
+
+#define SDEMMC_IO_CONFIG_DEFAULT() {\
+    .queue_len = 16, \
+    .stack_size = 4096, \
+    .priority = 5, \
+    .core_id = tskNO_AFFINITY, \
+    .max_merge_sectors = 128, \
+    .bg_starve_limit = 32, \
+}
+
+typedef struct sdEmmc_io_s* sdEmmc_io_handle_t;
+
+/**
+ * Start the I/O service for an initialized card
+ *
+ * @param card  card initialized using sdEmmc_card_init; owned by the service until sdEmmc_io_stop
+ * @param config  service configuration, or NULL for SDEMMC_IO_CONFIG_DEFAULT
+ * @param out_handle  receives the service handle
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NO_MEM if the service task or queue can not be created
+ */
+esp_err_t sdEmmc_io_start(sdmmc_card_t* card, const sdEmmc_io_config_t* config,
+        sdEmmc_io_handle_t* out_handle);
+
+/**
+ * Complete all pending requests and stop the I/O service
+ *
+ * @note Must not be called from the completion callback.
+ */
+esp_err_t sdEmmc_io_stop(sdEmmc_io_handle_t handle);
+
+/**
+ * Submit a request without waiting for it to complete
+ *
+ * req->done is called from the service task once the request completes.
+ *
+ * @return
+ *      - ESP_OK if the request was queued
+ *      - ESP_ERR_INVALID_ARG if the request is empty
+ *      - ESP_ERR_TIMEOUT if the submission queue stayed full for timeout_ms
+ */
+esp_err_t sdEmmc_io_submit(sdEmmc_io_handle_t handle, sdEmmc_io_req_t* req, uint32_t timeout_ms);
+
+/**
+ * Read sectors through the I/O service, blocking the calling task until done
+ *
+ * @note Uses the task notification of the calling task.
+ */
+esp_err_t sdEmmc_io_read(sdEmmc_io_handle_t handle, void* dst,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Write sectors through the I/O service, blocking the calling task until done
+ *
+ * @param background  if true, the write yields to pending reads and foreground writes
+ * @note Uses the task notification of the calling task.
+ */
+esp_err_t sdEmmc_io_write(sdEmmc_io_handle_t handle, const void* src,
+        size_t start_sector, size_t sector_count, bool background);
+
+#ifdef __cplusplus
+}
+#endif
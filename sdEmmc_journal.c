@@ -0,0 +1,146 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_crc.h"
+#include "sdEmmc_journal.h"
+
+#define JOURNAL_MAGIC   0x314a4453      // "SDJ1"
+
+/* First bytes of the header sector; the rest is zero */
+typedef struct {
+    uint32_t magic;
+    uint32_t start_sector;      /* target of the update */
+    uint32_t sector_count;
+    uint32_t data_crc;          /* CRC-32C of the update, as stored after the header */
+    uint32_t crc;               /* CRC-32C of the fields above */
+} journal_header_t;
+
+/* Write the header, or a cleared one if h is NULL */
+static esp_err_t journal_write_header(sdmmc_card_t* card, const sdEmmc_journal_config_t* c,
+        const journal_header_t* h)
+{
+    uint8_t* buf = sdEmmc_dma_buf_get(card);
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(buf, 0, SDMMC_DMA_POOL_BUF_SIZE);
+    if (h != NULL) {
+        memcpy(buf, h, sizeof(*h));
+    }
+    esp_err_t err = sdEmmc_write_sectors_dma(card, buf, c->start_sector, 1);
+    sdEmmc_dma_buf_put(card, buf);
+    return err;
+}
+
+static bool journal_header_valid(const sdmmc_card_t* card, const sdEmmc_journal_config_t* c,
+        const journal_header_t* h)
+{
+    return h->magic == JOURNAL_MAGIC &&
+           h->crc == sdEmmc_crc32c(0, h, offsetof(journal_header_t, crc)) &&
+           h->sector_count != 0 && h->sector_count < c->sector_count &&
+           h->start_sector + h->sector_count <= card->csd.capacity;
+}
+
+/* Copy a committed update into place, a sector at a time through buf */
+static esp_err_t journal_replay(sdmmc_card_t* card, const sdEmmc_journal_config_t* c,
+        const journal_header_t* h, uint8_t* buf)
+{
+    const size_t sector_size = card->csd.sector_size;
+    uint32_t crc = 0;
+    esp_err_t err;
+    for (size_t i = 0; i < h->sector_count; ++i) {
+        err = sdEmmc_read_sectors_dma(card, buf, c->start_sector + 1 + i, 1);
+        if (err != ESP_OK) {
+            return err;
+        }
+        crc = sdEmmc_crc32c(crc, buf, sector_size);
+    }
+    if (crc != h->data_crc) {
+        log_w( "%s: update of %d sectors at %d doesn't match its CRC, dropped", __func__,
+                h->sector_count, h->start_sector);
+        return journal_write_header(card, c, NULL);
+    }
+    for (size_t i = 0; i < h->sector_count; ++i) {
+        err = sdEmmc_read_sectors_dma(card, buf, c->start_sector + 1 + i, 1);
+        if (err == ESP_OK) {
+            err = sdEmmc_write_sectors_dma(card, buf, h->start_sector + i, 1);
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    log_d( "%s: replayed %d sectors at %d", __func__, h->sector_count, h->start_sector);
+    return journal_write_header(card, c, NULL);
+}
+
+esp_err_t sdEmmc_journal_attach(sdmmc_card_t* card, sdEmmc_journal_t* journal,
+        const sdEmmc_journal_config_t* config)
+{
+    if (config->sector_count < 2 || card->csd.sector_size > SDMMC_DMA_POOL_BUF_SIZE ||
+        config->start_sector + config->sector_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t* buf = sdEmmc_dma_buf_get(card);
+    if (buf == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    journal_header_t h;
+    bool replayed = false;
+    esp_err_t err = sdEmmc_read_sectors_dma(card, buf, config->start_sector, 1);
+    if (err == ESP_OK) {
+        memcpy(&h, buf, sizeof(h));
+        if (journal_header_valid(card, config, &h)) {
+            err = journal_replay(card, config, &h, buf);
+            replayed = true;
+        }
+    }
+    sdEmmc_dma_buf_put(card, buf);
+    if (err != ESP_OK) {
+        log_e( "%s: recovering the journal returned 0x%x", __func__, err);
+        return err;
+    }
+    memset(journal, 0, sizeof(*journal));
+    journal->config = *config;
+    journal->replays = replayed ? 1 : 0;
+    card->journal = journal;
+    return ESP_OK;
+}
+
+void sdEmmc_journal_detach(sdmmc_card_t* card)
+{
+    card->journal = NULL;
+}
+
+esp_err_t sdEmmc_journal_write(sdmmc_card_t* card, const void* src,
+        size_t start_sector, size_t sector_count)
+{
+    sdEmmc_journal_t* journal = card->journal;
+    const sdEmmc_journal_config_t* c = &journal->config;
+    if (sector_count >= c->sector_count) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    journal_header_t h = {
+        .magic = JOURNAL_MAGIC,
+        .start_sector = start_sector,
+        .sector_count = sector_count,
+        .data_crc = sdEmmc_crc32c(0, src, sector_count * card->csd.sector_size),
+    };
+    h.crc = sdEmmc_crc32c(0, &h, offsetof(journal_header_t, crc));
+    /* each step is programmed before the next one starts */
+    esp_err_t err = sdEmmc_write_sectors(card, src, c->start_sector + 1, sector_count);
+    if (err == ESP_OK) {
+        err = journal_write_header(card, c, &h);
+    }
+    if (err == ESP_OK) {
+        err = sdEmmc_write_sectors(card, src, start_sector, sector_count);
+    }
+    if (err == ESP_OK) {
+        err = journal_write_header(card, c, NULL);
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: update of %d sectors at %d returned 0x%x", __func__, sector_count, start_sector, err);
+        return err;
+    }
+    journal->commits++;
+    return ESP_OK;
+}
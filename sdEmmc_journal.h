@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Write-ahead journal
+ *
+ * Makes multi-sector updates atomic on cards without reliable write (SD
+ * cards), and for ranges larger than an eMMC writes atomically. Used by
+ * sdEmmc_write_sectors_reliable, for the user area only.
+ *
+ * An update first goes to the journal area, after its header sector, then a
+ * header naming the target range and the CRC-32C of the data commits it.
+ * The data is then written in place, and the header cleared. A header
+ * which was torn by a power loss fails its CRC and is ignored; a complete
+ * one is replayed into place by the next sdEmmc_journal_attach.
+ *
+ * Each update costs its data twice plus two header sectors.
+ */
+
+/**
+ * Journal configuration
+ */
+typedef struct {
+    size_t start_sector;        /*!< first sector of the journal area; not used for anything else */
+    size_t sector_count;        /*!< size of the journal area: a header sector plus the largest update */
+} sdEmmc_journal_config_t;
+
+/**
+ * Journal state, attached to a card
+ */
+typedef struct sdEmmc_journal_s {
+    sdEmmc_journal_config_t config;
+    uint32_t commits;           /*!< updates written through the journal */
+    uint32_t replays;           /*!< updates replayed at attach */
+} sdEmmc_journal_t;
+
+/**
+ * Start using a journal area, replaying the update it holds, if any
+ *
+ * @param card  card initialized using sdEmmc_card_init
+ * @param journal  state; must stay valid until sdEmmc_journal_detach
+ * @param config  configuration
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the journal area doesn't fit the card
+ *      - ESP_ERR_NO_MEM if no DMA pool buffer is free
+ *      - One of the error codes of sdEmmc_read_sectors_dma and sdEmmc_write_sectors
+ */
+esp_err_t sdEmmc_journal_attach(sdmmc_card_t* card, sdEmmc_journal_t* journal,
+        const sdEmmc_journal_config_t* config);
+
+/**
+ * Stop using the journal; sdEmmc_write_sectors_reliable can't fall back to it anymore
+ */
+void sdEmmc_journal_detach(sdmmc_card_t* card);
+
+/**
+ * Called by the command layer to write sectors atomically through the journal
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the update is larger than the journal area
+ *      - ESP_ERR_NO_MEM if no DMA pool buffer is free
+ *      - One of the error codes of sdEmmc_write_sectors
+ */
+esp_err_t sdEmmc_journal_write(sdmmc_card_t* card, const void* src,
+        size_t start_sector, size_t sector_count);
+
+#ifdef __cplusplus
+}
+#endif
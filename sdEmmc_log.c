@@ -0,0 +1,369 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "esp_timer.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_crc.h"
+#include "sdEmmc_log.h"
+#include "sys/param.h"
+#include "soc/soc_memory_layout.h"
+
+#define LOG_SEG_MAGIC       0x53474f4c      // "LOGS"
+#define LOG_CKPT_MAGIC      0x434b4f4c      // "LOKC"
+#define LOG_CKPT_SECTORS    2
+
+/* first bytes of every segment */
+typedef struct {
+    uint32_t magic;
+    uint32_t log_id;
+    uint32_t seq;
+    uint32_t payload_len;       // bytes of records following the header
+    uint32_t records;
+    uint32_t data_crc;          // CRC-32C of the payload
+    uint32_t reserved;
+    uint32_t hdr_crc;           // CRC-32C of the fields above
+} log_seg_hdr_t;
+
+_Static_assert(sizeof(log_seg_hdr_t) == SDEMMC_LOG_HDR_SIZE, "segment header size");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t log_id;
+    uint32_t gen;               // checkpoints alternate between two sectors; the higher gen wins
+    uint32_t next_seq;          // all segments before this one are complete on the card
+    uint32_t segment_sectors;
+    uint32_t segment_count;
+    uint32_t crc;
+} log_checkpoint_t;
+
+static size_t log_payload_size(const sdEmmc_log_t* log)
+{
+    return log->segment_sectors * log->card->csd.sector_size - SDEMMC_LOG_HDR_SIZE;
+}
+
+static size_t log_segment_sector(const sdEmmc_log_t* log, uint32_t seq)
+{
+    return log->data_sector + (seq % log->segment_count) * log->segment_sectors;
+}
+
+static esp_err_t log_setup(sdEmmc_log_t* log, sdmmc_card_t* card,
+        const sdEmmc_log_config_t* config, void* buf)
+{
+    if (buf == NULL || !esp_ptr_dma_capable(buf) || (intptr_t) buf % 4 != 0 ||
+        config->segment_sectors == 0 || config->sector_count <= LOG_CKPT_SECTORS ||
+        config->first_sector + config->sector_count > card->csd.capacity) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint32_t segment_count = (config->sector_count - LOG_CKPT_SECTORS) / config->segment_sectors;
+    if (segment_count < 2 || config->checkpoint_interval == 0 ||
+        config->checkpoint_interval >= segment_count ||
+        config->segment_sectors * card->csd.sector_size <= SDEMMC_LOG_HDR_SIZE + SDEMMC_LOG_REC_HDR_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(log, 0, sizeof(*log));
+    log->card = card;
+    log->buf = (uint8_t*) buf;
+    log->data_sector = config->first_sector + LOG_CKPT_SECTORS;
+    log->segment_sectors = config->segment_sectors;
+    log->segment_count = segment_count;
+    log->checkpoint_interval = config->checkpoint_interval;
+    return ESP_OK;
+}
+
+/* Read both checkpoint sectors; returns the valid one with the highest generation */
+static esp_err_t log_read_checkpoint(sdEmmc_log_t* log, log_checkpoint_t* out_ckpt, bool* out_found)
+{
+    *out_found = false;
+    for (int i = 0; i < LOG_CKPT_SECTORS; ++i) {
+        esp_err_t err = sdEmmc_read_sectors_dma(log->card, log->buf, log->data_sector - LOG_CKPT_SECTORS + i, 1);
+        if (err != ESP_OK) {
+            return err;
+        }
+        log_checkpoint_t ckpt;
+        memcpy(&ckpt, log->buf, sizeof(ckpt));
+        if (ckpt.magic != LOG_CKPT_MAGIC ||
+            ckpt.crc != sdEmmc_crc32c(0, &ckpt, offsetof(log_checkpoint_t, crc))) {
+            continue;
+        }
+        if (!*out_found || (int32_t) (ckpt.gen - out_ckpt->gen) > 0) {
+            *out_ckpt = ckpt;
+            *out_found = true;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t log_write_checkpoint(sdEmmc_log_t* log)
+{
+    sdmmc_card_t* card = log->card;
+    esp_err_t err;
+    if (log->busy) {
+        err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+        if (err != ESP_OK) {
+            return err;
+        }
+        log->busy = false;
+    }
+    uint8_t* sector = (uint8_t*) sdEmmc_dma_buf_get(card);
+    if (sector == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    log_checkpoint_t ckpt = {
+        .magic = LOG_CKPT_MAGIC,
+        .log_id = log->log_id,
+        .gen = log->checkpoint_gen + 1,
+        .next_seq = log->next_seq,
+        .segment_sectors = log->segment_sectors,
+        .segment_count = log->segment_count,
+    };
+    ckpt.crc = sdEmmc_crc32c(0, &ckpt, offsetof(log_checkpoint_t, crc));
+    memset(sector, 0, card->csd.sector_size);
+    memcpy(sector, &ckpt, sizeof(ckpt));
+    err = sdEmmc_write_sectors_dma(card, sector,
+            log->data_sector - LOG_CKPT_SECTORS + ckpt.gen % LOG_CKPT_SECTORS, 1);
+    sdEmmc_dma_buf_put(card, sector);
+    if (err != ESP_OK) {
+        log_e( "%s: writing checkpoint returned 0x%x", __func__, err);
+        return err;
+    }
+    log->checkpoint_gen = ckpt.gen;
+    log->since_checkpoint = 0;
+    return ESP_OK;
+}
+
+static esp_err_t log_write_segment(sdEmmc_log_t* log)
+{
+    sdmmc_card_t* card = log->card;
+    log_seg_hdr_t hdr = {
+        .magic = LOG_SEG_MAGIC,
+        .log_id = log->log_id,
+        .seq = log->next_seq,
+        .payload_len = log->fill,
+        .records = log->records,
+        .data_crc = sdEmmc_crc32c(0, log->buf + SDEMMC_LOG_HDR_SIZE, log->fill),
+    };
+    hdr.hdr_crc = sdEmmc_crc32c(0, &hdr, offsetof(log_seg_hdr_t, hdr_crc));
+    memcpy(log->buf, &hdr, sizeof(hdr));
+
+    /* the previous segment was left programming while this one was filled */
+    esp_err_t err;
+    if (log->busy) {
+        err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+        if (err != ESP_OK) {
+            return err;
+        }
+        log->busy = false;
+    }
+    const size_t sector = log_segment_sector(log, log->next_seq);
+    err = sdEmmc_write_sectors_dma_no_wait(card, log->buf, sector, log->segment_sectors);
+    log->busy = (err == ESP_OK);
+    if (err == ESP_ERR_NOT_SUPPORTED) {
+        /* integrity tags written through: wait for this segment now */
+        err = sdEmmc_write_sectors_dma(card, log->buf, sector, log->segment_sectors);
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: writing segment %u returned 0x%x", __func__, log->next_seq, err);
+        return err;
+    }
+    log->next_seq++;
+    log->fill = 0;
+    log->records = 0;
+    if (++log->since_checkpoint >= log->checkpoint_interval) {
+        return log_write_checkpoint(log);
+    }
+    return ESP_OK;
+}
+
+/* Check the header of segment seq; only its first sector is read */
+static esp_err_t log_probe(sdEmmc_log_t* log, uint32_t seq, bool* out_valid)
+{
+    esp_err_t err = sdEmmc_read_sectors_dma(log->card, log->buf, log_segment_sector(log, seq), 1);
+    if (err != ESP_OK) {
+        return err;
+    }
+    log_seg_hdr_t hdr;
+    memcpy(&hdr, log->buf, sizeof(hdr));
+    *out_valid = hdr.magic == LOG_SEG_MAGIC && hdr.log_id == log->log_id && hdr.seq == seq &&
+            hdr.payload_len <= log_payload_size(log) &&
+            hdr.hdr_crc == sdEmmc_crc32c(0, &hdr, offsetof(log_seg_hdr_t, hdr_crc));
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_log_format(sdEmmc_log_t* log, sdmmc_card_t* card,
+        const sdEmmc_log_config_t* config, void* buf)
+{
+    esp_err_t err = log_setup(log, card, config, buf);
+    if (err != ESP_OK) {
+        return err;
+    }
+    /* a new id makes segments of the previous log invalid without erasing them */
+    log_checkpoint_t old;
+    bool found;
+    err = log_read_checkpoint(log, &old, &found);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (found) {
+        log->log_id = old.log_id + 1;
+        log->checkpoint_gen = old.gen;
+    } else {
+        log->log_id = (uint32_t) esp_timer_get_time();
+    }
+    return log_write_checkpoint(log);
+}
+
+esp_err_t sdEmmc_log_mount(sdEmmc_log_t* log, sdmmc_card_t* card,
+        const sdEmmc_log_config_t* config, void* buf)
+{
+    esp_err_t err = log_setup(log, card, config, buf);
+    if (err != ESP_OK) {
+        return err;
+    }
+    log_checkpoint_t ckpt;
+    bool found;
+    err = log_read_checkpoint(log, &ckpt, &found);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (!found || ckpt.segment_sectors != log->segment_sectors ||
+        ckpt.segment_count != log->segment_count) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    log->log_id = ckpt.log_id;
+    log->checkpoint_gen = ckpt.gen;
+
+    /* Segments ckpt.next_seq, ckpt.next_seq + 1, ... are intact up to the head;
+     * the slot after the head holds an older sequence number or garbage. Find
+     * the number of intact segments n by bisection: valid(n - 1) && !valid(n).
+     */
+    uint32_t lo = 0;
+    uint32_t hi = log->segment_count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        bool valid;
+        err = log_probe(log, ckpt.next_seq + mid - 1, &valid);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (valid) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    log->next_seq = ckpt.next_seq + lo;
+    log->since_checkpoint = lo;
+
+    /* the newest segment may have been torn by a reset while it was written */
+    if (lo > 0) {
+        err = sdEmmc_log_read_segment(log, log->next_seq - 1, log->buf);
+        if (err == ESP_ERR_INVALID_CRC) {
+            log_w( "%s: discarding torn segment %u", __func__, log->next_seq - 1);
+            log->next_seq--;
+            log->since_checkpoint--;
+        } else if (err != ESP_OK) {
+            return err;
+        }
+    }
+    log_d( "%s: id=%x next_seq=%u (checkpoint %u)", __func__, log->log_id, log->next_seq, ckpt.next_seq);
+    return ESP_OK;
+}
+
+size_t sdEmmc_log_max_record(const sdEmmc_log_t* log)
+{
+    return log_payload_size(log) - SDEMMC_LOG_REC_HDR_SIZE;
+}
+
+esp_err_t sdEmmc_log_append(sdEmmc_log_t* log, const void* data, size_t len)
+{
+    if (len == 0 || len > sdEmmc_log_max_record(log)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t padded = (len + 3) & ~3;
+    if (log->fill + SDEMMC_LOG_REC_HDR_SIZE + padded > log_payload_size(log)) {
+        esp_err_t err = log_write_segment(log);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    uint8_t* p = log->buf + SDEMMC_LOG_HDR_SIZE + log->fill;
+    uint32_t rec_len = len;
+    memcpy(p, &rec_len, SDEMMC_LOG_REC_HDR_SIZE);
+    memcpy(p + SDEMMC_LOG_REC_HDR_SIZE, data, len);
+    memset(p + SDEMMC_LOG_REC_HDR_SIZE + len, 0, padded - len);
+    log->fill += SDEMMC_LOG_REC_HDR_SIZE + padded;
+    log->records++;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_log_sync(sdEmmc_log_t* log)
+{
+    if (log->fill > 0) {
+        esp_err_t err = log_write_segment(log);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    if (log->since_checkpoint > 0) {
+        return log_write_checkpoint(log);
+    }
+    return ESP_OK;
+}
+
+void sdEmmc_log_range(const sdEmmc_log_t* log, uint32_t* out_first, uint32_t* out_next)
+{
+    /* the slot of next_seq is treated as free: it may be torn mid-write */
+    *out_first = (log->next_seq >= log->segment_count) ? log->next_seq - log->segment_count + 1 : 0;
+    *out_next = log->next_seq;
+}
+
+esp_err_t sdEmmc_log_read_segment(sdEmmc_log_t* log, uint32_t seq, void* buf)
+{
+    sdmmc_card_t* card = log->card;
+    uint32_t first, next;
+    sdEmmc_log_range(log, &first, &next);
+    if ((int32_t) (seq - first) < 0 || (int32_t) (seq - next) >= 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t err;
+    if (log->busy) {
+        err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+        if (err != ESP_OK) {
+            return err;
+        }
+        log->busy = false;
+    }
+    err = sdEmmc_read_sectors_dma(card, buf, log_segment_sector(log, seq), log->segment_sectors);
+    if (err != ESP_OK) {
+        return err;
+    }
+    log_seg_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != LOG_SEG_MAGIC || hdr.log_id != log->log_id || hdr.seq != seq ||
+        hdr.hdr_crc != sdEmmc_crc32c(0, &hdr, offsetof(log_seg_hdr_t, hdr_crc))) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (hdr.payload_len > log_payload_size(log) ||
+        hdr.data_crc != sdEmmc_crc32c(0, (uint8_t*) buf + SDEMMC_LOG_HDR_SIZE, hdr.payload_len)) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+bool sdEmmc_log_next_record(const void* buf, size_t* offset, const void** out_data, size_t* out_len)
+{
+    log_seg_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (*offset + SDEMMC_LOG_REC_HDR_SIZE > hdr.payload_len) {
+        return false;
+    }
+    const uint8_t* p = (const uint8_t*) buf + SDEMMC_LOG_HDR_SIZE + *offset;
+    uint32_t len;
+    memcpy(&len, p, SDEMMC_LOG_REC_HDR_SIZE);
+    if (len == 0 || len > hdr.payload_len - *offset - SDEMMC_LOG_REC_HDR_SIZE) {
+        return false;
+    }
+    *out_data = p + SDEMMC_LOG_REC_HDR_SIZE;
+    *out_len = len;
+    *offset += SDEMMC_LOG_REC_HDR_SIZE + ((len + 3) & ~3);
+    return true;
+}
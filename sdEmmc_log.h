@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Append-only record log on raw sectors
+ *
+ * A region of the card is used as a circular log without a file system.
+ * Records are packed into segments of segment_sectors sectors, and each full
+ * segment goes to the card as one multi-block write. A segment starts with a
+ * header carrying the log id, a sequence number and checksums of the header
+ * and the payload; sequence number N is stored in segment N % segment_count,
+ * overwriting the oldest data once the region is full.
+ *
+ * The first two sectors of the region hold checkpoints, written alternately
+ * every checkpoint_interval segments. On mount the newest valid checkpoint
+ * gives a sequence number known to be on the card, and the segments written
+ * after it are found by binary search over the sequence numbers, so only
+ * about log2(segment_count) headers are read. A segment torn by a reset is
+ * detected by its payload checksum and discarded.
+ *
+ * For best throughput, place the region on an allocation unit boundary and
+ * choose a segment size which divides the AU.
+ */
+
+#define SDEMMC_LOG_HDR_SIZE     32      /*!< bytes taken by the segment header */
+#define SDEMMC_LOG_REC_HDR_SIZE 4       /*!< bytes of framing before each record */
+
+/**
+ * Log geometry
+ */
+typedef struct {
+    size_t first_sector;            /*!< first sector of the region */
+    size_t sector_count;            /*!< size of the region, in sectors, including 2 checkpoint sectors */
+    size_t segment_sectors;         /*!< sectors per segment, i.e. per multi-block write */
+    uint32_t checkpoint_interval;   /*!< segments between checkpoints, less than the number of segments */
+} sdEmmc_log_config_t;
+
+/**
+ * Log state. Members are private to sdEmmc_log.c.
+ */
+typedef struct {
+    sdmmc_card_t* card;
+    uint8_t* buf;                   /*!< segment being filled */
+    size_t data_sector;             /*!< first sector of segment 0 */
+    size_t segment_sectors;
+    uint32_t segment_count;
+    uint32_t checkpoint_interval;
+    uint32_t log_id;                /*!< distinguishes this log from earlier ones in the same region */
+    uint32_t next_seq;              /*!< sequence number of the segment being filled */
+    uint32_t checkpoint_gen;        /*!< generation of the newest checkpoint */
+    uint32_t since_checkpoint;      /*!< segments written since the last checkpoint */
+    size_t fill;                    /*!< payload bytes in buf */
+    uint32_t records;               /*!< records in buf */
+    bool busy;                      /*!< last segment write may still be programming */
+} sdEmmc_log_t;
+
+/**
+ * Start a new, empty log in the region
+ *
+ * Segments of earlier logs in the region are ignored from then on.
+ *
+ * @param log  log to initialize; ready for appending on return
+ * @param card  card initialized using sdEmmc_card_init
+ * @param config  region geometry
+ * @param buf  DMA capable, word aligned buffer of config->segment_sectors sectors
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the geometry or the buffer is not usable
+ *      - One of the error codes of sdEmmc_write_sectors_dma
+ */
+esp_err_t sdEmmc_log_format(sdEmmc_log_t* log, sdmmc_card_t* card,
+        const sdEmmc_log_config_t* config, void* buf);
+
+/**
+ * Open the log in the region and find its head
+ *
+ * @param log  log to initialize; appends continue after the last intact segment
+ * @param card  card initialized using sdEmmc_card_init
+ * @param config  region geometry; must be the one the log was formatted with
+ * @param buf  DMA capable, word aligned buffer of config->segment_sectors sectors
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the geometry or the buffer is not usable
+ *      - ESP_ERR_NOT_FOUND if the region holds no log with this geometry
+ *      - One of the error codes of sdEmmc_read_sectors_dma
+ */
+esp_err_t sdEmmc_log_mount(sdEmmc_log_t* log, sdmmc_card_t* card,
+        const sdEmmc_log_config_t* config, void* buf);
+
+/**
+ * Append a record
+ *
+ * The record is buffered; the segment is written once the next record
+ * doesn't fit. Fixed size records are appended the same way.
+ *
+ * @param data  record contents
+ * @param len  record length, at most sdEmmc_log_max_record(log) bytes
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_SIZE if the record is empty or too large
+ *      - One of the error codes of sdEmmc_write_sectors_dma
+ */
+esp_err_t sdEmmc_log_append(sdEmmc_log_t* log, const void* data, size_t len);
+
+/**
+ * Write buffered records and a checkpoint, and wait for the card
+ *
+ * A partly filled segment is written as is; later records go to the next segment.
+ */
+esp_err_t sdEmmc_log_sync(sdEmmc_log_t* log);
+
+/**
+ * Largest record which fits into a segment, in bytes
+ */
+size_t sdEmmc_log_max_record(const sdEmmc_log_t* log);
+
+/**
+ * Range of sequence numbers of the segments on the card
+ *
+ * @param out_first  receives the oldest segment still available
+ * @param out_next  receives the sequence number the next segment will get
+ */
+void sdEmmc_log_range(const sdEmmc_log_t* log, uint32_t* out_first, uint32_t* out_next);
+
+/**
+ * Read and check one segment
+ *
+ * @param seq  sequence number, within the range given by sdEmmc_log_range
+ * @param buf  DMA capable, word aligned buffer of segment_sectors sectors; not the log's own buffer
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_FOUND if the segment has been overwritten or was never written
+ *      - ESP_ERR_INVALID_CRC if the segment is damaged
+ *      - One of the error codes of sdEmmc_read_sectors_dma
+ */
+esp_err_t sdEmmc_log_read_segment(sdEmmc_log_t* log, uint32_t seq, void* buf);
+
+/**
+ * Iterate over the records of a segment read by sdEmmc_log_read_segment
+ *
+ * @param buf  segment buffer
+ * @param offset  iteration state; set to 0 before the first call
+ * @param out_data  receives a pointer to the record, inside buf
+ * @param out_len  receives the record length
+ * @return true if a record was returned, false at the end of the segment
+ */
+bool sdEmmc_log_next_record(const void* buf, size_t* offset, const void** out_data, size_t* out_len);
+
+#ifdef __cplusplus
+}
+#endif
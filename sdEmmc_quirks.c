@@ -0,0 +1,59 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_quirks.h"
+
+#define CID_MANFID_TOSHIBA      0x11
+#define CID_MANFID_MICRON       0x13
+#define CID_MANFID_KINGSTON     0x70
+
+/* Known models, as collected by the Linux MMC core */
+static const sdEmmc_quirk_t s_builtin_quirks[] = {
+    /* multi-block transfers bounded by CMD23 are slower than CMD12 ones */
+    { true, CID_MANFID_TOSHIBA, SDEMMC_QUIRK_ANY_OEM, "MMC08G", SDEMMC_QUIRK_ANY_REV,
+            { .flags = SDEMMC_QUIRK_NO_CMD23 } },
+    { true, CID_MANFID_TOSHIBA, SDEMMC_QUIRK_ANY_OEM, "MMC16G", SDEMMC_QUIRK_ANY_REV,
+            { .flags = SDEMMC_QUIRK_NO_CMD23 } },
+    { true, CID_MANFID_TOSHIBA, SDEMMC_QUIRK_ANY_OEM, "MMC32G", SDEMMC_QUIRK_ANY_REV,
+            { .flags = SDEMMC_QUIRK_NO_CMD23 } },
+    /* need a longer read timeout than the CSD indicates */
+    { true, CID_MANFID_MICRON, 0x200, NULL, SDEMMC_QUIRK_ANY_REV,
+            { .min_read_ms = 600 } },
+    /* TRIM is advertised, but trimmed sectors don't reliably read back erased */
+    { true, CID_MANFID_KINGSTON, SDEMMC_QUIRK_ANY_OEM, "V10008", SDEMMC_QUIRK_ANY_REV,
+            { .flags = SDEMMC_QUIRK_NO_TRIM } },
+};
+
+static const sdEmmc_quirk_t* s_user_quirks;
+static size_t s_user_quirk_count;
+
+void sdEmmc_quirks_set_table(const sdEmmc_quirk_t* table, size_t count)
+{
+    s_user_quirks = table;
+    s_user_quirk_count = table ? count : 0;
+}
+
+static bool quirk_matches(const sdEmmc_quirk_t* q, const sdmmc_card_t* card, bool is_mmc)
+{
+    const sdmmc_cid_t* cid = &card->cid;
+    return q->mmc == is_mmc && q->mfg_id == cid->mfg_id &&
+           (q->oem_id == SDEMMC_QUIRK_ANY_OEM || q->oem_id == cid->oem_id) &&
+           (q->name == NULL || strncmp(q->name, cid->name, strlen(q->name)) == 0) &&
+           (q->revision == SDEMMC_QUIRK_ANY_REV || q->revision == cid->revision);
+}
+
+const sdEmmc_quirk_t* sdEmmc_quirks_lookup(const sdmmc_card_t* card)
+{
+    const bool is_mmc = sdEmmc_card_is_mmc(card);
+    for (size_t i = 0; i < s_user_quirk_count; ++i) {
+        if (quirk_matches(&s_user_quirks[i], card, is_mmc)) {
+            return &s_user_quirks[i];
+        }
+    }
+    for (size_t i = 0; i < sizeof(s_builtin_quirks) / sizeof(s_builtin_quirks[0]); ++i) {
+        if (quirk_matches(&s_builtin_quirks[i], card, is_mmc)) {
+            return &s_builtin_quirks[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Per-model quirks
+ *
+ * At init, the card's CID is looked up in a table of known models, first in
+ * the table set with sdEmmc_quirks_set_table, then in the built-in one. The
+ * settings of the first matching entry end up in card->quirks:
+ *
+ * - max_freq_khz caps the clock selected at init
+ * - min_read_ms raises the read timeout taken from the CSD
+ * - busy_poll_us spaces out the status polls of sdEmmc_wait_ready
+ * - write_chunk_sectors seeds card->tuning.write_min_sectors
+ * - SDEMMC_QUIRK_NO_TRIM makes erases use whole erase groups
+ * - the other flags are for code sending those commands
+ */
+
+#define SDEMMC_QUIRK_ANY_OEM    0xffff  // oem_id matching any OEM
+#define SDEMMC_QUIRK_ANY_REV    (-1)    // revision matching any revision
+
+/**
+ * Quirks table entry
+ */
+typedef struct {
+    bool mmc;                   /*!< entry applies to MMC cards (SD otherwise); the CID formats differ */
+    int mfg_id;                 /*!< manufacturer ID */
+    uint16_t oem_id;            /*!< OEM ID, or SDEMMC_QUIRK_ANY_OEM */
+    const char* name;           /*!< product name prefix, or NULL for any product */
+    int revision;               /*!< product revision, or SDEMMC_QUIRK_ANY_REV */
+    sdmmc_quirks_t quirks;      /*!< settings for matching cards */
+} sdEmmc_quirk_t;
+
+/**
+ * Set a table which takes precedence over the built-in one
+ *
+ * Affects cards initialized afterwards.
+ *
+ * @param table  entries; must stay valid while cards are initialized, NULL to remove
+ * @param count  number of entries
+ */
+void sdEmmc_quirks_set_table(const sdEmmc_quirk_t* table, size_t count);
+
+/**
+ * Find the entry matching the card
+ *
+ * @param card  card with decoded CID and CSD
+ * @return matching entry, or NULL
+ */
+const sdEmmc_quirk_t* sdEmmc_quirks_lookup(const sdmmc_card_t* card);
+
+#ifdef __cplusplus
+}
+#endif
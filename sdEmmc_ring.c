@@ -0,0 +1,260 @@
+#include <stdatomic.h>
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_ring.h"
+
+/* Bounded ring with per-slot sequence numbers (D. Vyukov's MPMC queue,
+ * restricted to a single consumer). A slot is free for the producer at
+ * position pos when seq == pos, and holds an entry for the consumer when
+ * seq == pos + 1. With a single producer the tail CAS becomes a plain store.
+ */
+typedef struct {
+    _Atomic uint32_t seq;
+    union {
+        sdEmmc_ring_sqe_t sqe;
+        sdEmmc_ring_cqe_t cqe;
+    } e;
+} ring_slot_t;
+
+typedef struct {
+    ring_slot_t* slots;
+    uint32_t mask;
+    bool mp;
+    _Atomic uint32_t tail;      // next position to produce
+    _Atomic uint32_t head;      // next position to consume
+} ring_t;
+
+struct sdEmmc_ring_s {
+    sdmmc_card_t* card;
+    ring_t sq;
+    ring_t cq;
+    TaskHandle_t task;
+    TaskHandle_t stopper;
+    atomic_bool sleeping;
+    atomic_bool stopping;
+};
+
+static esp_err_t ring_init(ring_t* r, size_t len, bool mp)
+{
+    if (len == 0 || (len & (len - 1)) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    r->slots = (ring_slot_t*) calloc(len, sizeof(ring_slot_t));
+    if (r->slots == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        atomic_init(&r->slots[i].seq, i);
+    }
+    r->mask = len - 1;
+    r->mp = mp;
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->head, 0);
+    return ESP_OK;
+}
+
+static ring_slot_t* ring_produce_begin(ring_t* r, uint32_t* out_pos)
+{
+    uint32_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for (;;) {
+        ring_slot_t* slot = &r->slots[pos & r->mask];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t diff = (int32_t) (seq - pos);
+        if (diff == 0) {
+            if (!r->mp) {
+                atomic_store_explicit(&r->tail, pos + 1, memory_order_relaxed);
+                *out_pos = pos;
+                return slot;
+            }
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *out_pos = pos;
+                return slot;
+            }
+            // failed CAS reloaded pos
+        } else if (diff < 0) {
+            return NULL;    // full
+        } else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static void ring_produce_end(ring_slot_t* slot, uint32_t pos)
+{
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static ring_slot_t* ring_consume_begin(ring_t* r, uint32_t* out_pos)
+{
+    uint32_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    ring_slot_t* slot = &r->slots[pos & r->mask];
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if ((int32_t) (seq - (pos + 1)) < 0) {
+        return NULL;        // empty
+    }
+    *out_pos = pos;
+    return slot;
+}
+
+static void ring_consume_end(ring_t* r, ring_slot_t* slot, uint32_t pos)
+{
+    atomic_store_explicit(&r->head, pos + 1, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, pos + r->mask + 1, memory_order_release);
+}
+
+static void ring_post_completion(sdEmmc_ring_handle_t h, void* ctx, esp_err_t err)
+{
+    uint32_t pos;
+    ring_slot_t* slot;
+    while ((slot = ring_produce_begin(&h->cq, &pos)) == NULL) {
+        if (atomic_load(&h->stopping)) {
+            log_w( "%s: completion ring full, dropping completion", __func__);
+            return;
+        }
+        vTaskDelay(1);
+    }
+    slot->e.cqe.ctx = ctx;
+    slot->e.cqe.err = err;
+    ring_produce_end(slot, pos);
+}
+
+static void sdEmmc_ring_task(void* arg)
+{
+    sdEmmc_ring_handle_t h = (sdEmmc_ring_handle_t) arg;
+    for (;;) {
+        uint32_t pos;
+        ring_slot_t* slot = ring_consume_begin(&h->sq, &pos);
+        if (slot == NULL) {
+            if (atomic_load(&h->stopping)) {
+                break;
+            }
+            /* announce going to sleep, then look again: a producer either sees
+             * the flag and notifies, or its entry is seen here. The fence keeps
+             * the acquire load of the slot from moving before the flag store,
+             * and pairs with the one in ring_push_sqe */
+            atomic_store(&h->sleeping, true);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (ring_consume_begin(&h->sq, &pos) != NULL || atomic_load(&h->stopping)) {
+                atomic_store(&h->sleeping, false);
+                continue;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        sdEmmc_ring_sqe_t sqe = slot->e.sqe;
+        ring_consume_end(&h->sq, slot, pos);
+
+        esp_err_t err;
+        if (sqe.op == SDEMMC_IO_READ) {
+            err = sdEmmc_read_sectors_dma(h->card, sqe.buf, sqe.start_sector, sqe.sector_count);
+        } else {
+            err = sdEmmc_write_sectors_dma(h->card, sqe.buf, sqe.start_sector, sqe.sector_count);
+        }
+        ring_post_completion(h, sqe.ctx, err);
+    }
+    xTaskNotifyGive(h->stopper);
+    vTaskDelete(NULL);
+}
+
+esp_err_t sdEmmc_ring_start(sdmmc_card_t* card, const sdEmmc_ring_config_t* config,
+        sdEmmc_ring_handle_t* out_handle)
+{
+    const sdEmmc_ring_config_t default_config = SDEMMC_RING_CONFIG_DEFAULT();
+    if (config == NULL) {
+        config = &default_config;
+    }
+    sdEmmc_ring_handle_t h = (sdEmmc_ring_handle_t) calloc(1, sizeof(*h));
+    if (h == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    h->card = card;
+    atomic_init(&h->sleeping, false);
+    atomic_init(&h->stopping, false);
+    esp_err_t err = ring_init(&h->sq, config->sq_len, config->multi_producer);
+    if (err == ESP_OK) {
+        err = ring_init(&h->cq, config->cq_len, false);
+    }
+    if (err == ESP_OK &&
+        xTaskCreatePinnedToCore(&sdEmmc_ring_task, "sdEmmc_ring", config->stack_size, h,
+            config->priority, &h->task, config->core_id) != pdPASS) {
+        err = ESP_ERR_NO_MEM;
+    }
+    if (err != ESP_OK) {
+        free(h->sq.slots);
+        free(h->cq.slots);
+        free(h);
+        return err;
+    }
+    *out_handle = h;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_ring_stop(sdEmmc_ring_handle_t h)
+{
+    h->stopper = xTaskGetCurrentTaskHandle();
+    atomic_store(&h->stopping, true);
+    if (atomic_exchange(&h->sleeping, false)) {
+        xTaskNotifyGive(h->task);
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    free(h->sq.slots);
+    free(h->cq.slots);
+    free(h);
+    return ESP_OK;
+}
+
+static bool ring_push_sqe(sdEmmc_ring_handle_t h, const sdEmmc_ring_sqe_t* sqe)
+{
+    uint32_t pos;
+    ring_slot_t* slot = ring_produce_begin(&h->sq, &pos);
+    if (slot == NULL) {
+        return false;
+    }
+    slot->e.sqe = *sqe;
+    ring_produce_end(slot, pos);
+    /* order the release store of the entry before the load of sleeping */
+    atomic_thread_fence(memory_order_seq_cst);
+    return true;
+}
+
+esp_err_t sdEmmc_ring_submit(sdEmmc_ring_handle_t h, const sdEmmc_ring_sqe_t* sqe)
+{
+    if (!ring_push_sqe(h, sqe)) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (atomic_exchange(&h->sleeping, false)) {
+        xTaskNotifyGive(h->task);
+    }
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_ring_submit_from_isr(sdEmmc_ring_handle_t h, const sdEmmc_ring_sqe_t* sqe)
+{
+    if (!ring_push_sqe(h, sqe)) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (atomic_exchange(&h->sleeping, false)) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(h->task, &woken);
+        if (woken) {
+            portYIELD_FROM_ISR();
+        }
+    }
+    return ESP_OK;
+}
+
+bool sdEmmc_ring_reap(sdEmmc_ring_handle_t h, sdEmmc_ring_cqe_t* out_cqe)
+{
+    uint32_t pos;
+    ring_slot_t* slot = ring_consume_begin(&h->cq, &pos);
+    if (slot == NULL) {
+        return false;
+    }
+    *out_cqe = slot->e.cqe;
+    ring_consume_end(&h->cq, slot, pos);
+    return true;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "sdEmmc_types.h"
+#include "sdEmmc_io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Lock-free submission / completion rings
+ *
+ * An I/O worker task, typically pinned to the other core, owns the card and
+ * executes sector requests taken from a submission ring. Results are posted
+ * to a completion ring which the submitter polls. Neither side takes a lock:
+ * the rings are bounded arrays of slots with per-slot sequence numbers, so
+ * submitting or reaping a request is a handful of atomic operations. The
+ * worker is only notified through the kernel when it has gone idle.
+ *
+ * The completion ring has a single consumer. The submission ring has a
+ * single producer, unless multi_producer is set in the configuration.
+ */
+
+/**
+ * Submission ring entry
+ */
+typedef struct {
+    sdEmmc_io_op_t op;          /*!< SDEMMC_IO_READ or SDEMMC_IO_WRITE */
+    void* buf;                  /*!< DMA capable, word aligned buffer of sector_count sectors */
+    size_t start_sector;        /*!< first sector */
+    size_t sector_count;        /*!< number of sectors */
+    void* ctx;                  /*!< user context, returned in the completion entry */
+} sdEmmc_ring_sqe_t;
+
+/**
+ * Completion ring entry
+ */
+typedef struct {
+    void* ctx;                  /*!< context of the submission entry */
+    esp_err_t err;              /*!< result of the transfer */
+} sdEmmc_ring_cqe_t;
+
+/**
+ * Ring worker configuration
+ */
+typedef struct {
+    size_t sq_len;              /*!< submission ring slots, power of 2 */
+    size_t cq_len;              /*!< completion ring slots, power of 2 */
+    bool multi_producer;        /*!< allow concurrent submitters */
+    uint32_t stack_size;        /*!< worker task stack size, in bytes */
+    UBaseType_t priority;       /*!< worker task priority */
+    BaseType_t core_id;         /*!< core to pin the worker task to, or tskNO_AFFINITY */
+} sdEmmc_ring_config_t;
+
+#define SDEMMC_RING_CONFIG_DEFAULT() {\
+    .sq_len = 32, \
+    .cq_len = 32, \
+    .multi_producer = false, \
+    .stack_size = 4096, \
+    .priority = 5, \
+    .core_id = 0, \
+}
+
+typedef struct sdEmmc_ring_s* sdEmmc_ring_handle_t;
+
+/**
+ * Allocate the rings and start the worker task
+ *
+ * @param card  card initialized using sdEmmc_card_init; owned by the worker until sdEmmc_ring_stop
+ * @param config  ring configuration, or NULL for SDEMMC_RING_CONFIG_DEFAULT
+ * @param out_handle  receives the ring handle
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if a ring length is not a power of 2
+ *      - ESP_ERR_NO_MEM if the rings or the worker task can not be allocated
+ */
+esp_err_t sdEmmc_ring_start(sdmmc_card_t* card, const sdEmmc_ring_config_t* config,
+        sdEmmc_ring_handle_t* out_handle);
+
+/**
+ * Complete all submitted requests and stop the worker task
+ *
+ * Completions not reaped before the call are discarded.
+ */
+esp_err_t sdEmmc_ring_stop(sdEmmc_ring_handle_t handle);
+
+/**
+ * Post a request to the submission ring. Never blocks.
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NO_MEM if the submission ring is full
+ */
+esp_err_t sdEmmc_ring_submit(sdEmmc_ring_handle_t handle, const sdEmmc_ring_sqe_t* sqe);
+
+/**
+ * Same as sdEmmc_ring_submit, for use from an interrupt handler
+ */
+esp_err_t sdEmmc_ring_submit_from_isr(sdEmmc_ring_handle_t handle, const sdEmmc_ring_sqe_t* sqe);
+
+/**
+ * Take one entry from the completion ring. Never blocks.
+ *
+ * @return true if an entry was written to out_cqe, false if the ring is empty
+ */
+bool sdEmmc_ring_reap(sdEmmc_ring_handle_t handle, sdEmmc_ring_cqe_t* out_cqe);
+
+#ifdef __cplusplus
+}
+#endif
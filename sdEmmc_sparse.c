@@ -0,0 +1,171 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_sparse.h"
+#include "sys/param.h"
+#include "soc/soc_memory_layout.h"
+
+#define SPARSE_WORDS_PER_SECTOR (SDEMMC_SPARSE_BITS_PER_SECTOR / 32)
+
+size_t sdEmmc_sparse_map_words(size_t sector_count, size_t granule_sectors)
+{
+    size_t granules = (sector_count + granule_sectors - 1) / granule_sectors;
+    size_t map_sectors = (granules + SDEMMC_SPARSE_BITS_PER_SECTOR - 1) / SDEMMC_SPARSE_BITS_PER_SECTOR;
+    return map_sectors * SPARSE_WORDS_PER_SECTOR;
+}
+
+static inline bool sparse_test(const uint32_t* bits, size_t g)
+{
+    return (bits[g / 32] >> (g % 32)) & 1;
+}
+
+/* Set (or clear) the bits of granules [g0, g1); widens [*lo, *hi) to the changed ones */
+static void sparse_mark(uint32_t* bits, size_t g0, size_t g1, bool written, size_t* lo, size_t* hi)
+{
+    for (size_t g = g0; g < g1; ++g) {
+        if (sparse_test(bits, g) == written) {
+            continue;
+        }
+        bits[g / 32] ^= 1u << (g % 32);
+        *lo = MIN(*lo, g);
+        *hi = MAX(*hi, g + 1);
+    }
+}
+
+static void sparse_mark_meta(const sdEmmc_sparse_t* sparse, size_t* lo, size_t* hi)
+{
+    const sdEmmc_sparse_config_t* c = &sparse->config;
+    if (!c->persist) {
+        return;
+    }
+    size_t meta_count = (sparse->granules + SDEMMC_SPARSE_BITS_PER_SECTOR - 1) / SDEMMC_SPARSE_BITS_PER_SECTOR;
+    sparse_mark(c->bits, c->meta_sector / c->granule_sectors,
+            (c->meta_sector + meta_count - 1) / c->granule_sectors + 1, true, lo, hi);
+}
+
+/* Write the map sectors holding the bits of granules [lo, hi) to the metadata area */
+static esp_err_t sparse_persist(sdmmc_card_t* card, size_t lo, size_t hi)
+{
+    sdEmmc_sparse_t* sparse = card->sparse;
+    const sdEmmc_sparse_config_t* c = &sparse->config;
+    if (!c->persist || lo >= hi) {
+        return ESP_OK;
+    }
+    size_t m0 = lo / SDEMMC_SPARSE_BITS_PER_SECTOR;
+    size_t m1 = (hi - 1) / SDEMMC_SPARSE_BITS_PER_SECTOR;
+    esp_err_t err = sdEmmc_wait_ready(card, sdEmmc_data_timeout_ms(card, true, 0));
+    if (err == ESP_OK) {
+        err = sdEmmc_write_sectors_dma(card, c->bits + m0 * SPARSE_WORDS_PER_SECTOR,
+                c->meta_sector + m0, m1 - m0 + 1);
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: writing map sectors %d..%d returned 0x%x", __func__, m0, m1, err);
+        return err;
+    }
+    sparse->map_writes += m1 - m0 + 1;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_sparse_attach(sdmmc_card_t* card, sdEmmc_sparse_t* sparse,
+        const sdEmmc_sparse_config_t* config)
+{
+    if (config->bits == NULL || config->granule_sectors == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const size_t words = sdEmmc_sparse_map_words(card->csd.capacity, config->granule_sectors);
+    const size_t meta_count = words / SPARSE_WORDS_PER_SECTOR;
+    if (config->persist) {
+        if (!esp_ptr_dma_capable(config->bits) || (intptr_t) config->bits % 4 != 0 ||
+            config->meta_sector + meta_count > card->csd.capacity) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        esp_err_t err = sdEmmc_read_sectors_dma(card, config->bits, config->meta_sector, meta_count);
+        if (err != ESP_OK) {
+            log_e( "%s: loading map returned 0x%x", __func__, err);
+            return err;
+        }
+    }
+    memset(sparse, 0, sizeof(*sparse));
+    sparse->config = *config;
+    sparse->granules = (card->csd.capacity + config->granule_sectors - 1) / config->granule_sectors;
+    card->sparse = sparse;
+    size_t lo = SIZE_MAX, hi = 0;
+    sparse_mark_meta(sparse, &lo, &hi);
+    log_d( "%s: %d granules of %d sectors, %s", __func__, sparse->granules, config->granule_sectors,
+            config->persist ? "persistent" : "RAM map");
+    return sparse_persist(card, lo, hi);
+}
+
+void sdEmmc_sparse_detach(sdmmc_card_t* card)
+{
+    card->sparse = NULL;
+}
+
+esp_err_t sdEmmc_sparse_reset(sdmmc_card_t* card)
+{
+    sdEmmc_sparse_t* sparse = card->sparse;
+    if (sparse == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!sdEmmc_erased_reads_zero(card)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    memset(sparse->config.bits, 0, (sparse->granules + 31) / 32 * sizeof(uint32_t));
+    /* any map sector may have changed, so all of them are written rather than
+     * the range sparse_mark_meta reports for the metadata area alone */
+    size_t meta_lo = SIZE_MAX, meta_hi = 0;
+    sparse_mark_meta(sparse, &meta_lo, &meta_hi);
+    return sparse_persist(card, 0, sparse->granules);
+}
+
+size_t sdEmmc_sparse_run(sdmmc_card_t* card, size_t start_sector, size_t sector_count,
+        bool* out_written)
+{
+    const sdEmmc_sparse_t* sparse = card->sparse;
+    const size_t gs = sparse->config.granule_sectors;
+    const size_t end = start_sector + sector_count;
+    size_t g = start_sector / gs;
+    const bool written = sparse_test(sparse->config.bits, g);
+    while (++g * gs < end && sparse_test(sparse->config.bits, g) == written) {
+    }
+    *out_written = written;
+    return MIN(g * gs, end) - start_sector;
+}
+
+esp_err_t sdEmmc_sparse_on_write(sdmmc_card_t* card, size_t start_sector, size_t sector_count)
+{
+    sdEmmc_sparse_t* sparse = card->sparse;
+    const size_t gs = sparse->config.granule_sectors;
+    size_t lo = SIZE_MAX, hi = 0;
+    sparse_mark(sparse->config.bits, start_sector / gs,
+            (start_sector + sector_count - 1) / gs + 1, true, &lo, &hi);
+    return sparse_persist(card, lo, hi);
+}
+
+esp_err_t sdEmmc_sparse_on_erase(sdmmc_card_t* card, size_t start_sector, size_t sector_count)
+{
+    /* granules read back as 0xff stay marked, so that they are read from the card */
+    if (!sdEmmc_erased_reads_zero(card)) {
+        return ESP_OK;
+    }
+    sdEmmc_sparse_t* sparse = card->sparse;
+    const size_t gs = sparse->config.granule_sectors;
+    const size_t end = start_sector + sector_count;
+    /* the last granule may extend past the end of the card */
+    size_t g0 = (start_sector + gs - 1) / gs;
+    size_t g1 = (end == card->csd.capacity) ? sparse->granules : end / gs;
+    if (g1 <= g0) {
+        return ESP_OK;
+    }
+    size_t lo = SIZE_MAX, hi = 0;
+    sparse_mark(sparse->config.bits, g0, g1, false, &lo, &hi);
+    sparse_mark_meta(sparse, &lo, &hi);
+    /* the metadata area itself was erased: rewrite all of it */
+    const sdEmmc_sparse_config_t* c = &sparse->config;
+    size_t meta_count = (sparse->granules + SDEMMC_SPARSE_BITS_PER_SECTOR - 1) / SDEMMC_SPARSE_BITS_PER_SECTOR;
+    if (c->persist && start_sector < c->meta_sector + meta_count && c->meta_sector < end) {
+        lo = 0;
+        hi = sparse->granules;
+    }
+    return sparse_persist(card, lo, hi);
+}
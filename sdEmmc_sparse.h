@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Written-sector map
+ *
+ * While attached to a card, one bit per granule of granule_sectors sectors
+ * records whether anything was written to the granule since the map was
+ * last reset. sdEmmc_read_sectors_dma returns zeros for granules which were
+ * never written, without a transfer, so reading a mostly empty card only
+ * reads its written parts. Erasing whole granules clears their bits again,
+ * on cards whose erased sectors read back as zeros (sdEmmc_erased_reads_zero).
+ * On cards reading them as 0xff, erased granules stay marked and are read
+ * from the card.
+ *
+ * With persist set, the map is loaded from a metadata area on the card at
+ * attach. A write to a granule whose bit is clear first sets the bit and
+ * writes the map sector holding it to the metadata area, before the data
+ * itself: after a power loss the map may claim too much, never too little.
+ * Granules already marked cost nothing extra.
+ *
+ * The map covers the user area. Vectored transfers and streams fall back to
+ * per-call transfers while it is attached, so that every write is seen.
+ */
+
+#define SDEMMC_SPARSE_BITS_PER_SECTOR   (512 * 8)
+
+/**
+ * Written-sector map configuration
+ */
+typedef struct {
+    uint32_t* bits;             /*!< sdEmmc_sparse_map_words words; DMA capable and word aligned if persist is set */
+    size_t granule_sectors;     /*!< sectors tracked by each bit */
+    bool persist;               /*!< keep the map in the metadata area starting at meta_sector */
+    size_t meta_sector;         /*!< first sector of the metadata area; zero filled before first use */
+} sdEmmc_sparse_config_t;
+
+/**
+ * Written-sector map state, attached to a card
+ */
+typedef struct sdEmmc_sparse_s {
+    sdEmmc_sparse_config_t config;
+    size_t granules;            /*!< number of granules covering the card */
+    uint32_t elided_sectors;    /*!< sectors returned as zeros without a transfer */
+    uint32_t map_writes;        /*!< map sectors written to the metadata area */
+} sdEmmc_sparse_t;
+
+/**
+ * Size of the map, and of the metadata area in sectors
+ *
+ * @param sector_count  number of sectors of the card (card->csd.capacity)
+ * @param granule_sectors  sectors tracked by each bit
+ * @return number of uint32_t words; the metadata area takes
+ *         words * 32 / SDEMMC_SPARSE_BITS_PER_SECTOR sectors
+ */
+size_t sdEmmc_sparse_map_words(size_t sector_count, size_t granule_sectors);
+
+/**
+ * Start tracking written granules on the card
+ *
+ * The granules holding the metadata area are always treated as written.
+ *
+ * @param card  card initialized using sdEmmc_card_init
+ * @param sparse  state; must stay valid until sdEmmc_sparse_detach
+ * @param config  configuration; without persist the caller initializes the bits
+ *                (0 = never written, e.g. right after sdEmmc_erase_sectors of the card)
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the configuration doesn't fit the card
+ *      - One of the error codes of sdEmmc_read_sectors_dma, when loading a persisted map
+ */
+esp_err_t sdEmmc_sparse_attach(sdmmc_card_t* card, sdEmmc_sparse_t* sparse,
+        const sdEmmc_sparse_config_t* config);
+
+/**
+ * Stop tracking written granules on the card
+ */
+void sdEmmc_sparse_detach(sdmmc_card_t* card);
+
+/**
+ * Mark the whole card as never written, e.g. after erasing it completely
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if no map is attached to the card
+ *      - ESP_ERR_NOT_SUPPORTED if erased sectors don't read back as zeros;
+ *        the map is left as it is
+ *      - One of the error codes of sdEmmc_write_sectors_dma when writing the map
+ */
+esp_err_t sdEmmc_sparse_reset(sdmmc_card_t* card);
+
+/**
+ * Length of the run of granules in the same state, starting at a sector
+ *
+ * @param card  card with a map attached
+ * @param start_sector  first sector
+ * @param sector_count  sectors to look at
+ * @param out_written  receives whether the run was written
+ * @return number of sectors in the run, at least 1 and at most sector_count
+ */
+size_t sdEmmc_sparse_run(sdmmc_card_t* card, size_t start_sector, size_t sector_count,
+        bool* out_written);
+
+/**
+ * Called by the command layer before sectors are written
+ *
+ * Marks the granules as written and, as configured, writes the changed map
+ * sectors to the metadata area.
+ */
+esp_err_t sdEmmc_sparse_on_write(sdmmc_card_t* card, size_t start_sector, size_t sector_count);
+
+/**
+ * Called by the command layer after sectors have been erased; granules erased
+ * completely are never written again, if erased sectors read back as zeros
+ */
+esp_err_t sdEmmc_sparse_on_erase(sdmmc_card_t* card, size_t start_sector, size_t sector_count);
+
+#ifdef __cplusplus
+}
+#endif
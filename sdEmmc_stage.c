@@ -0,0 +1,105 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_stage.h"
+#include "sys/param.h"
+#include "soc/soc_memory_layout.h"
+
+esp_err_t sdEmmc_stage_init(sdEmmc_stage_t* stage, sdmmc_card_t* card,
+        void* buf, size_t buf_sectors)
+{
+    if (buf == NULL || buf_sectors == 0 ||
+        !esp_ptr_dma_capable(buf) || (intptr_t) buf % 4 != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t au_sectors = (size_t) card->ssr.alloc_unit_kb * 1024 / card->csd.sector_size;
+    size_t unit = 1;
+    while (unit * 2 <= buf_sectors) {
+        unit *= 2;
+    }
+    if (au_sectors != 0) {
+        while (au_sectors % unit != 0) {
+            unit /= 2;
+        }
+    } else {
+        // AU not reported (e.g. MMC): only align to the staging unit
+        au_sectors = unit;
+    }
+    memset(stage, 0, sizeof(*stage));
+    stage->card = card;
+    stage->buf = (uint8_t*) buf;
+    stage->unit_sectors = unit;
+    stage->au_sectors = au_sectors;
+    log_d( "%s: unit=%d au=%d sectors", __func__, unit, au_sectors);
+    return ESP_OK;
+}
+
+/* sectors left until the end of the staging unit holding base */
+static size_t stage_room(const sdEmmc_stage_t* stage)
+{
+    size_t unit_end = (stage->base / stage->unit_sectors + 1) * stage->unit_sectors;
+    return unit_end - (stage->base + stage->fill);
+}
+
+esp_err_t sdEmmc_stage_flush(sdEmmc_stage_t* stage)
+{
+    if (stage->fill == 0) {
+        return ESP_OK;
+    }
+    esp_err_t err = sdEmmc_write_sectors_dma(stage->card, stage->buf, stage->base, stage->fill);
+    if (err != ESP_OK) {
+        log_e( "%s: writing %d+%d returned 0x%x", __func__, stage->base, stage->fill, err);
+        return err;
+    }
+    stage->fill = 0;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_stage_write(sdEmmc_stage_t* stage, const void* src,
+        size_t start_sector, size_t sector_count)
+{
+    const size_t sector_size = stage->card->csd.sector_size;
+    const size_t unit = stage->unit_sectors;
+    const uint8_t* p = (const uint8_t*) src;
+    esp_err_t err;
+
+    while (sector_count > 0) {
+        if (stage->fill > 0 && start_sector != stage->base + stage->fill) {
+            err = sdEmmc_stage_flush(stage);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        if (stage->fill == 0) {
+            stage->base = start_sector;
+            /* whole units starting on a unit boundary go straight to the card,
+             * split at AU boundaries */
+            if (start_sector % unit == 0 && sector_count >= unit &&
+                esp_ptr_dma_capable(p) && (intptr_t) p % 4 == 0) {
+                size_t au_left = stage->au_sectors - start_sector % stage->au_sectors;
+                size_t n = MIN(sector_count - sector_count % unit, au_left);
+                err = sdEmmc_write_sectors_dma(stage->card, p, start_sector, n);
+                if (err != ESP_OK) {
+                    return err;
+                }
+                p += n * sector_size;
+                start_sector += n;
+                sector_count -= n;
+                continue;
+            }
+        }
+        size_t n = MIN(sector_count, stage_room(stage));
+        memcpy(stage->buf + stage->fill * sector_size, p, n * sector_size);
+        stage->fill += n;
+        p += n * sector_size;
+        start_sector += n;
+        sector_count -= n;
+        if (stage_room(stage) == 0) {
+            err = sdEmmc_stage_flush(stage);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
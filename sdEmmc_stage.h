@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Allocation unit aligned write staging
+ *
+ * SD cards reach their speed class throughput only when written sequentially
+ * in chunks which don't cross allocation unit (AU) boundaries. Writes going
+ * through a stage are collected in a caller-provided buffer and sent to the
+ * card as aligned multi-block writes of one staging unit: the largest power
+ * of 2 number of sectors which fits into the buffer and divides the AU.
+ * Larger writes starting on a unit boundary bypass the buffer and are split
+ * only at AU boundaries.
+ *
+ * Staged data is not visible to reads until sdEmmc_stage_flush is called.
+ */
+typedef struct {
+    sdmmc_card_t* card;         /*!< card the stage writes to */
+    uint8_t* buf;               /*!< staging buffer of unit_sectors sectors */
+    size_t unit_sectors;        /*!< staging unit, in sectors */
+    size_t au_sectors;          /*!< allocation unit, in sectors */
+    size_t base;                /*!< first staged sector */
+    size_t fill;                /*!< number of sectors staged after base */
+} sdEmmc_stage_t;
+
+/**
+ * Set up a write stage
+ *
+ * @param stage  stage to initialize
+ * @param card  card initialized using sdEmmc_card_init; card->ssr supplies the AU size
+ * @param buf  DMA capable, word aligned buffer of buf_sectors sectors
+ * @param buf_sectors  size of buf, in sectors
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if buf is not DMA capable or is empty
+ */
+esp_err_t sdEmmc_stage_init(sdEmmc_stage_t* stage, sdmmc_card_t* card,
+        void* buf, size_t buf_sectors);
+
+/**
+ * Write sectors through the stage
+ *
+ * Data continuing the staged range is appended; any other write flushes
+ * the stage first.
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - One of the error codes of sdEmmc_write_sectors_dma
+ */
+esp_err_t sdEmmc_stage_write(sdEmmc_stage_t* stage, const void* src,
+        size_t start_sector, size_t sector_count);
+
+/**
+ * Write staged sectors to the card
+ */
+esp_err_t sdEmmc_stage_flush(sdEmmc_stage_t* stage);
+
+#ifdef __cplusplus
+}
+#endif
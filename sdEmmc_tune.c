@@ -0,0 +1,126 @@
+#include <string.h>
+#include "esp32-hal-log.h"
+#include "esp_timer.h"
+#include "sdEmmc_cmd.h"
+#include "sdEmmc_tune.h"
+#include "sys/param.h"
+#include "soc/soc_memory_layout.h"
+
+#define TUNE_MAX_STEPS  16
+
+typedef struct {
+    sdmmc_card_t* card;
+    void* buf;
+    size_t base;                /* first sector of the scratch area, aligned */
+    size_t span;                /* usable size of the scratch area, a multiple of the largest transfer */
+} tune_ctx_t;
+
+/* Throughput in KB/s of transfers of size sectors, starting offset sectors into each chunk */
+static esp_err_t tune_measure(const tune_ctx_t* t, bool is_write, size_t size, size_t offset,
+        uint32_t* out_kbps)
+{
+    const size_t reps = MAX(2, SDEMMC_TUNE_MIN_SECTORS_PER_STEP / size);
+    const size_t stride = size + offset;
+    size_t pos = 0;
+    int64_t t0 = esp_timer_get_time();
+    for (size_t i = 0; i < reps; ++i) {
+        if (pos + stride > t->span) {
+            pos = 0;
+        }
+        size_t sector = t->base + pos + offset;
+        esp_err_t err = is_write ? sdEmmc_write_sectors_dma(t->card, t->buf, sector, size) :
+                sdEmmc_read_sectors_dma(t->card, t->buf, sector, size);
+        if (err != ESP_OK) {
+            return err;
+        }
+        pos += (stride + size - 1) / size * size;
+    }
+    int64_t us = MAX(esp_timer_get_time() - t0, 1);
+    *out_kbps = (uint32_t) ((uint64_t) reps * size * t->card->csd.sector_size * 1000000 / 1024 / us);
+    return ESP_OK;
+}
+
+/* Measure sizes 1, 2, 4, ... max_size; return the smallest within the knee of the best */
+static esp_err_t tune_curve(const tune_ctx_t* t, bool is_write, size_t max_size,
+        uint32_t* out_min_sectors, uint32_t* out_best_kbps)
+{
+    uint32_t kbps[TUNE_MAX_STEPS];
+    size_t steps = 0;
+    uint32_t best = 0;
+    for (size_t size = 1; size <= max_size && steps < TUNE_MAX_STEPS; size *= 2, ++steps) {
+        esp_err_t err = tune_measure(t, is_write, size, 0, &kbps[steps]);
+        if (err != ESP_OK) {
+            return err;
+        }
+        log_d( "%s: %s %d sectors: %u KB/s", __func__, is_write ? "write" : "read", size, kbps[steps]);
+        best = MAX(best, kbps[steps]);
+    }
+    size_t knee = 0;
+    while ((uint64_t) kbps[knee] * 100 < (uint64_t) best * SDEMMC_TUNE_KNEE_PERCENT) {
+        ++knee;
+    }
+    *out_min_sectors = 1u << knee;
+    *out_best_kbps = best;
+    return ESP_OK;
+}
+
+esp_err_t sdEmmc_tune(sdmmc_card_t* card, void* buf, size_t buf_sectors,
+        size_t scratch_sector, size_t scratch_sectors)
+{
+    if (!esp_ptr_dma_capable(buf) || (intptr_t) buf % 4 != 0 || buf_sectors == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (scratch_sector + scratch_sectors > card->csd.capacity) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t max_size = 1;
+    while (max_size * 2 <= buf_sectors) {
+        max_size *= 2;
+    }
+    /* align the measurements to the largest transfer, so that alignment effects show */
+    size_t base = (scratch_sector + max_size - 1) / max_size * max_size;
+    size_t span = (scratch_sector + scratch_sectors - base) / max_size * max_size;
+    if (base >= scratch_sector + scratch_sectors || span < 2 * max_size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    tune_ctx_t t = {
+        .card = card,
+        .buf = buf,
+        .base = base,
+        .span = span,
+    };
+    memset(buf, 0xa5, max_size * card->csd.sector_size);
+
+    sdmmc_tuning_t result = { 0 };
+    esp_err_t err = tune_curve(&t, true, max_size, &result.write_min_sectors, &result.write_kbps);
+    if (err == ESP_OK) {
+        err = tune_curve(&t, false, max_size, &result.read_min_sectors, &result.read_kbps);
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: measurement failed (0x%x)", __func__, err);
+        return err;
+    }
+
+    /* smallest power of 2 offset at which the knee size still writes efficiently */
+    const size_t size = result.write_min_sectors;
+    uint32_t aligned_kbps;
+    err = tune_measure(&t, true, size, 0, &aligned_kbps);
+    result.align_sectors = size;
+    for (size_t offset = 1; err == ESP_OK && offset < size; offset *= 2) {
+        uint32_t kbps;
+        err = tune_measure(&t, true, size, offset, &kbps);
+        if (err == ESP_OK && (uint64_t) kbps * 100 >= (uint64_t) aligned_kbps * SDEMMC_TUNE_KNEE_PERCENT) {
+            result.align_sectors = offset;
+            break;
+        }
+    }
+    if (err != ESP_OK) {
+        log_e( "%s: measurement failed (0x%x)", __func__, err);
+        return err;
+    }
+    card->tuning = result;
+    log_d( "%s: read min %d sectors (%u KB/s), write min %d sectors (%u KB/s), align %d", __func__,
+            result.read_min_sectors, result.read_kbps, result.write_min_sectors,
+            result.write_kbps, result.align_sectors);
+    return ESP_OK;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdEmmc_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Transfer size calibration
+ *
+ * Optional step after sdEmmc_card_init. Reads and writes of 1, 2, 4, ...
+ * sectors, up to the size of the buffer provided, are timed in a scratch
+ * area of the card. The smallest size reaching 90% of the best throughput
+ * is the knee of the curve. Writes of that size are then repeated at
+ * offsets of 1, 2, 4, ... sectors to find the alignment they need to stay
+ * within 90%. Results go to card->tuning, for caches, loggers and other
+ * upper layers to size their transfers.
+ */
+
+#define SDEMMC_TUNE_MIN_SECTORS_PER_STEP  256    // Sectors transferred per measured size, at least
+#define SDEMMC_TUNE_KNEE_PERCENT          90     // Fraction of the best throughput considered efficient
+
+/**
+ * Measure efficient transfer sizes of the card
+ *
+ * The contents of the scratch area are destroyed.
+ *
+ * @param card  card initialized using sdEmmc_card_init
+ * @param buf  DMA capable, word aligned buffer of buf_sectors sectors; e.g. 256 sectors to measure up to 128 KB
+ * @param buf_sectors  size of buf, in sectors; a power of 2 is best
+ * @param scratch_sector  first sector of the scratch area
+ * @param scratch_sectors  size of the scratch area, at least 2 * buf_sectors
+ * @return
+ *      - ESP_OK on success, card->tuning filled in
+ *      - ESP_ERR_INVALID_ARG if buf is not DMA capable or the scratch area is too small
+ *      - ESP_ERR_INVALID_SIZE if the scratch area is beyond card capacity
+ *      - One of the error codes of sdEmmc_read_sectors_dma / sdEmmc_write_sectors_dma
+ */
+esp_err_t sdEmmc_tune(sdmmc_card_t* card, void* buf, size_t buf_sectors,
+        size_t scratch_sector, size_t scratch_sectors);
+
+#ifdef __cplusplus
+}
+#endif
@@ -20,41 +20,152 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "esp_err.h"
 
+/* Low-memory profile (-DSDEMMC_CONFIG_LOW_MEMORY=1). The decoded register
+ * structures below use the narrowest type that holds each field, which
+ * shrinks sdmmc_card_t by about 30 bytes. The structures aren't packed, so
+ * every field stays naturally aligned. Members present in ESP-IDF's
+ * sdmmc_types.h keep its order, with the ones added here after them, so
+ * only the narrow types change the layout: code sharing these structures
+ * with ESP-IDF must not be built with the profile. sdmmc_command_t and
+ * sdmmc_host_t are shared with the host drivers and keep their layout in
+ * both profiles. The profile also halves the DMA pool and drops the 12 KB
+ * of CRC slicing tables (SDEMMC_CRC_TABLES in sdEmmc_crc.h).
+ */
+#ifndef SDEMMC_CONFIG_LOW_MEMORY
+#define SDEMMC_CONFIG_LOW_MEMORY    0
+#endif
+
+#if SDEMMC_CONFIG_LOW_MEMORY
+#define SDEMMC_INT(narrow)          narrow
+#define SDEMMC_U32(narrow)          narrow
+#else
+#define SDEMMC_INT(narrow)          int
+#define SDEMMC_U32(narrow)          uint32_t
+#endif
+
 /**
  * Decoded values from SD card Card Specific Data register
  */
 typedef struct {
-    int csd_ver;                /*!< CSD structure format */
-    int mmc_ver;                /*!< MMC version (for CID format) */
-    int capacity;               /*!< total number of sectors */
-    int sector_size;            /*!< sector size in bytes */
-    int read_block_len;         /*!< block length for reads */
-    int card_command_class;     /*!< Card Command Class for SD */
-    int tr_speed;               /*!< Max transfer speed */
+    SDEMMC_INT(uint8_t) csd_ver;            /*!< CSD structure format */
+    SDEMMC_INT(uint8_t) mmc_ver;            /*!< MMC version (for CID format) */
+    int capacity;                           /*!< total number of sectors */
+    SDEMMC_INT(uint16_t) sector_size;       /*!< sector size in bytes */
+    SDEMMC_INT(uint16_t) read_block_len;    /*!< block length for reads */
+    SDEMMC_INT(uint16_t) card_command_class; /*!< Card Command Class for SD */
+    int tr_speed;                           /*!< Max transfer speed */
+    int taac_ns;                            /*!< asynchronous part of data access time (TAAC), in ns */
+    SDEMMC_INT(uint8_t) nsac;               /*!< clock dependent part of data access time (NSAC), in units of 100 clocks */
+    SDEMMC_INT(uint8_t) r2w_factor;         /*!< log2 of typical write time relative to read access time */
 } sdmmc_csd_t;
 
 /**
  * Decoded values from SD card Card IDentification register
  */
 typedef struct {
-    int mfg_id;     /*!< manufacturer identification number */
-    int oem_id;     /*!< OEM/product identification number */
-    char name[8];   /*!< product name (MMC v1 has the longest) */
-    int revision;   /*!< product revision */
-    int serial;     /*!< product serial number */
-    int date;       /*!< manufacturing date */
+    int mfg_id;                     /*!< manufacturer identification number (24 bits on MMC v1) */
+    SDEMMC_INT(uint16_t) oem_id;    /*!< OEM/product identification number */
+    char name[8];                   /*!< product name (MMC v1 has the longest) */
+    SDEMMC_INT(uint8_t) revision;   /*!< product revision */
+    int serial;                     /*!< product serial number */
+    SDEMMC_INT(uint16_t) date;      /*!< manufacturing date */
 } sdmmc_cid_t;
 
 /**
  * Decoded values from SD Configuration Register
  */
 typedef struct {
-    int sd_spec;    /*!< SD Physical layer specification version, reported by card */
-    int bus_width;  /*!< bus widths supported by card: BIT(0) — 1-bit bus, BIT(2) — 4-bit bus */
+    SDEMMC_INT(uint8_t) sd_spec;    /*!< SD Physical layer specification version, reported by card */
+    SDEMMC_INT(uint8_t) bus_width;  /*!< bus widths supported by card: BIT(0) — 1-bit bus, BIT(2) — 4-bit bus */
+    SDEMMC_INT(uint8_t) data_stat_after_erase; /*!< value of erased bits (DATA_STAT_AFTER_ERASE); 1 if SCR couldn't be read */
 } sdmmc_scr_t;
 
+/**
+ * Values kept from MMC Extended CSD register
+ */
+typedef struct {
+    uint32_t sleep_awake_ms;    /*!< max time of a sleep or awake transition (S_A_TIMEOUT) */
+    uint32_t sleep_notify_ms;   /*!< max busy time of the sleep notification (SLEEP_NOTIFICATION_TIME), 0 if not supported */
+    uint32_t cmd6_ms;           /*!< max busy time of SWITCH, including POWER_OFF_SHORT (GENERIC_CMD6_TIME) */
+    uint32_t part_switch_ms;    /*!< max busy time of a partition switch (PARTITION_SWITCH_TIME) */
+    uint32_t part_sectors[8];   /*!< size of each hardware partition, by sdEmmc_part_t; 0 if not present */
+    uint8_t rev;                /*!< EXT_CSD revision */
+    uint8_t sec_feature;        /*!< secure/TRIM features supported (SEC_FEATURE_SUPPORT) */
+    uint8_t erase_group_def;    /*!< 1 if high capacity erase groups are in use */
+    uint8_t power_off_notify;   /*!< 1 if power off notification is enabled (POWERED_ON was set at init) */
+    uint8_t erased_mem_cont;    /*!< value of erased or trimmed bits (ERASED_MEM_CONT) */
+    uint8_t part_config;        /*!< PARTITION_CONFIG at init, with the partition access bits */
+    uint8_t rel_param;          /*!< reliable write features (WR_REL_PARAM) */
+    uint8_t rel_set;            /*!< partitions written reliably by every write (WR_REL_SET) */
+    uint8_t rel_wr_sectors;     /*!< sectors written atomically by a reliable write (REL_WR_SEC_C); 0 if not supported */
+} sdmmc_ext_csd_t;
+
+/**
+ * eMMC hardware partitions, by their PARTITION_ACCESS value
+ */
+typedef enum {
+    SDEMMC_PART_USER = 0,       /*!< user data area */
+    SDEMMC_PART_BOOT1 = 1,      /*!< boot partition 1 */
+    SDEMMC_PART_BOOT2 = 2,      /*!< boot partition 2 */
+    SDEMMC_PART_GP1 = 4,        /*!< general purpose partition 1 */
+    SDEMMC_PART_GP2 = 5,        /*!< general purpose partition 2 */
+    SDEMMC_PART_GP3 = 6,        /*!< general purpose partition 3 */
+    SDEMMC_PART_GP4 = 7,        /*!< general purpose partition 4 */
+} sdEmmc_part_t;
+
+/**
+ * Decoded values from SD Status Register
+ */
+typedef struct {
+    uint32_t alloc_unit_kb;                 /*!< allocation unit (AU) size, in KB; 0 if not reported */
+    SDEMMC_U32(uint16_t) erase_size_au;     /*!< number of AUs erased within erase_timeout */
+    SDEMMC_U32(uint8_t) erase_timeout;      /*!< timeout of erasing erase_size_au AUs, in seconds */
+    SDEMMC_U32(uint8_t) erase_offset;       /*!< fixed offset added to the erase timeout, in seconds */
+    SDEMMC_U32(uint8_t) speed_class;        /*!< speed class: 0 (not reported), 2, 4, 6 or 10 */
+    SDEMMC_U32(uint8_t) uhs_speed_grade;    /*!< UHS speed grade: 0, 1 or 3 */
+} sdmmc_ssr_t;
+
+/**
+ * Data timeouts of the card, derived from CSD, EXT_CSD and SSR at init
+ */
+typedef struct {
+    uint32_t cmd_ms;            /*!< timeout of commands without data transfer or busy signaling */
+    uint32_t read_ms;           /*!< worst case access time of a read block */
+    uint32_t write_ms;          /*!< worst case programming (busy) time of a written block */
+    uint32_t erase_ms;          /*!< worst case erase time of erase_unit_sectors sectors */
+    uint32_t erase_offset_ms;   /*!< fixed time added to each erase */
+    uint32_t erase_unit_sectors; /*!< erase_ms applies to this many sectors */
+} sdmmc_timeouts_t;
+
+/**
+ * Transfer sizes measured by sdEmmc_tune; 0 until it has run
+ */
+typedef struct {
+    uint32_t read_min_sectors;  /*!< smallest read reaching 90% of the best read throughput */
+    uint32_t write_min_sectors; /*!< smallest write reaching 90% of the best write throughput; until measured, the quirks' write_chunk_sectors */
+    uint32_t align_sectors;     /*!< alignment writes of write_min_sectors need to keep that throughput */
+    uint32_t read_kbps;         /*!< best read throughput measured, in KB/s */
+    uint32_t write_kbps;        /*!< best write throughput measured, in KB/s */
+} sdmmc_tuning_t;
+
+/**
+ * Per-model settings of the card, from the quirks table entry matching its CID
+ */
+typedef struct {
+    uint32_t flags;             /*!< SDEMMC_QUIRK_* */
+#define SDEMMC_QUIRK_NO_CMD23   BIT(0)      /*!< don't bound multi-block transfers with SET_BLOCK_COUNT (CMD23) */
+#define SDEMMC_QUIRK_NO_ACMD23  BIT(1)      /*!< don't pre-erase with SET_WR_BLK_ERASE_COUNT (ACMD23) */
+#define SDEMMC_QUIRK_NO_CACHE   BIT(2)      /*!< don't enable the eMMC cache */
+#define SDEMMC_QUIRK_NO_TRIM    BIT(3)      /*!< TRIM is advertised but unreliable; erase whole groups */
+    uint32_t max_freq_khz;      /*!< highest reliable clock; 0 for no limit */
+    uint32_t write_chunk_sectors; /*!< preferred write size; 0 if not known */
+    uint32_t busy_poll_us;      /*!< delay between busy polls; 0 to poll back to back */
+    uint32_t min_read_ms;       /*!< lower bound of the read timeout; 0 to follow the CSD */
+} sdmmc_quirks_t;
+
 /**
  * SD/MMC command response buffer
  */
@@ -67,6 +178,14 @@ typedef struct {
     uint32_t data[512 / 8 / sizeof(uint32_t)];  /*!< response data */
 } sdmmc_switch_func_rsp_t;
 
+/**
+ * One segment of a scatter-gather data buffer
+ */
+typedef struct {
+    void* data;                 /*!< DMA capable, word aligned segment buffer */
+    size_t len;                 /*!< segment length in bytes */
+} sdmmc_segment_t;
+
 /**
  * SD/MMC command information
  */
@@ -90,6 +209,8 @@ typedef struct {
 #define SCF_RSP_CRC      0x0400
 #define SCF_RSP_IDX      0x0800
 #define SCF_RSP_PRESENT  0x1000
+#define SCF_NO_AUTO_STOP 0x2000     /*!< leave a multi-block transfer open when the data ends (SDMMC_HOST_FLAG_STREAM hosts only) */
+#define SCF_DATA_ONLY    0x4000     /*!< continue the open transfer with more data, without sending a command (SDMMC_HOST_FLAG_STREAM hosts only) */
 /* response types */
 #define SCF_RSP_R0       0 /*!< none */
 #define SCF_RSP_R1       (SCF_RSP_PRESENT|SCF_RSP_CRC|SCF_RSP_IDX)
@@ -103,6 +224,8 @@ typedef struct {
 #define SCF_RSP_R7       (SCF_RSP_PRESENT|SCF_RSP_CRC|SCF_RSP_IDX)
         esp_err_t error;            /*!< error returned from transfer */
         int timeout_ms;             /*!< response timeout, in milliseconds */
+        const sdmmc_segment_t* segs; /*!< if not NULL, data is transferred from/to these segments instead of data (SDMMC_HOST_FLAG_SG hosts only) */
+        size_t nsegs;               /*!< number of entries in segs */
 } sdmmc_command_t;
 
 /**
@@ -117,6 +240,8 @@ typedef struct {
 #define SDMMC_HOST_FLAG_4BIT    BIT(1)      /*!< host supports 4-line SD and MMC protocol */
 #define SDMMC_HOST_FLAG_8BIT    BIT(2)      /*!< host supports 8-line MMC protocol */
 #define SDMMC_HOST_FLAG_SPI     BIT(3)      /*!< host supports SPI protocol */
+#define SDMMC_HOST_FLAG_SG      BIT(4)      /*!< do_transaction accepts segment lists (sdmmc_command_t::segs) */
+#define SDMMC_HOST_FLAG_STREAM  BIT(5)      /*!< do_transaction accepts SCF_NO_AUTO_STOP and SCF_DATA_ONLY */
 #define SDMMC_HOST_MMC_CARD     BIT(8)      /*!< card in MMC mode (SD otherwise) */
 #define SDMMC_HOST_IO_CARD      BIT(9)      /*!< card in IO mode (SD moe only) */
 #define SDMMC_HOST_MEM_CARD     BIT(10)     /*!< card in memory mode (SD or MMC) */
@@ -129,8 +254,32 @@ typedef struct {
     esp_err_t (*do_transaction)(int slot, sdmmc_command_t* cmdinfo);    /*!< host function to do a transaction */
     esp_err_t (*deinit)(void);  /*!< host function to deinitialize the driver */
     int command_timeout_ms;     /*!< timeout, in milliseconds, of a single command. Set to 0 to use the default value. */
+    int dma_pool_buffers;       /*!< number of DMA buffers allocated for the card at init, 1 to 32. Set to 0 to use the default value. */
 } sdmmc_host_t;
 
+/**
+ * Retry policy of sdEmmc_read_sectors_retry and sdEmmc_write_sectors_retry
+ */
+typedef struct {
+    int retries;                /*!< retries of a failed range, after recovering the card, before it is split in half */
+    uint32_t delay_ms;          /*!< delay before each retry */
+} sdmmc_retry_policy_t;
+
+/**
+ * Pool of DMA capable buffers, allocated once at card init
+ */
+typedef struct {
+    uint8_t* base;              /*!< count * buf_size bytes of DMA capable memory */
+    size_t buf_size;            /*!< size of one buffer, in bytes */
+    uint32_t count;             /*!< number of buffers */
+    uint32_t free_mask;         /*!< bit N is set if buffer N is free */
+} sdmmc_dma_pool_t;
+
+struct sdEmmc_integrity_s;
+struct sdEmmc_clock_s;
+struct sdEmmc_sparse_s;
+struct sdEmmc_journal_s;
+
 /**
  * SD/MMC card information structure
  */
@@ -140,9 +289,58 @@ typedef struct {
     sdmmc_cid_t cid;            /*!< decoded CID (Card IDentification) register value */
     sdmmc_csd_t csd;            /*!< decoded CSD (Card-Specific Data) register value */
     sdmmc_scr_t scr;            /*!< decoded SCR (SD card Configuration Register) value */
+    sdmmc_ssr_t ssr;            /*!< decoded SSR (SD Status Register) value */
+    sdmmc_ext_csd_t ext_csd;    /*!< values from EXT_CSD (MMC only) */
     uint16_t rca;               /*!< RCA (Relative Card Address) */
+    uint8_t part;               /*!< selected hardware partition (sdEmmc_part_t); always SDEMMC_PART_USER on SD cards */
+    uint32_t zero_erase_sectors; /*!< runs of this many zero sectors are erased instead of written; 0 if off (sdEmmc_set_zero_elision) */
+    uint32_t freq_khz;          /*!< card clock frequency in use, in kHz */
+    int bus_width;              /*!< data bus width in use: 1, 4 or 8 */
+    sdmmc_timeouts_t timeouts;  /*!< timeouts used for commands issued to the card */
+    sdmmc_tuning_t tuning;      /*!< efficient transfer sizes, see sdEmmc_tune */
+    sdmmc_quirks_t quirks;      /*!< per-model settings, see sdEmmc_quirks_lookup */
+    sdmmc_dma_pool_t pool;      /*!< buffers used for all driver-internal transfers */
+    struct sdEmmc_integrity_s* integrity; /*!< sector CRC tracking, see sdEmmc_integrity_attach; NULL if disabled */
+    struct sdEmmc_clock_s* clock; /*!< adaptive clock control, see sdEmmc_clock_attach; NULL if disabled */
+    struct sdEmmc_sparse_s* sparse; /*!< written-sector map, see sdEmmc_sparse_attach; NULL if disabled */
+    struct sdEmmc_journal_s* journal; /*!< fallback of sdEmmc_write_sectors_reliable, see sdEmmc_journal_attach; NULL if disabled */
 } sdmmc_card_t;
 
+/**
+ * Direction of a stream
+ */
+typedef enum {
+    SDEMMC_STREAM_READ,
+    SDEMMC_STREAM_WRITE,
+} sdEmmc_stream_dir_t;
+
+/**
+ * Sequential transfer session, see sdEmmc_stream_open
+ */
+typedef struct {
+    sdmmc_card_t* card;         /*!< card the stream transfers to or from */
+    sdEmmc_stream_dir_t dir;    /*!< transfer direction */
+    size_t next_sector;         /*!< sector the next call starts at */
+    bool open;                  /*!< an open-ended CMD18/CMD25 is running */
+    bool busy;                  /*!< last write may still be programming (per-call transfers) */
+    size_t sectors;             /*!< sectors transferred since sdEmmc_stream_open */
+    uint32_t commands;          /*!< read/write commands issued since sdEmmc_stream_open */
+} sdEmmc_stream_t;
+
+/**
+ * Requests merged into one multi-block transfer, see sdEmmc_merge_add
+ */
+typedef struct {
+    bool is_write;              /*!< direction of the merged requests */
+    size_t start_sector;        /*!< first sector of the transfer */
+    size_t sector_count;        /*!< sectors merged so far */
+    size_t max_sectors;         /*!< upper bound of sector_count */
+    size_t sector_size;         /*!< sector size of the card */
+    sdmmc_segment_t* segs;      /*!< buffers of the merged requests; contiguous ones share a segment */
+    size_t nsegs;               /*!< entries of segs in use */
+    size_t max_segs;            /*!< capacity of segs; 1 only merges requests contiguous in memory */
+} sdEmmc_merge_t;
+
 
 
 